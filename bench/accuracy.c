@@ -0,0 +1,217 @@
+/* Accuracy harness: steps the example scenes and prints, as JSON lines,
+ * the cost of the steps next to the conserved quantities of the system, so
+ * that a faster step can be checked against its loss of accuracy. */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <rbphys.h>
+
+#include "scenes.h"
+
+const char *integrators[] = {"euler", "gyro", "rk4"};
+
+#define INTEGRATOR_COUNT 3
+
+/* Conserved quantities of a scene:
+ * P = total linear momentum;
+ * L = total angular momentum about the origin;
+ * E = kinetic plus potential energy, of the attractor and of gravity;
+ * pscale, lscale = sums of the magnitudes of the body momenta, the drifts
+ * are relative to them since the totals may well be zero;
+ */
+typedef struct totals {
+	Vector3 P;
+	Vector3 L;
+	double E;
+	double pscale;
+	double lscale;
+} totals;
+
+double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+void
+usage(void)
+{
+	fprintf(stderr, "usage: accuracy [-s scene] [-i euler|gyro|rk4] "
+	    "[-n bodies] [-t steps] [-e every] [-E energy] [-p depth]\n");
+	exit(1);
+}
+
+totals
+measure(scene *s)
+{
+	totals t = {{0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.0f}, 0.0, 0.0, 0.0};
+	int i;
+
+	for (i = 0; i < s->n; i++) {
+		rbp_body *b = &s->bodies[i];
+		float m = rbp_body_mass(b);
+		if (m == 0.0f) {
+			continue;
+		}
+		Vector3 l = Vector3Add(Vector3CrossProduct(b->pos, b->p), b->L);
+		double r = Vector3Length(b->pos);
+		t.P = Vector3Add(t.P, b->p);
+		t.L = Vector3Add(t.L, l);
+		t.pscale += Vector3Length(b->p);
+		t.lscale += Vector3Length(l);
+		t.E += 0.5*Vector3DotProduct(b->p, b->p)*b->minv;
+		t.E += 0.5*Vector3DotProduct(rbp_w(b), b->L);
+		t.E -= m*Vector3DotProduct(s->w.gravity, b->pos);
+		if (s->attract != 0.0f) {
+			t.E -= s->attract*m/r;
+		}
+	}
+	return t;
+}
+
+/* Deepest contact found by the last step */
+float
+penetration(scene *s)
+{
+	float depth = 0.0f;
+	int i;
+
+	for (i = 0; i < s->w.ncontacts; i++) {
+		depth = fmaxf(depth, s->w.contacts[i].depth);
+	}
+	return depth;
+}
+
+double
+drift(Vector3 a, Vector3 b, double scale)
+{
+	return scale > 0.0 ? Vector3Length(Vector3Subtract(a, b))/scale : 0.0;
+}
+
+/* Runs scene sc with integrator method for steps steps. A sample line is
+ * printed every every steps, then a summary line. Returns 0 if the energy
+ * drift or the penetration went over their budgets. */
+int
+run(int sc, int method, int n, int steps, int every, double ebudget,
+    double pbudget)
+{
+	scene s;
+	double cost = 0.0, dp = 0.0, dl = 0.0, de = 0.0, maxdepth = 0.0;
+	int i;
+
+	if (!scene_init(&s, sc, n)) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	s.w.integrator = method;
+
+	totals t0 = measure(&s);
+	double escale = fmax(fabs(t0.E), 1e-9);
+	for (i = 1; i <= steps; i++) {
+		double t = now();
+		if (!scene_step(&s)) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		t = now() - t;
+		cost += t;
+
+		totals tt = measure(&s);
+		double depth = penetration(&s);
+		dp = fmax(dp, drift(tt.P, t0.P, t0.pscale));
+		dl = fmax(dl, drift(tt.L, t0.L, t0.lscale));
+		de = fmax(de, fabs(tt.E - t0.E)/escale);
+		maxdepth = fmax(maxdepth, depth);
+		if (every > 0 && i % every == 0) {
+			printf("{\"scene\":\"%s\",\"integrator\":\"%s\","
+			    "\"bodies\":%d,\"step\":%d,\"ns_per_body\":%.6g,"
+			    "\"P\":[%.9g,%.9g,%.9g],\"L\":[%.9g,%.9g,%.9g],"
+			    "\"E\":%.9g,\"penetration\":%.6g,\"contacts\":%d}\n",
+			    s.name, integrators[method], n, i, 1e9*t/n,
+			    tt.P.x, tt.P.y, tt.P.z, tt.L.x, tt.L.y, tt.L.z,
+			    tt.E, depth, s.w.ncontacts);
+		}
+	}
+
+	int ok = (ebudget <= 0.0 || de <= ebudget) &&
+	    (pbudget <= 0.0 || maxdepth <= pbudget);
+	printf("{\"scene\":\"%s\",\"integrator\":\"%s\",\"bodies\":%d,"
+	    "\"steps\":%d,\"summary\":true,\"ns_per_body_step\":%.6g,"
+	    "\"momentum_drift\":%.6g,\"angular_momentum_drift\":%.6g,"
+	    "\"energy_drift\":%.6g,\"max_penetration\":%.6g,"
+	    "\"within_budget\":%s}\n",
+	    s.name, integrators[method], n, steps, 1e9*cost/((double) n*steps),
+	    dp, dl, de, maxdepth, ok ? "true" : "false");
+	scene_free(&s);
+	return ok;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int n = 100, steps = 600, every = 60;
+	int sc = -1, method = -1, i, j, opt, ok = 1;
+	double ebudget = 0.0, pbudget = 0.0;
+
+	while ((opt = getopt(argc, argv, "s:i:n:t:e:E:p:")) != -1) {
+		switch (opt) {
+		case 's':
+			if ((sc = scene_find(optarg)) < 0) {
+				usage();
+			}
+			break;
+		case 'i':
+			for (method = 0; method < INTEGRATOR_COUNT; method++) {
+				if (strcmp(integrators[method], optarg) == 0) {
+					break;
+				}
+			}
+			if (method == INTEGRATOR_COUNT) {
+				usage();
+			}
+			break;
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 't':
+			steps = atoi(optarg);
+			break;
+		case 'e':
+			every = atoi(optarg);
+			break;
+		case 'E':
+			ebudget = atof(optarg);
+			break;
+		case 'p':
+			pbudget = atof(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc || n <= 0 || steps <= 0) {
+		usage();
+	}
+
+	for (i = 0; i < SCENE_COUNT; i++) {
+		if (sc >= 0 && i != sc) {
+			continue;
+		}
+		for (j = 0; j < INTEGRATOR_COUNT; j++) {
+			if (method >= 0 && j != method) {
+				continue;
+			}
+			ok &= run(i, j, n, steps, every, ebudget, pbudget);
+		}
+	}
+	return !ok;
+}
@@ -0,0 +1,191 @@
+/* Headless rbphys benchmark: times the world step on the example scenes
+ * scaled to the requested body counts. No window, no libraylib. */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <rbphys.h>
+
+#include "scenes.h"
+
+#define MAX_COUNTS 16
+
+/* step function timed, scene_move with -m */
+int (*step)(scene *s) = scene_step;
+
+double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+void
+usage(void)
+{
+	int i;
+
+	fprintf(stderr, "usage: bench [-s scene] [-n bodies[,bodies...]] "
+	    "[-w warmup] [-t steps] [-r repetitions] [-m] [-p trace.json]\n"
+	    "scenes:");
+	for (i = 0; i < SCENE_COUNT; i++) {
+		fprintf(stderr, " %s", scenes[i].name);
+	}
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+/* Runs one repetition: builds the scene, steps it warmup times untimed,
+ * then steps times timed. Returns the time taken, pairs and contacts are
+ * the totals over the timed steps. */
+double
+repetition(int sc, int n, int warmup, int steps, double *pairs,
+    double *contacts)
+{
+	scene s;
+	double t0, t;
+	int i;
+
+	if (!scene_init(&s, sc, n)) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < warmup; i++) {
+		if (!step(&s)) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+
+	*pairs = 0.0;
+	*contacts = 0.0;
+	t0 = now();
+	for (i = 0; i < steps; i++) {
+		if (!step(&s)) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		*pairs += s.w.npairs;
+		*contacts += s.w.ncontacts;
+	}
+	t = now() - t0;
+	scene_free(&s);
+	return t;
+}
+
+void
+bench(int sc, int n, int warmup, int steps, int reps)
+{
+	double sum = 0.0, sum2 = 0.0, min = INFINITY;
+	double pps = 0.0, cps = 0.0;
+	int r;
+
+	for (r = 0; r < reps; r++) {
+		double pairs, contacts;
+		double t = repetition(sc, n, warmup, steps, &pairs, &contacts);
+		double ns = 1e9*t/((double) n*steps);
+		sum += ns;
+		sum2 += ns*ns;
+		min = ns < min ? ns : min;
+		pps += pairs/t;
+		cps += contacts/t;
+	}
+
+	double mean = sum/reps;
+	double sd = reps > 1 ? sqrt(fmax(0.0, (sum2 - sum*mean)/(reps - 1))) :
+	    0.0;
+	printf("%-20s %8d %10.1f %8.1f %10.1f %12.4g %12.4g\n",
+	    scenes[sc].name, n, mean, sd, min, pps/reps, cps/reps);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int counts[MAX_COUNTS] = {100, 1000};
+	int ncounts = 2;
+	int warmup = 60, steps = 120, reps = 5;
+	int sc = -1, i, j, opt;
+	char *p;
+#ifdef RBP_PROFILE
+	char *trace = NULL;
+#endif
+
+	while ((opt = getopt(argc, argv, "s:n:w:t:r:mp:")) != -1) {
+		switch (opt) {
+		case 's':
+			if ((sc = scene_find(optarg)) < 0) {
+				usage();
+			}
+			break;
+		case 'n':
+			ncounts = 0;
+			for (p = optarg; *p && ncounts < MAX_COUNTS; ) {
+				counts[ncounts] = strtol(p, &p, 10);
+				if (counts[ncounts++] <= 0) {
+					usage();
+				}
+				p += *p == ',';
+			}
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			break;
+		case 't':
+			steps = atoi(optarg);
+			break;
+		case 'r':
+			reps = atoi(optarg);
+			break;
+		case 'm':
+			step = scene_move;
+			break;
+		case 'p':
+#ifdef RBP_PROFILE
+			trace = optarg;
+			break;
+#else
+			fprintf(stderr, "-p needs a build with -DRBP_PROFILE\n");
+			return 1;
+#endif
+		default:
+			usage();
+		}
+	}
+	if (optind < argc || warmup < 0 || steps <= 0 || reps <= 0) {
+		usage();
+	}
+
+	printf("# dt %g, %d warm-up steps, %d timed steps, %d repetitions%s\n",
+	    SCENE_DT, warmup, steps, reps, step == scene_move ?
+	    ", motion only" : "");
+	printf("# rbp_body %d bytes, rbp_body_props %d bytes\n",
+	    (int) sizeof(rbp_body), (int) sizeof(rbp_body_props));
+	printf("%-20s %8s %10s %8s %10s %12s %12s\n", "# scene", "bodies",
+	    "ns/body", "stddev", "min", "pairs/s", "contacts/s");
+	for (i = 0; i < SCENE_COUNT; i++) {
+		if (sc >= 0 && i != sc) {
+			continue;
+		}
+		for (j = 0; j < ncounts; j++) {
+			bench(i, counts[j], warmup, steps, reps);
+		}
+	}
+
+#ifdef RBP_PROFILE
+	if (trace != NULL) {
+		/* the last RBP_PROF_FRAMES steps run */
+		FILE *f = fopen(trace, "w");
+		if (f == NULL || !rbp_prof_export(f) || fclose(f) != 0) {
+			fprintf(stderr, "cannot write %s\n", trace);
+			return 1;
+		}
+	}
+#endif
+	return 0;
+}
@@ -0,0 +1,23 @@
+# rbphys benchmark build configuration
+
+# Only raymath.h is needed, it comes with raylib or on its own
+RAYMATH = ${HOME}/.local/include
+RAYMATH_INC = -I${RAYMATH}
+
+RBPHYS = -I../
+
+INCS = ${RAYMATH_INC} ${RBPHYS}
+LIBS = -lm
+
+# raymath functions are compiled in, there is no libraylib to link
+CPPFLAGS = -DRAYMATH_STATIC_INLINE
+
+# uncomment to time the step phases, see ../rbp-prof.h and bench -p
+#CPPFLAGS += -DRBP_PROFILE
+
+# measure optimized code
+OPT = -O2
+
+CFLAGS = -std=c99 -pedantic -Wall -Wno-deprecated-declarations ${OPT} ${INCS} ${CPPFLAGS}
+LDFLAGS = ${LIBS}
+CC = cc
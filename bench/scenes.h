@@ -0,0 +1,348 @@
+/* Headless versions of the example scenes, scaled to any number of bodies.
+ * Shared by the programs in bench/, they need nothing but rbphys.h and
+ * raymath.h. */
+
+#include <string.h>
+
+#define SCENE_DT (1.0f/60.0f)
+
+/* Scene data type:
+ * name = example the scene is modeled after;
+ * w = world holding every body;
+ * n, bodies, props, colliders = bodies of the scene, the static ones
+ * included, with their properties apart as in rbp_pool;
+ * attract = acceleration towards the origin at unit distance, falling
+ * with the squared distance, 0 for none;
+ * seed = state of scene_rand;
+ * sun, slab, ground = static shapes of the scene;
+ * heights = samples of ground;
+ */
+typedef struct scene {
+	const char *name;
+	rbp_world w;
+	int n;
+	rbp_body *bodies;
+	rbp_body_props *props;
+	rbp_collider *colliders;
+	float attract;
+	unsigned int seed;
+
+	rbp_shape_sphere sun;
+	rbp_shape_cuboid slab;
+	rbp_shape_heightmap ground;
+	float *heights;
+} scene;
+
+typedef void (*scene_setup)(scene *s, int n);
+
+/* Shapes of the dynamic bodies */
+rbp_shape_sphere scene_ball = {SPHERE, 0, 1.0f};
+rbp_shape_sphere scene_pebble = {SPHERE, 0, 0.2f};
+rbp_shape_cuboid scene_box = {CUBOID, 0, {0.0f, 0.0f, 0.0f, 1.0f},
+    1.5f, 1.5f, 1.5f};
+
+int scene_material = -1;
+
+/* Returns a pseudo random number in [0, 1) */
+float
+scene_rand(scene *s)
+{
+	s->seed = s->seed*1103515245u + 12345u;
+	return (float) ((s->seed >> 8) & 0xffffff) / 16777216.0f;
+}
+
+/* Returns a pseudo random vector in [-a, a)^3 */
+Vector3
+scene_rand_vector(scene *s, float a)
+{
+	float x = (2.0f*scene_rand(s) - 1.0f)*a;
+	float y = (2.0f*scene_rand(s) - 1.0f)*a;
+	float z = (2.0f*scene_rand(s) - 1.0f)*a;
+	return (Vector3) {x, y, z};
+}
+
+/* Body space inertia tensor of a sphere or cuboid of mass m */
+Matrix
+scene_inertia(void *shape, float m)
+{
+	rbp_shape *sh = shape;
+
+	if (sh->shape_type == SPHERE) {
+		rbp_shape_sphere *sp = shape;
+		float I = 0.4f*m*sp->radius*sp->radius;
+		return MatrixScale(I, I, I);
+	}
+	rbp_shape_cuboid *cb = shape;
+	float x2 = cb->xsize*cb->xsize;
+	float y2 = cb->ysize*cb->ysize;
+	float z2 = cb->zsize*cb->zsize;
+	return MatrixScale(m*(y2 + z2)/12.0f, m*(x2 + z2)/12.0f,
+	    m*(x2 + y2)/12.0f);
+}
+
+/* Adds a body with the given shape and mass at pos, resting. m = 0 makes a
+ * static body. */
+rbp_body *
+scene_body(scene *s, void *shape, float m, Vector3 pos)
+{
+	rbp_body *b = &s->bodies[s->n];
+	rbp_body_props *props = &s->props[s->n];
+	rbp_collider *c = &s->colliders[s->n];
+
+	memset(b, 0, sizeof(*b));
+	props->m = m;
+	props->Ib = scene_inertia(shape, m);
+	b->pos = pos;
+	b->dir = QuaternionIdentity();
+	rbp_collider_init(c, shape, Vector3Zero(), scene_material);
+	props->collider = c;
+	b->props = props;
+	rbp_calculate_properties(b);
+	rbp_world_add(&s->w, b);
+	s->n++;
+	return b;
+}
+
+/* Side of the smallest cubic lattice with n points farther than hole from
+ * its center */
+int
+scene_side(int n, float spacing, float hole)
+{
+	int side, i, j, k, count;
+
+	for (side = 1; ; side++) {
+		float c = 0.5f*(side - 1);
+		count = 0;
+		for (i = 0; i < side; i++)
+		for (j = 0; j < side; j++)
+		for (k = 0; k < side; k++) {
+			Vector3 d = {i - c, j - c, k - c};
+			count += Vector3Length(d)*spacing >= hole;
+		}
+		if (count >= n) {
+			return side;
+		}
+	}
+}
+
+/* Adds n bodies on the cubic lattice of scene_side centered on center,
+ * every other one with shape2. They get a random velocity and spin of up to
+ * jitter. */
+void
+scene_lattice(scene *s, int n, void *shape1, void *shape2, float m,
+    float spacing, Vector3 center, float hole, float jitter)
+{
+	int side = scene_side(n, spacing, hole);
+	float c = 0.5f*(side - 1);
+	int i, j, k, added = 0;
+
+	for (j = 0; j < side; j++)
+	for (i = 0; i < side; i++)
+	for (k = 0; k < side; k++) {
+		Vector3 d = {(i - c)*spacing, (j - c)*spacing, (k - c)*spacing};
+		if (added == n || Vector3Length(d) < hole) {
+			continue;
+		}
+		void *shape = added % 2 ? shape2 : shape1;
+		rbp_body *b = scene_body(s, shape, m, Vector3Add(center, d));
+		b->p = Vector3Scale(scene_rand_vector(s, jitter), m);
+		b->L = MatrixVector3Multiply(rbp_body_inertia(b),
+		    scene_rand_vector(s, jitter));
+		added++;
+	}
+}
+
+/* orbit.c: small bodies on circular orbits of random radius and plane
+ * around an attractor at the origin */
+void
+scene_orbit(scene *s, int n)
+{
+	float rmax = 12.0f + 4.0f*cbrtf(n);
+	int i;
+
+	s->attract = 1600.0f;
+	for (i = 0; i < n; i++) {
+		float r = 12.0f + (rmax - 12.0f)*scene_rand(s);
+		Vector3 u = Vector3Normalize(scene_rand_vector(s, 1.0f));
+		Vector3 t = Vector3CrossProduct(u, scene_rand_vector(s, 1.0f));
+		rbp_body *b = scene_body(s, &scene_pebble, 1.0f,
+		    Vector3Scale(u, r));
+		b->p = Vector3Scale(Vector3Normalize(t), sqrtf(s->attract/r));
+		b->L = (Vector3) {0.0f, -0.1f, 0.0f};
+	}
+}
+
+/* collide_sphere.c: balls falling onto a static sphere */
+void
+scene_collide_sphere(scene *s, int n)
+{
+	s->attract = 1600.0f;
+	s->sun = (rbp_shape_sphere) {SPHERE, 0, 5.0f};
+	scene_body(s, &s->sun, 0.0f, Vector3Zero());
+	scene_lattice(s, n, &scene_ball, &scene_ball, 0.1f, 3.0f,
+	    Vector3Zero(), 8.0f, 1.0f);
+}
+
+/* collide_cube.c: balls and boxes falling onto a static cube */
+void
+scene_collide_cube(scene *s, int n)
+{
+	s->attract = 1600.0f;
+	s->slab = (rbp_shape_cuboid) {CUBOID, 0, QuaternionIdentity(),
+	    10.0f, 10.0f, 10.0f};
+	scene_body(s, &s->slab, 0.0f, Vector3Zero());
+	scene_lattice(s, n, &scene_ball, &scene_box, 1.0f, 3.0f,
+	    Vector3Zero(), 10.0f, 1.0f);
+}
+
+/* collide_static_cube.c: rolling balls dropped on a static slab under
+ * gravity */
+void
+scene_collide_static_cube(scene *s, int n)
+{
+	float spacing = 2.5f;
+	int side = scene_side(n, spacing, 0.0f);
+	float half = 0.5f*(side - 1)*spacing;
+
+	s->w.gravity = (Vector3) {0.0f, -9.8f, 0.0f};
+	s->slab = (rbp_shape_cuboid) {CUBOID, 0, QuaternionIdentity(),
+	    2.0f*half + 40.0f, 2.0f, 2.0f*half + 40.0f};
+	scene_body(s, &s->slab, 0.0f, (Vector3) {0.0f, -1.0f, 0.0f});
+	scene_lattice(s, n, &scene_ball, &scene_ball, 1.0f, spacing,
+	    (Vector3) {0.0f, 1.5f + half, 0.0f}, 0.0f, 0.5f);
+}
+
+/* heightmap.c: balls and boxes dropped on a bumpy heightmap under
+ * gravity */
+void
+scene_heightmap(scene *s, int n)
+{
+	float spacing = 2.5f;
+	int side = scene_side(n, spacing, 0.0f);
+	float half = 0.5f*(side - 1)*spacing;
+	float size = 2.0f*half + 40.0f;
+	int res = 64, i, j;
+
+	s->w.gravity = (Vector3) {0.0f, -9.8f, 0.0f};
+	s->heights = malloc(res*res*sizeof(*s->heights));
+	for (j = 0; j < res; j++) {
+		for (i = 0; i < res; i++) {
+			s->heights[j*res + i] = 0.5f + 0.25f*sinf(0.4f*i) +
+			    0.25f*cosf(0.3f*j);
+		}
+	}
+	rbp_heightmap_init(&s->ground, res, res, size, 4.0f, size, s->heights);
+	scene_body(s, &s->ground, 0.0f,
+	    (Vector3) {-0.5f*size, -4.0f, -0.5f*size});
+	scene_lattice(s, n, &scene_ball, &scene_box, 1.0f, spacing,
+	    (Vector3) {0.0f, 1.5f + half, 0.0f}, 0.0f, 0.5f);
+}
+
+/* Scene table, in the order of the examples */
+struct {
+	const char *name;
+	scene_setup setup;
+} scenes[] = {
+	{"orbit", scene_orbit},
+	{"collide_sphere", scene_collide_sphere},
+	{"collide_cube", scene_collide_cube},
+	{"collide_static_cube", scene_collide_static_cube},
+	{"heightmap", scene_heightmap},
+};
+
+#define SCENE_COUNT ((int) (sizeof(scenes)/sizeof(scenes[0])))
+
+/* Returns the index of the scene called name, -1 if there is none */
+int
+scene_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < SCENE_COUNT; i++) {
+		if (strcmp(scenes[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Builds scene number i with n dynamic bodies, returns 0 if out of
+ * memory */
+int
+scene_init(scene *s, int i, int n)
+{
+	memset(s, 0, sizeof(*s));
+	if (scene_material < 0) {
+		scene_material = rbp_material_add(0.90f, 0.4f, 0.3f);
+	}
+	s->name = scenes[i].name;
+	s->seed = 1;
+	rbp_world_init(&s->w);
+	s->bodies = malloc((n + 1)*sizeof(*s->bodies));
+	s->props = malloc((n + 1)*sizeof(*s->props));
+	s->colliders = malloc((n + 1)*sizeof(*s->colliders));
+	if (s->bodies == NULL || s->props == NULL || s->colliders == NULL ||
+	    !rbp_world_reserve(&s->w, n + 1)) {
+		return 0;
+	}
+	scenes[i].setup(s, n);
+	return 1;
+}
+
+void
+scene_free(scene *s)
+{
+	int i;
+
+	for (i = 0; i < s->n; i++) {
+		rbp_collider_release(&s->colliders[i]);
+	}
+	rbp_world_free(&s->w);
+	free(s->bodies);
+	free(s->props);
+	free(s->colliders);
+	free(s->heights);
+	s->n = 0;
+}
+
+/* Adds the pull of the attractor to the bodies of s */
+void
+scene_attract(scene *s)
+{
+	int i;
+
+	if (s->attract != 0.0f) {
+		for (i = 0; i < s->n; i++) {
+			rbp_body *b = &s->bodies[i];
+			if (b->minv == 0.0f) {
+				continue;
+			}
+			float r2 = Vector3DotProduct(b->pos, b->pos);
+			float a = -s->attract/(b->minv*r2*sqrtf(r2));
+			rbp_add_force(b, Vector3Scale(b->pos, a), b->pos);
+		}
+	}
+}
+
+/* Advances the scene by one step of SCENE_DT, returns 0 if out of memory */
+int
+scene_step(scene *s)
+{
+	scene_attract(s);
+	return rbp_world_step(&s->w, SCENE_DT);
+}
+
+/* Advances the scene by one step of SCENE_DT without collisions: only the
+ * per body work of a step, forces, integration and motion */
+int
+scene_move(scene *s)
+{
+	int i;
+
+	scene_attract(s);
+	for (i = 0; i < s->w.nbodies; i++) {
+		rbp_integrate(s->w.bodies[i], s->w.gravity, SCENE_DT);
+	}
+	rbp_update_bodies(s->w.bodies, s->w.nbodies, s->w.integrator, SCENE_DT);
+	return 1;
+}
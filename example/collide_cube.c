@@ -20,41 +20,43 @@ int main()
 	planet_model.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = texture;
 	sun_model.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = texture;
 
+	rbp_body_props planet_props;
 	rbp_body planet;
-	planet.m = 1.0f;
-	planet.Ib = MatrixIdentity();
+	planet.props = &planet_props;
+	planet_props.m = 1.0f;
+	planet_props.Ib = MatrixIdentity();
 	planet.pos = (Vector3) {5.6f, 0.0f, 4.5f};
 	planet.p = Vector3Zero();
 	planet.dir = QuaternionIdentity();
 	planet.L = (Vector3) {0.0f, 0.0f, 0.0f};
-	rbp_collider_sphere planet_collider ={
-		SPHERE,
-		{0.0f, 0.0f, 0.0f},
-		0.90f,
-		0.4f,
-		0.3f,
-		1.0f};
-	planet.collider = &planet_collider;
+	rbp_shape_sphere planet_shape = {SPHERE, 0, 1.0f};
+	int material = rbp_material_add(0.90f, 0.4f, 0.3f);
+	rbp_collider planet_collider;
+	rbp_collider_init(&planet_collider, &planet_shape,
+		(Vector3) {0.0f, 0.0f, 0.0f}, material);
+	planet_props.collider = &planet_collider;
 	rbp_calculate_properties(&planet);
 
+	rbp_body_props sun_props;
 	rbp_body sun;
-	sun.m = 10.0f;
-	sun.Ib = MatrixScale(100.0f, 100.0f, 100.0f);
+	sun.props = &sun_props;
+	sun_props.m = 10.0f;
+	sun_props.Ib = MatrixScale(100.0f, 100.0f, 100.0f);
 	sun.pos = Vector3Zero();
 	sun.p = Vector3Zero();
 	sun.dir = QuaternionIdentity();
 	sun.L = (Vector3) {0.0f, 0.0f, 0.0f};
-	rbp_collider_cuboid sun_collider = {
+	rbp_shape_cuboid sun_shape = {
 		CUBOID,
-		{0.0f,0.0f,0.0f},
-		0.90f,
-		0.4f,
-		0.3f,
+		0,
 		QuaternionIdentity(),
 		10.0f,
 		10.0f,
 		10.0f};
-	sun.collider = &sun_collider;
+	rbp_collider sun_collider;
+	rbp_collider_init(&sun_collider, &sun_shape,
+		(Vector3) {0.0f, 0.0f, 0.0f}, material);
+	sun_props.collider = &sun_collider;
 	rbp_calculate_properties(&sun);
 
 	Camera3D camera = { 0 };
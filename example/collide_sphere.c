@@ -20,50 +20,57 @@ int main()
 	planet_model.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = texture;
 	sun_model.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = texture;
 
+	rbp_body_props planet_props;
 	rbp_body planet;
-	planet.m = 0.1f;
-	planet.Ib = MatrixScale(0.1f, 0.1f, 0.1f);
+	planet.props = &planet_props;
+	planet_props.m = 0.1f;
+	planet_props.Ib = MatrixScale(0.1f, 0.1f, 0.1f);
 	planet.pos = (Vector3) {10.0f, 0.0f, -9.0f};
 	planet.p = (Vector3) {0.0f, 0.0f, 0.5f};
 	planet.dir = QuaternionIdentity();
 	planet.L = (Vector3) {0.0f, 0.0f, 0.0f};
-	rbp_collider_sphere planet_collider = {
-		SPHERE,
-		{0.0f, 0.0f, 0.0f},
-		0.99f,
-		0.20f,
-		0.10f,
-		1.0f};
-	planet.collider = &planet_collider;
+	rbp_shape_sphere planet_shape = {SPHERE, 0, 1.0f};
+	int material = rbp_material_add(0.99f, 0.20f, 0.10f);
+	rbp_collider planet_collider;
+	rbp_collider_init(&planet_collider, &planet_shape,
+		(Vector3) {0.0f, 0.0f, 0.0f}, material);
+	planet_props.collider = &planet_collider;
 	rbp_calculate_properties(&planet);
 
+	rbp_body_props sun_props;
 	rbp_body sun;
-	sun.m = 10.0f;
-	sun.Ib = MatrixScale(10.0f, 10.0f, 10.0f);
+	sun.props = &sun_props;
+	sun_props.m = 10.0f;
+	sun_props.Ib = MatrixScale(10.0f, 10.0f, 10.0f);
 	sun.pos = (Vector3) {0.0f, 0.0f, -10.0f};
 	sun.p = (Vector3) {0.0f, 0.0f, -0.5f};
 	sun.dir = QuaternionIdentity();
 	sun.L = Vector3Zero();
-	rbp_collider_sphere sun_collider = {
-		SPHERE,
-		{0.0f, 0.0f, 0.0f}, 
-		0.99f, 
-		0.20f, 
-		0.10f, 
-		5.0f};
-	sun.collider = &sun_collider;
+	rbp_shape_sphere sun_shape = {SPHERE, 0, 5.0f};
+	rbp_collider sun_collider;
+	rbp_collider_init(&sun_collider, &sun_shape,
+		(Vector3) {0.0f, 0.0f, 0.0f}, material);
+	sun_props.collider = &sun_collider;
 	rbp_calculate_properties(&sun);
 
 	Vector3 offset = (Vector3) {0.0f, 0.0f, 20.0f};
+	rbp_body_props planet2_props = planet_props;
 	rbp_body planet2 = planet;
+	planet2.props = &planet2_props;
 	planet2.pos = Vector3Add(planet2.pos, offset);
-	rbp_collider_sphere planet2_collider = planet_collider;
-	planet2.collider = &planet2_collider;
+	rbp_collider planet2_collider;
+	rbp_collider_init(&planet2_collider, &planet_shape,
+		planet_collider.offset, planet_collider.material);
+	planet2_props.collider = &planet2_collider;
 
+	rbp_body_props sun2_props = sun_props;
 	rbp_body sun2 = sun;
+	sun2.props = &sun2_props;
 	sun2.pos = Vector3Add(sun2.pos, offset);
-	rbp_collider_sphere sun2_collider = sun_collider;
-	sun2.collider = &sun2_collider;
+	rbp_collider sun2_collider;
+	rbp_collider_init(&sun2_collider, &sun_shape, sun_collider.offset,
+		sun_collider.material);
+	sun2_props.collider = &sun2_collider;
 
 	int trj1_max = 4096;
 	unsigned int trj1_counter = 0;
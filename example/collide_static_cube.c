@@ -20,21 +20,23 @@ int main()
 	ball_model.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = texture;
 	slab_model.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = texture;
 
+	rbp_body_props ball_props;
 	rbp_body ball;
-	ball.m = 1.0f;
-	ball.Ib = MatrixIdentity();
+	ball.props = &ball_props;
+	ball_props.m = 1.0f;
+	ball_props.Ib = MatrixIdentity();
 	ball.pos = (Vector3) {0.0f, 1.1f, -9.0f};
 	ball.p = (Vector3) {0.0f, 0.0f, 16.0f};
 	ball.dir = QuaternionIdentity();
 	ball.L = (Vector3) {-16.0f, 0.0f, 0.0f};
-	rbp_collider_sphere ball_collider ={
-		.collider_type = SPHERE,
-		.offset = (Vector3) {0.0f, 0.0f, 0.0f},
-		.e = 0.90f,
-		.uf_s = 0.6f,
-		.uf_d = 0.3f,
+	rbp_shape_sphere ball_shape = {
+		.shape_type = SPHERE,
 		.radius = 1.0f};
-	ball.collider = &ball_collider;
+	rbp_collider ball_collider = {
+		.shape = rbp_shape_retain(&ball_shape),
+		.offset = (Vector3) {0.0f, 0.0f, 0.0f},
+		.material = rbp_material_add(0.90f, 0.6f, 0.3f)};
+	ball_props.collider = &ball_collider;
 	rbp_calculate_properties(&ball);
 
 	rbp_body ball1 = ball;
@@ -48,23 +50,25 @@ int main()
 
 	rbp_body *balls[] = {&ball, &ball1, &ball2};
 
+	rbp_body_props slab_props;
 	rbp_body slab;
-	slab.m = 0.0f; /* static body */
+	slab.props = &slab_props;
+	slab_props.m = 0.0f; /* static body */
 	slab.pos = (Vector3) {0.0f, -1.0f, 0.0f};
 	slab.p = Vector3Zero();
 	slab.dir = QuaternionIdentity();
 	slab.L = (Vector3) {0.0f, 0.0f, 0.0f};
-	rbp_collider_cuboid slab_collider = {
-		.collider_type = CUBOID,
-		.offset = (Vector3) {0.0f,0.0f,0.0f},
-		.e = 0.90f,
-		.uf_s = 1.0f,
-		.uf_d = 1.0f,
+	rbp_shape_cuboid slab_shape = {
+		.shape_type = CUBOID,
 		.dir = QuaternionIdentity(),
 		.xsize = 50.0f,
 		.ysize = 2.0f,
 		.zsize = 50.0f};
-	slab.collider = &slab_collider;
+	rbp_collider slab_collider = {
+		.shape = rbp_shape_retain(&slab_shape),
+		.offset = (Vector3) {0.0f,0.0f,0.0f},
+		.material = rbp_material_add(0.90f, 1.0f, 1.0f)};
+	slab_props.collider = &slab_collider;
 	rbp_calculate_properties(&slab);
 
 	Camera3D camera = { 0 };
@@ -18,13 +18,19 @@ int main()
 	Model cube_model = LoadModelFromMesh(GenMeshCube(1.0f, 1.0f, 1.0f));
 	cube_model.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = texture;
 
+	rbp_body_props cube_props;
 	rbp_body cube;
+	cube.props = &cube_props;
+	cube_props.m = 1.0f;
+	cube_props.Ib = MatrixIdentity();
+	cube_props.collider = NULL;
 	cube.minv = 1.0f;
 	cube.Ibinv = MatrixIdentity();
 	cube.pos = (Vector3) {0.0f, 0.0f, 0.0f};
 	cube.p = (Vector3) {0.0f, 0.0f, 0.0f};
 	cube.dir = QuaternionFromAxisAngle((Vector3) {0.0f, 0.0f, 1.0f}, PI*0.1);
 	cube.L = (Vector3) {0.0f, 0.0f, 0.0f};
+	rbp_clear_forces(&cube);
 
 	Camera3D camera = { 0 };
 	camera.position = Vector3Add(cube.pos, (Vector3) {-1.0f, 2.0f, -5.0f});
@@ -41,31 +47,28 @@ int main()
 		/* Input */
 		if (IsKeyDown(KEY_L)) {
 			/* Increase angular momentum */
-			rbp_bspace_force(
+			rbp_add_bforce(
 			    &cube,
 			    (Vector3) {1.0f, 0.0f, 0.0f},
-			    (Vector3) {0.0f, 0.0f, 1.0f},
-			    dt);
-			rbp_bspace_force(
+			    (Vector3) {0.0f, 0.0f, 1.0f});
+			rbp_add_bforce(
 			    &cube,
 			    (Vector3) {-1.0f, 0.0f, 0.0f},
-			    (Vector3) {0.0f, 0.0f, -1.0f},
-			    dt);
+			    (Vector3) {0.0f, 0.0f, -1.0f});
 		}
 		if (IsKeyDown(KEY_K)) {
 			/* Simulate top contact point */
-			rbp_wspace_force(
+			rbp_add_force(
 			    &cube,
 			    (Vector3) {0.0f, 10.0f, 0.0f},
-			    rbp_wtobspace(&cube, (Vector3) {0.0f, -1.0f, 0.0f}),
-			    dt);
+			    rbp_wtobspace(&cube, (Vector3) {0.0f, -1.0f, 0.0f}));
 
 			/* Simulate gravity */
-			rbp_wspace_force(&cube,
+			rbp_add_force(&cube,
 			    (Vector3) {0.0f, -10.0f, 0.0f},
-			    cube.pos,
-			    dt);
+			    cube.pos);
 		}
+		rbp_integrate(&cube, Vector3Zero(), dt);
 
 		/* Update physics */
 		now = GetTime();
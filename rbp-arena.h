@@ -0,0 +1,156 @@
+/* Frame arena for rbphys, included by rbphys.h. A bump allocator for the
+ * data that only lives for one step (pairs, contacts, solver scratch),
+ * thrown away all at once by rbp_arena_reset. Overflow during a step is
+ * served from the heap and the arena is resized to the high water mark at
+ * the next reset, so a step that is about as busy as the previous ones
+ * allocates nothing. An arena belongs to one thread, give every thread
+ * stepping a world its own.
+ */
+
+/* Initial size in bytes of an arena */
+#ifndef RBP_ARENA_SIZE
+#define RBP_ARENA_SIZE (64*1024)
+#endif
+
+/* Alignment of every allocation */
+#define RBP_ARENA_ALIGN 16
+#define RBP_ARENA_ROUND(n) \
+	(((n) + RBP_ARENA_ALIGN - 1) & ~(size_t) (RBP_ARENA_ALIGN - 1))
+
+/* Heap block holding an allocation that did not fit, data follows the
+ * header */
+typedef struct rbp_arena_chunk {
+	struct rbp_arena_chunk *next;
+	size_t size;
+} rbp_arena_chunk;
+
+#define RBP_ARENA_HEADER RBP_ARENA_ROUND(sizeof(rbp_arena_chunk))
+
+/* Arena data type:
+ * mem, size = block allocations are bumped from;
+ * used = bytes of mem in use;
+ * wanted = bytes asked for since the last reset, mem grows to it;
+ * chunks = overflow blocks, latest first;
+ * last = last allocation, the only one that can grow in place;
+ * last_chunk = whether last is the data of chunks instead of in mem;
+ */
+typedef struct rbp_arena {
+	char *mem;
+	size_t size;
+	size_t used;
+	size_t wanted;
+	rbp_arena_chunk *chunks;
+	char *last;
+	int last_chunk;
+} rbp_arena;
+
+void
+rbp_arena_init(rbp_arena *a)
+{
+	a->mem = NULL;
+	a->size = 0;
+	a->used = 0;
+	a->wanted = RBP_ARENA_SIZE;
+	a->chunks = NULL;
+	a->last = NULL;
+	a->last_chunk = 0;
+}
+
+/* Drops every allocation of a in O(1), unless the last step overflowed:
+ * the overflow blocks are then freed and mem is resized to fit them all */
+void
+rbp_arena_reset(rbp_arena *a)
+{
+	while (a->chunks != NULL) {
+		rbp_arena_chunk *next = a->chunks->next;
+		free(a->chunks);
+		a->chunks = next;
+	}
+	if (a->wanted > a->size) {
+		size_t size = a->size ? 2*a->size : a->wanted;
+		while (size < a->wanted) {
+			size *= 2;
+		}
+		char *mem = malloc(size);
+		if (mem != NULL) {
+			free(a->mem);
+			a->mem = mem;
+			a->size = size;
+		}
+	}
+	a->used = 0;
+	a->wanted = 0;
+	a->last = NULL;
+	a->last_chunk = 0;
+}
+
+void
+rbp_arena_free(rbp_arena *a)
+{
+	a->wanted = 0;
+	rbp_arena_reset(a);
+	free(a->mem);
+	rbp_arena_init(a);
+}
+
+/* Returns size bytes valid until the next reset of a, or NULL if out of
+ * memory */
+void *
+rbp_arena_alloc(rbp_arena *a, size_t size)
+{
+	size = RBP_ARENA_ROUND(size);
+	a->wanted += size;
+	if (a->used + size <= a->size) {
+		a->last = a->mem + a->used;
+		a->last_chunk = 0;
+		a->used += size;
+		return a->last;
+	}
+
+	rbp_arena_chunk *c = malloc(RBP_ARENA_HEADER + size);
+	if (c == NULL) {
+		return NULL;
+	}
+	c->next = a->chunks;
+	c->size = size;
+	a->chunks = c;
+	a->last = (char *) c + RBP_ARENA_HEADER;
+	a->last_chunk = 1;
+	return a->last;
+}
+
+/* Resizes allocation p of a from old to size bytes and returns it, maybe
+ * moved. The last allocation grows in place when there is room. Returns
+ * NULL if out of memory, leaving p as it was. */
+void *
+rbp_arena_resize(rbp_arena *a, void *p, size_t old, size_t size)
+{
+	void *q;
+
+	old = RBP_ARENA_ROUND(old);
+	size = RBP_ARENA_ROUND(size);
+	if (p != NULL && p == a->last && !a->last_chunk &&
+	    (size_t) (a->last - a->mem) + size <= a->size) {
+		a->used = (a->last - a->mem) + size;
+		a->wanted = a->wanted - old + size;
+		return p;
+	}
+	if (p != NULL && p == a->last && a->last_chunk) {
+		rbp_arena_chunk *c = realloc(a->chunks,
+		    RBP_ARENA_HEADER + size);
+		if (c == NULL) {
+			return NULL;
+		}
+		c->size = size;
+		a->chunks = c;
+		a->last = (char *) c + RBP_ARENA_HEADER;
+		a->wanted = a->wanted - old + size;
+		return a->last;
+	}
+
+	q = rbp_arena_alloc(a, size);
+	if (q != NULL && p != NULL) {
+		memcpy(q, p, old < size ? old : size);
+	}
+	return q;
+}
@@ -13,23 +13,14 @@ typedef struct rbp_simplex {
 	Vector3 D;
 } rbp_simplex;
 
-/* Defining some macros to ease typing */
-#define NEG(d) Vector3Negate(d)
-#define SUB(a, b) Vector3Subtract(a, b);
-#define DOT(a, b) Vector3DotProduct(a, b)
-#define X(a, b) Vector3CrossProduct(a, b)
-#define X3(a, b) Vector3CrossProduct(Vector3CrossProduct(a, b), a)
+/* Maximum number of iterations of rbp_gjk_distance */
+#ifndef RBP_GJK_ITERATIONS
+#define RBP_GJK_ITERATIONS 32
+#endif
 
-/* Calls the support-mappings from each body and returns the
- * minkowski difference.
- */
-Vector3
-rbp_support(rbp_body *a, rbp_body *b, Vector3 d)
-{
-	Vector3 sa = a->support(a, d);
-	Vector3 sb = b->support(b, NEG(d));
-	return Vector3Subtract(sa, sb);
-}
+/* Defining some macros to ease typing (NEG, DOT and X come from rbphys.h) */
+#define SUB(a, b) Vector3Subtract(a, b)
+#define X3(a, b) Vector3CrossProduct(Vector3CrossProduct(a, b), a)
 
 /* Checks at which side of the line (1-simplex) the origin resides. */
 int
@@ -207,9 +198,175 @@ rbp_gjk(rbp_body *b1, rbp_body *b2, Vector3 *sepnorm)
 	}
 }
 
+/* Finds the point of the simplex w (n points) closest to the origin and
+ * writes it to v. The simplex is reduced to the smallest feature holding v,
+ * returns its new size, 4 if the origin is inside the tetrahedron. */
+int
+rbp_simplex_closest(Vector3 *w, int n, Vector3 *v)
+{
+	Vector3 a = w[0];
+	Vector3 b = w[1];
+	Vector3 c = w[2];
+
+	switch (n) {
+	case 1:
+		*v = a;
+		return 1;
+
+	case 2: {
+		Vector3 ab = SUB(b, a);
+		float t = -DOT(a, ab);
+		if (t <= 0.0f) {
+			*v = a;
+			return 1;
+		}
+		if (t >= DOT(ab, ab)) {
+			w[0] = b;
+			*v = b;
+			return 1;
+		}
+		*v = Vector3Add(a, Vector3Scale(ab, t / DOT(ab, ab)));
+		return 2;
+	}
+
+	case 3: {
+		/* Voronoi regions of the triangle, as in
+		 * rbp_closest_triangle_point */
+		Vector3 ab = SUB(b, a);
+		Vector3 ac = SUB(c, a);
+		float d1 = -DOT(ab, a);
+		float d2 = -DOT(ac, a);
+		if (d1 <= 0.0f && d2 <= 0.0f) {
+			*v = a;
+			return 1;
+		}
+		float d3 = -DOT(ab, b);
+		float d4 = -DOT(ac, b);
+		if (d3 >= 0.0f && d4 <= d3) {
+			w[0] = b;
+			*v = b;
+			return 1;
+		}
+		float vc = d1*d4 - d3*d2;
+		if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+			*v = Vector3Add(a, Vector3Scale(ab, d1 / (d1 - d3)));
+			return 2;
+		}
+		float d5 = -DOT(ab, c);
+		float d6 = -DOT(ac, c);
+		if (d6 >= 0.0f && d5 <= d6) {
+			w[0] = c;
+			*v = c;
+			return 1;
+		}
+		float vb = d5*d2 - d1*d6;
+		if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+			w[1] = c;
+			*v = Vector3Add(a, Vector3Scale(ac, d2 / (d2 - d6)));
+			return 2;
+		}
+		float va = d3*d6 - d5*d4;
+		if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) {
+			w[0] = c;
+			*v = Vector3Lerp(b, c, (d4 - d3) / ((d4 - d3) + (d5 - d6)));
+			return 2;
+		}
+		float denom = 1.0f / (va + vb + vc);
+		*v = Vector3Add(a, Vector3Add(Vector3Scale(ab, vb*denom),
+		    Vector3Scale(ac, vc*denom)));
+		return 3;
+	}
+
+	case 4: {
+		/* Closest of the faces with the origin on their outer side */
+		static const int faces[4][4] = {
+			{0, 1, 2, 3}, {0, 2, 3, 1}, {0, 3, 1, 2}, {1, 3, 2, 0}
+		};
+		Vector3 best[3];
+		float bestd = FLT_MAX;
+		int bestn = 4;
+		int i;
+
+		for (i = 0; i < 4; i++) {
+			Vector3 f[3] = {w[faces[i][0]], w[faces[i][1]],
+			    w[faces[i][2]]};
+			Vector3 fn = X(SUB(f[1], f[0]), SUB(f[2], f[0]));
+			Vector3 fv;
+			int fcount;
+			if (-DOT(f[0], fn)*DOT(SUB(w[faces[i][3]], f[0]), fn) > 0.0f) {
+				continue;
+			}
+			fcount = rbp_simplex_closest(f, 3, &fv);
+			if (DOT(fv, fv) < bestd) {
+				bestd = DOT(fv, fv);
+				bestn = fcount;
+				*v = fv;
+				best[0] = f[0];
+				best[1] = f[1];
+				best[2] = f[2];
+			}
+		}
+		if (bestn == 4) {
+			*v = Vector3Zero();
+			return 4;
+		}
+		for (i = 0; i < bestn; i++) {
+			w[i] = best[i];
+		}
+		return bestn;
+	}
+
+	default:
+		return 0;
+	}
+}
+
+/* GJK distance query: returns the distance between the colliders of b1 and
+ * b2, 0 if they overlap, and writes the point of their minkowski difference
+ * closest to the origin to v, which points from b2 to b1. The distance
+ * returned never exceeds the real one, even when the iterations run out.
+ * Only for shapes with a support mapping. */
+float
+rbp_gjk_distance(rbp_body *b1, rbp_body *b2, Vector3 *v)
+{
+	Vector3 w[4];
+	float lower = 0.0f;
+	int n = 0;
+	int i;
+
+	*v = rbp_support(b1, b2, SUB(b1->pos, b2->pos));
+	for (i = 0; i < RBP_GJK_ITERATIONS; i++) {
+		float vv = DOT(*v, *v);
+		if (vv < 1e-12f) {
+			/* touching */
+			return 0.0f;
+		}
+
+		/* Every point of the difference is at least as far along v as p,
+		 * stop once p gets no closer to the origin than v */
+		Vector3 p = rbp_support(b1, b2, NEG(*v));
+		float vp = DOT(*v, p);
+		lower = fmaxf(lower, vp / sqrtf(vv));
+		if (vv - vp <= 1e-5f*vv) {
+			break;
+		}
+
+		Vector3 last = *v;
+		w[n++] = p;
+		n = rbp_simplex_closest(w, n, v);
+		if (n == 4) {
+			if (vp > 0.0f) {
+				/* a flat tetrahedron fooled the inside test, the
+				 * plane along v still separates the shapes */
+				*v = last;
+				break;
+			}
+			return 0.0f;
+		}
+	}
+	return lower;
+}
+
 /* Cleanup macros */
-#undef NEG
 #undef SUB
-#undef DOT
-#undef X
 #undef X3
\ No newline at end of file
@@ -8,25 +8,11 @@ typedef struct rbp_portal {
 	Vector3 N; /* portal normal vector in winding ABC */
 } rbp_portal;
 
-/* Defining some macros to ease typing */
-#define NEG(d) Vector3Negate(d)
+/* Defining some macros to ease typing (NEG, DOT and X come from rbphys.h) */
 #define SUB(a, b) Vector3Subtract(a, b)
-#define DOT(a, b) Vector3DotProduct(a, b)
-#define X(a, b) Vector3CrossProduct(a, b)
 #define X3(a, b) Vector3CrossProduct(Vector3CrossProduct(a, b), a)
 #define NORM(a, b, c) X(SUB(b, a), SUB(c, a))
 
-/* Calls the support-mappings from each body and returns the
- * minkowski difference.
- */
-Vector3
-rbp_support(rbp_body *a, rbp_body *b, Vector3 d)
-{
-	Vector3 sa = a->support(a, d);
-	Vector3 sb = b->support(b, NEG(d));
-	return Vector3Subtract(sa, sb);
-}
-
 float rbp_plucker_dot(Vector3 a, Vector3 b)
 {
 	Vector3 v = SUB(b, a);
@@ -121,10 +107,169 @@ rbp_mpr(rbp_body *b1, rbp_body *b2)
 	}	
 }
 
+/* Support point of the minkowski difference that remembers the points of
+ * each body it came from, so contact points can be recovered */
+typedef struct rbp_mpr_vertex {
+	Vector3 v; /* a - b */
+	Vector3 a; /* support point of b1 */
+	Vector3 b; /* support point of b2 */
+} rbp_mpr_vertex;
+
+#ifndef RBP_MPR_ITERATIONS
+#define RBP_MPR_ITERATIONS 64
+#endif
+#define RBP_MPR_EPS 1e-4f
+
+void
+rbp_mpr_support(rbp_body *b1, rbp_body *b2, Vector3 d, rbp_mpr_vertex *s)
+{
+	s->a = rbp_support_body(b1, d);
+	s->b = rbp_support_body(b2, NEG(d));
+	s->v = SUB(s->a, s->b);
+}
+
+/* MPR with penetration: on a hit fills the normal (b1->b2), depth and
+ * contact points of c and returns 1. Returns 0 on a miss without touching
+ * c. */
+int
+rbp_mpr_contact(rbp_body *b1, rbp_body *b2, rbp_contact *c)
+{
+	rbp_mpr_vertex v0, v1, v2, v3, v4, tmp;
+	Vector3 n;
+	int i;
+
+	/* Phase 1: Portal discovery, starting from a point deep within the
+	 * minkowski difference */
+	v0.a = rbp_collider_center(b1);
+	v0.b = rbp_collider_center(b2);
+	v0.v = SUB(v0.a, v0.b);
+	if (DOT(v0.v, v0.v) < 1e-12f) {
+		/* centers coincide, nudge so the origin ray is defined */
+		v0.v = (Vector3) {1e-5f, 0.0f, 0.0f};
+	}
+
+	n = NEG(v0.v);
+	rbp_mpr_support(b1, b2, n, &v1);
+	if (DOT(v1.v, n) <= 0.0f) {
+		return 0;
+	}
+
+	n = X(v1.v, v0.v);
+	if (DOT(n, n) < 1e-12f) {
+		/* the origin is on the segment v0-v1 */
+		c->cn = Vector3Normalize(v1.v);
+		c->depth = Vector3Length(v1.v);
+		c->p1 = v1.a;
+		c->p2 = v1.b;
+		return 1;
+	}
+
+	rbp_mpr_support(b1, b2, n, &v2);
+	if (DOT(v2.v, n) <= 0.0f) {
+		return 0;
+	}
+
+	n = X(SUB(v1.v, v0.v), SUB(v2.v, v0.v));
+	if (DOT(n, v0.v) > 0.0f) {
+		tmp = v1;
+		v1 = v2;
+		v2 = tmp;
+		n = NEG(n);
+	}
+
+	for (i = 0; i < RBP_MPR_ITERATIONS; i++) {
+		rbp_mpr_support(b1, b2, n, &v3);
+		if (DOT(v3.v, n) <= 0.0f) {
+			return 0;
+		}
+		if (DOT(X(v1.v, v3.v), v0.v) < 0.0f) {
+			/* origin is outside of v0 v1 v3, drop v2 */
+			v2 = v3;
+			n = X(SUB(v1.v, v0.v), SUB(v3.v, v0.v));
+			continue;
+		}
+		if (DOT(X(v3.v, v2.v), v0.v) < 0.0f) {
+			/* origin is outside of v0 v3 v2, drop v1 */
+			v1 = v3;
+			n = X(SUB(v3.v, v0.v), SUB(v2.v, v0.v));
+			continue;
+		}
+		break;
+	}
+
+	/* Phase 2: Portal refinement, until the portal is on the surface of
+	 * the minkowski difference */
+	int hit = 0;
+	for (i = 0; i < RBP_MPR_ITERATIONS; i++) {
+		n = Vector3Normalize(X(SUB(v2.v, v1.v), SUB(v3.v, v1.v)));
+		float d = DOT(n, v1.v);
+		if (d >= 0.0f) {
+			/* origin is behind the portal */
+			hit = 1;
+		}
+
+		rbp_mpr_support(b1, b2, n, &v4);
+		float delta = DOT(SUB(v4.v, v3.v), n);
+		if (DOT(v4.v, n) <= 0.0f) {
+			/* origin is beyond the support plane, miss */
+			return 0;
+		}
+		if (delta <= RBP_MPR_EPS) {
+			break;
+		}
+
+		/* Replace a portal vertex with v4 keeping the origin ray inside */
+		if (DOT(X(v4.v, v1.v), v0.v) < 0.0f) {
+			if (DOT(X(v4.v, v2.v), v0.v) < 0.0f) {
+				v1 = v4;
+			} else {
+				v3 = v4;
+			}
+		} else {
+			if (DOT(X(v4.v, v3.v), v0.v) < 0.0f) {
+				v2 = v4;
+			} else {
+				v1 = v4;
+			}
+		}
+	}
+
+	if (!hit) {
+		return 0;
+	}
+
+	/* The penetration is the distance from the origin to the portal,
+	 * contact points interpolate the portal vertices at the projection of
+	 * the origin */
+	float depth = DOT(n, v1.v);
+	Vector3 o = Vector3Scale(n, depth);
+	Vector3 e1 = SUB(v2.v, v1.v);
+	Vector3 e2 = SUB(v3.v, v1.v);
+	Vector3 e3 = SUB(o, v1.v);
+	float d11 = DOT(e1, e1);
+	float d12 = DOT(e1, e2);
+	float d22 = DOT(e2, e2);
+	float d31 = DOT(e3, e1);
+	float d32 = DOT(e3, e2);
+	float den = d11*d22 - d12*d12;
+	float u = 1.0f/3.0f;
+	float v = 1.0f/3.0f;
+	if (fabsf(den) > 1e-12f) {
+		u = (d22*d31 - d12*d32) / den;
+		v = (d11*d32 - d12*d31) / den;
+	}
+	float w = 1.0f - u - v;
+
+	c->cn = n;
+	c->depth = depth;
+	c->p1 = Vector3Add(Vector3Scale(v1.a, w), Vector3Add(
+	    Vector3Scale(v2.a, u), Vector3Scale(v3.a, v)));
+	c->p2 = Vector3Add(Vector3Scale(v1.b, w), Vector3Add(
+	    Vector3Scale(v2.b, u), Vector3Scale(v3.b, v)));
+	return 1;
+}
+
 /* Cleanup macros */
-#undef NEG
 #undef SUB
-#undef DOT
-#undef X
 #undef X3
 #undef NORM
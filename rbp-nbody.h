@@ -0,0 +1,276 @@
+/* Barnes-Hut N-body gravity for rbphys, include it after rbphys.h.
+ * Tree traversal runs in parallel when built with OpenMP (-fopenmp). */
+
+/* Default opening angle: a cell is taken as a point mass once its size
+ * over its distance falls below it. 0 makes the sum exact. */
+#ifndef RBP_NBODY_THETA
+#define RBP_NBODY_THETA 0.5f
+#endif
+
+/* Maximum octree depth, bodies closer than the cell size at this depth
+ * share a leaf */
+#ifndef RBP_NBODY_DEPTH
+#define RBP_NBODY_DEPTH 32
+#endif
+
+/* Octree node data type:
+ * com = center of mass of the bodies in the cell;
+ * m = mass of the bodies in the cell;
+ * center, half = center of the cell and half its size;
+ * first = index of the first of the 8 children, -1 for leaves;
+ * body = index of the body held by a leaf, -1 if empty or shared;
+ */
+typedef struct rbp_octree_node {
+	Vector3 com;
+	float m;
+	Vector3 center;
+	float half;
+	int first;
+	int body;
+} rbp_octree_node;
+
+/* N-body gravity data type:
+ * G = gravitational constant;
+ * theta = opening angle, see RBP_NBODY_THETA;
+ * softening = Plummer softening length e, distances r are taken as
+ * sqrt(r^2 + e^2), keeps close encounters finite;
+ * nnodes, capacity, nodes = octree of the last rbp_nbody_build call;
+ */
+typedef struct rbp_nbody {
+	float G;
+	float theta;
+	float softening;
+	int nnodes;
+	int capacity;
+	rbp_octree_node *nodes;
+} rbp_nbody;
+
+void
+rbp_nbody_init(rbp_nbody *nb, float G)
+{
+	nb->G = G;
+	nb->theta = RBP_NBODY_THETA;
+	nb->softening = 0.0f;
+	nb->nnodes = 0;
+	nb->capacity = 0;
+	nb->nodes = NULL;
+}
+
+void
+rbp_nbody_free(rbp_nbody *nb)
+{
+	free(nb->nodes);
+	nb->nodes = NULL;
+	nb->nnodes = 0;
+	nb->capacity = 0;
+}
+
+/* Makes room for count nodes in nb, returns 0 if out of memory */
+int
+rbp_nbody_reserve(rbp_nbody *nb, int count)
+{
+	rbp_octree_node *nodes;
+	int capacity = nb->capacity ? nb->capacity : 64;
+
+	if (count <= nb->capacity) {
+		return 1;
+	}
+	while (capacity < count) {
+		capacity *= 2;
+	}
+	nodes = realloc(nb->nodes, capacity*sizeof(*nodes));
+	if (nodes == NULL) {
+		return 0;
+	}
+	nb->nodes = nodes;
+	nb->capacity = capacity;
+	return 1;
+}
+
+/* Appends 8 empty children for the cell of node i, returns 0 if out of
+ * memory */
+int
+rbp_octree_split(rbp_nbody *nb, int i)
+{
+	int k;
+
+	if (!rbp_nbody_reserve(nb, nb->nnodes + 8)) {
+		return 0;
+	}
+
+	rbp_octree_node *node = &nb->nodes[i];
+	float h = 0.5f*node->half;
+	node->first = nb->nnodes;
+	for (k = 0; k < 8; k++) {
+		rbp_octree_node *child = &nb->nodes[nb->nnodes++];
+		child->com = Vector3Zero();
+		child->m = 0.0f;
+		child->center = (Vector3) {
+			node->center.x + (k & 1 ? h : -h),
+			node->center.y + (k & 2 ? h : -h),
+			node->center.z + (k & 4 ? h : -h)};
+		child->half = h;
+		child->first = -1;
+		child->body = -1;
+	}
+	return 1;
+}
+
+/* Index of the child of node containing p */
+int
+rbp_octree_child(rbp_octree_node *node, Vector3 p)
+{
+	return node->first + (p.x >= node->center.x) +
+	    2*(p.y >= node->center.y) + 4*(p.z >= node->center.z);
+}
+
+/* Builds the octree of nb over the n bodies. Static bodies (m = 0) neither
+ * attract nor get attracted. Returns 0 if out of memory. */
+int
+rbp_nbody_build(rbp_nbody *nb, rbp_body **bodies, int n)
+{
+	Vector3 min = {FLT_MAX, FLT_MAX, FLT_MAX};
+	Vector3 max = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+	int i, j, depth;
+
+	for (i = 0; i < n; i++) {
+		min = Vector3Min(min, bodies[i]->pos);
+		max = Vector3Max(max, bodies[i]->pos);
+	}
+
+	/* Root cell: a cube around every body */
+	if (!rbp_nbody_reserve(nb, 1)) {
+		return 0;
+	}
+	nb->nnodes = 1;
+	rbp_octree_node *root = &nb->nodes[0];
+	Vector3 ext = Vector3Subtract(max, min);
+	root->com = Vector3Zero();
+	root->m = 0.0f;
+	root->center = Vector3Scale(Vector3Add(min, max), 0.5f);
+	root->half = 0.5f*fmaxf(fmaxf(ext.x, ext.y), fmaxf(ext.z, 1e-6f));
+	root->first = -1;
+	root->body = -1;
+
+	for (i = 0; i < n; i++) {
+		rbp_body *b = bodies[i];
+		float mb = rbp_body_mass(b);
+		int node = 0;
+
+		if (mb == 0.0f) {
+			continue;
+		}
+		for (depth = 0; ; depth++) {
+			rbp_octree_node *c = &nb->nodes[node];
+			float m = c->m;
+			c->m += mb;
+			c->com = Vector3Add(c->com, Vector3Scale(b->pos, mb));
+			if (c->first >= 0) {
+				node = rbp_octree_child(c, b->pos);
+				continue;
+			}
+			if (m == 0.0f) {
+				/* empty leaf */
+				c->body = i;
+				break;
+			}
+			if (depth >= RBP_NBODY_DEPTH) {
+				/* shared leaf, only the totals are kept */
+				c->body = -1;
+				break;
+			}
+
+			/* Occupied leaf: move its body one level down and retry */
+			j = c->body;
+			if (!rbp_octree_split(nb, node)) {
+				return 0;
+			}
+			c = &nb->nodes[node];
+			c->body = -1;
+			rbp_octree_node *child = &nb->nodes[rbp_octree_child(c,
+			    bodies[j]->pos)];
+			child->m = rbp_body_mass(bodies[j]);
+			child->com = Vector3Scale(bodies[j]->pos, child->m);
+			child->body = j;
+			node = rbp_octree_child(c, b->pos);
+		}
+	}
+
+	/* Mass weighted sums to centers of mass. Leaves take the exact body
+	 * position, so that a body finds itself at r = 0. */
+	for (i = 0; i < nb->nnodes; i++) {
+		rbp_octree_node *c = &nb->nodes[i];
+		if (c->body >= 0) {
+			c->com = bodies[c->body]->pos;
+		} else if (c->m > 0.0f) {
+			c->com = Vector3Scale(c->com, 1.0f/c->m);
+		}
+	}
+	return 1;
+}
+
+/* Gravitational acceleration at point p from the octree of nb. Cells seen
+ * under an angle below theta count as a single point mass. */
+Vector3
+rbp_nbody_accel(rbp_nbody *nb, Vector3 p)
+{
+	int stack[8*RBP_NBODY_DEPTH + 8];
+	int top = 0;
+	float theta2 = nb->theta*nb->theta;
+	float eps2 = nb->softening*nb->softening;
+	Vector3 a = Vector3Zero();
+
+	if (nb->nnodes > 0) {
+		stack[top++] = 0;
+	}
+	while (top > 0) {
+		rbp_octree_node *c = &nb->nodes[stack[--top]];
+		if (c->m == 0.0f) {
+			continue;
+		}
+		Vector3 d = Vector3Subtract(c->com, p);
+		float r2 = Vector3DotProduct(d, d);
+		float size = 2.0f*c->half;
+		if (c->first >= 0 && size*size >= theta2*r2) {
+			/* too close, open the cell */
+			int k;
+			for (k = 0; k < 8; k++) {
+				stack[top++] = c->first + k;
+			}
+			continue;
+		}
+		r2 += eps2;
+		if (r2 > 0.0f) {
+			/* p itself sits at r = 0 and pulls on nothing */
+			float s = nb->G*c->m / (r2*sqrtf(r2));
+			a = Vector3Add(a, Vector3Scale(d, s));
+		}
+	}
+	return a;
+}
+
+/* Rebuilds the octree of nb and adds the gravity between the n bodies to
+ * their force accumulators. Returns 0 if out of memory. */
+int
+rbp_nbody_gravity(rbp_nbody *nb, rbp_body **bodies, int n)
+{
+	int i;
+
+	if (!rbp_nbody_build(nb, bodies, n)) {
+		return 0;
+	}
+
+	/* Every body only writes to itself, the tree is read only */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+	for (i = 0; i < n; i++) {
+		rbp_body *b = bodies[i];
+		if (b->minv == 0.0f) {
+			continue;
+		}
+		Vector3 a = rbp_nbody_accel(nb, b->pos);
+		b->F = Vector3Add(b->F, Vector3Scale(a, rbp_body_mass(b)));
+	}
+	return 1;
+}
@@ -0,0 +1,379 @@
+/* Body pool for rbphys, included by rbphys.h. The pool owns its bodies and
+ * keeps the live ones packed at the start of two arrays, one for their state
+ * and one for their properties, so that the loops of a step only stream
+ * through the state. Bodies are referenced through generational handles, so
+ * that the pool may move them: removing a body moves the last one into its
+ * place and rbp_pool_compact sorts them along a Morton curve. Handles stay
+ * valid across moves, body pointers don't. */
+
+/* Handle data type: slot in the pool and generation of the slot when the
+ * handle was made. A handle goes stale when its body is removed. The zero
+ * handle is never valid. */
+typedef struct rbp_handle {
+	int slot;
+	unsigned int gen;
+} rbp_handle;
+
+/* Morton code and index of a body, for sorting */
+typedef struct rbp_pool_key {
+	unsigned int code;
+	int index;
+} rbp_pool_key;
+
+/* Pool data type:
+ * nbodies, capacity, bodies = live bodies, packed;
+ * props = properties of each body, bodies[i].props points to props[i];
+ * owner = slot of each body;
+ * nslots, gen = slots handed out so far and their generation;
+ * index = body of each live slot, next free slot for free slots;
+ * free = first free slot, -1 if none;
+ * keys, spare, sprops = scratch space of rbp_pool_compact;
+ * moved = whether bodies moved since the last rbp_pool_sync;
+ * nsynced, synced, sgen = slot and generation of each body at the last
+ * rbp_pool_sync, to follow the touching pairs of the world as they move;
+ */
+typedef struct rbp_pool {
+	int nbodies;
+	int capacity;
+	rbp_body *bodies;
+	rbp_body_props *props;
+	int *owner;
+	int nslots;
+	unsigned int *gen;
+	int *index;
+	int free;
+	rbp_pool_key *keys;
+	rbp_body *spare;
+	rbp_body_props *sprops;
+	int moved;
+	int nsynced;
+	int *synced;
+	unsigned int *sgen;
+} rbp_pool;
+
+void
+rbp_pool_init(rbp_pool *p)
+{
+	p->nbodies = 0;
+	p->capacity = 0;
+	p->bodies = NULL;
+	p->props = NULL;
+	p->owner = NULL;
+	p->nslots = 0;
+	p->gen = NULL;
+	p->index = NULL;
+	p->free = -1;
+	p->keys = NULL;
+	p->spare = NULL;
+	p->sprops = NULL;
+	p->moved = 0;
+	p->nsynced = 0;
+	p->synced = NULL;
+	p->sgen = NULL;
+}
+
+void
+rbp_pool_free(rbp_pool *p)
+{
+	free(p->bodies);
+	free(p->props);
+	free(p->owner);
+	free(p->gen);
+	free(p->index);
+	free(p->keys);
+	free(p->spare);
+	free(p->sprops);
+	free(p->synced);
+	free(p->sgen);
+	rbp_pool_init(p);
+}
+
+/* Points the bodies of p at their properties again, after either array
+ * moved */
+void
+rbp_pool_link(rbp_pool *p)
+{
+	int i;
+
+	for (i = 0; i < p->nbodies; i++) {
+		p->bodies[i].props = &p->props[i];
+	}
+}
+
+/* Makes room for capacity bodies in p. Returns 0 if out of memory, leaving
+ * p as it was. */
+int
+rbp_pool_reserve(rbp_pool *p, int capacity)
+{
+	void *q;
+
+	if (capacity <= p->capacity) {
+		return 1;
+	}
+	if ((q = realloc(p->bodies, capacity*sizeof(*p->bodies))) == NULL) {
+		return 0;
+	}
+	p->bodies = q;
+	p->moved = 1;
+	if ((q = realloc(p->props, capacity*sizeof(*p->props))) == NULL) {
+		return 0;
+	}
+	p->props = q;
+	rbp_pool_link(p);
+	if ((q = realloc(p->owner, capacity*sizeof(*p->owner))) == NULL) {
+		return 0;
+	}
+	p->owner = q;
+	if ((q = realloc(p->gen, capacity*sizeof(*p->gen))) == NULL) {
+		return 0;
+	}
+	p->gen = q;
+	if ((q = realloc(p->index, capacity*sizeof(*p->index))) == NULL) {
+		return 0;
+	}
+	p->index = q;
+	if ((q = realloc(p->synced, capacity*sizeof(*p->synced))) == NULL) {
+		return 0;
+	}
+	p->synced = q;
+	if ((q = realloc(p->sgen, capacity*sizeof(*p->sgen))) == NULL) {
+		return 0;
+	}
+	p->sgen = q;
+
+	/* scratch space, nothing to keep, but the old one stays until the
+	 * new one is there */
+	rbp_pool_key *keys = malloc(capacity*sizeof(*keys));
+	rbp_body *spare = malloc(capacity*sizeof(*spare));
+	rbp_body_props *sprops = malloc(capacity*sizeof(*sprops));
+	if (keys == NULL || spare == NULL || sprops == NULL) {
+		free(keys);
+		free(spare);
+		free(sprops);
+		return 0;
+	}
+	free(p->keys);
+	free(p->spare);
+	free(p->sprops);
+	p->keys = keys;
+	p->spare = spare;
+	p->sprops = sprops;
+	p->capacity = capacity;
+	return 1;
+}
+
+/* Returns the body of handle h, NULL if h is stale. The pointer is valid
+ * until a body is added or removed or the pool is compacted. */
+rbp_body *
+rbp_pool_get(rbp_pool *p, rbp_handle h)
+{
+	if (h.slot < 0 || h.slot >= p->nslots || p->gen[h.slot] != h.gen) {
+		return NULL;
+	}
+	return &p->bodies[p->index[h.slot]];
+}
+
+/* Copies body b and its properties into p and returns its handle, the zero
+ * handle if out of memory. Free slots are reused before new ones are
+ * taken. */
+rbp_handle
+rbp_pool_add(rbp_pool *p, rbp_body *b)
+{
+	rbp_handle h = {0, 0};
+	int slot;
+
+	if (p->nbodies == p->capacity) {
+		int capacity = p->capacity ? 2*p->capacity : RBP_WORLD_CAPACITY;
+		if (!rbp_pool_reserve(p, capacity)) {
+			return h;
+		}
+	}
+	if (p->free >= 0) {
+		slot = p->free;
+		p->free = p->index[slot];
+	} else {
+		slot = p->nslots++;
+		p->gen[slot] = 1;
+	}
+	p->index[slot] = p->nbodies;
+	p->owner[p->nbodies] = slot;
+	p->bodies[p->nbodies] = *b;
+	p->props[p->nbodies] = *b->props;
+	p->bodies[p->nbodies].props = &p->props[p->nbodies];
+	p->nbodies++;
+	p->moved = 1;
+	h.slot = slot;
+	h.gen = p->gen[slot];
+	return h;
+}
+
+/* Removes the body of handle h, the last body takes its place. Returns 0 if
+ * h is stale. */
+int
+rbp_pool_remove(rbp_pool *p, rbp_handle h)
+{
+	int i, last;
+
+	if (rbp_pool_get(p, h) == NULL) {
+		return 0;
+	}
+	i = p->index[h.slot];
+	last = --p->nbodies;
+	p->bodies[i] = p->bodies[last];
+	p->props[i] = p->props[last];
+	p->bodies[i].props = &p->props[i];
+	p->owner[i] = p->owner[last];
+	p->index[p->owner[i]] = i;
+
+	/* stale every handle to the slot, then put it on the free list */
+	p->gen[h.slot]++;
+	if (p->gen[h.slot] == 0) {
+		p->gen[h.slot] = 1;
+	}
+	p->index[h.slot] = p->free;
+	p->free = h.slot;
+	p->moved = 1;
+	return 1;
+}
+
+/* Spreads the low 10 bits of x over every third bit */
+unsigned int
+rbp_morton_spread(unsigned int x)
+{
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+int
+rbp_pool_key_compare(const void *a, const void *b)
+{
+	const rbp_pool_key *ka = a;
+	const rbp_pool_key *kb = b;
+
+	return (ka->code > kb->code) - (ka->code < kb->code);
+}
+
+/* Sorts the bodies of p along a Morton curve over their positions, so that
+ * bodies close in space are close in memory */
+void
+rbp_pool_compact(rbp_pool *p)
+{
+	Vector3 min = {FLT_MAX, FLT_MAX, FLT_MAX};
+	Vector3 max = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+	rbp_body *t;
+	rbp_body_props *tp;
+	int i;
+
+	if (p->nbodies < 2) {
+		return;
+	}
+	for (i = 0; i < p->nbodies; i++) {
+		min = Vector3Min(min, p->bodies[i].pos);
+		max = Vector3Max(max, p->bodies[i].pos);
+	}
+	Vector3 ext = Vector3Subtract(max, min);
+	float s = 1023.0f/fmaxf(fmaxf(ext.x, ext.y), fmaxf(ext.z, 1e-6f));
+	for (i = 0; i < p->nbodies; i++) {
+		Vector3 q = Vector3Subtract(p->bodies[i].pos, min);
+		q = Vector3Scale(q, s);
+		p->keys[i].code = rbp_morton_spread((unsigned int) q.x) |
+		    rbp_morton_spread((unsigned int) q.y) << 1 |
+		    rbp_morton_spread((unsigned int) q.z) << 2;
+		p->keys[i].index = i;
+	}
+	qsort(p->keys, p->nbodies, sizeof(*p->keys), rbp_pool_key_compare);
+
+	/* gather into the spare array and swap, the keys keep the owners */
+	for (i = 0; i < p->nbodies; i++) {
+		int j = p->keys[i].index;
+		p->spare[i] = p->bodies[j];
+		p->sprops[i] = p->props[j];
+		p->keys[i].index = p->owner[j];
+	}
+	for (i = 0; i < p->nbodies; i++) {
+		p->owner[i] = p->keys[i].index;
+		p->index[p->owner[i]] = i;
+	}
+	t = p->bodies;
+	p->bodies = p->spare;
+	p->spare = t;
+	tp = p->props;
+	p->props = p->sprops;
+	p->sprops = tp;
+	rbp_pool_link(p);
+	p->moved = 1;
+}
+
+/* Makes the bodies of w those of p, if they moved since the last call.
+ * Call it before stepping w after adding, removing or compacting. The
+ * touching pairs of w follow their bodies, so moving bodies doesn't make
+ * contact events. Only the bodies that changed index get their bounds,
+ * static flag and filter read again, and the static BVH is only rebuilt
+ * when a static body was added, removed or moved. Returns 0 if out of
+ * memory. */
+int
+rbp_pool_sync(rbp_pool *p, rbp_world *w)
+{
+	int i, known, changed = 0;
+
+	if (!p->moved && w->nbodies == p->nbodies) {
+		return 1;
+	}
+	if (!rbp_world_reserve(w, p->nbodies)) {
+		return 0;
+	}
+
+	/* new index of each body of the last sync, -1 if it was removed */
+	known = p->nsynced == w->nbodies;
+	if (known) {
+		for (i = 0; i < p->nsynced; i++) {
+			int slot = p->synced[i];
+			p->synced[i] = p->gen[slot] == p->sgen[i] ?
+			    p->index[slot] : -1;
+			if (p->synced[i] != i) {
+				/* static indices change if a static body goes */
+				w->sdirty |= w->fixed[i];
+				changed = 1;
+			}
+		}
+		rbp_world_remap(w, p->synced);
+	} else {
+		w->nkeys = 0; /* another world, or bodies added behind our back */
+		w->sdirty = 1;
+		changed = 1;
+	}
+
+	/* Bodies still at their index keep their bounds, flags and filter,
+	 * the others are read again */
+	for (i = 0; i < p->nbodies; i++) {
+		w->bodies[i] = &p->bodies[i];
+		if (known && i < p->nsynced && p->synced[i] == i) {
+			continue;
+		}
+		w->stale[i] = 1; /* other body, other bounds */
+		w->fixed[i] = p->props[i].m == 0.0f;
+		w->sdirty |= w->fixed[i];
+		w->ddirty |= !w->fixed[i];
+		rbp_world_filter(w, i);
+	}
+	w->nbodies = p->nbodies;
+	if (changed) {
+		w->nnodes = 0; /* stale until the next rebuild */
+		w->ddirty = 1;
+	}
+	if (w->sdirty) {
+		w->nsnodes = 0;
+	}
+
+	for (i = 0; i < p->nbodies; i++) {
+		p->synced[i] = p->owner[i];
+		p->sgen[i] = p->gen[p->owner[i]];
+	}
+	p->nsynced = p->nbodies;
+	p->moved = 0;
+	return 1;
+}
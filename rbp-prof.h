@@ -0,0 +1,176 @@
+/* Step profiling for rbphys, included by rbphys.h. Build with -DRBP_PROFILE
+ * to time the phases of rbp_world_step and count the work done in each.
+ * Without it the RBP_PROF_* macros expand to nothing and none of the code
+ * below is compiled. */
+
+/* Phases of a world step, RBP_PHASE_STEP spans the whole step */
+typedef enum {
+	RBP_PHASE_STEP = 0,
+	RBP_PHASE_INTEGRATE,
+	RBP_PHASE_BROADPHASE,
+	RBP_PHASE_PAIRS,
+	RBP_PHASE_COLLIDE,
+	RBP_PHASE_RESOLVE,
+	RBP_PHASE_UPDATE,
+	RBP_PHASES
+} rbp_phase;
+
+#ifdef RBP_PROFILE
+
+#include <stdio.h>
+#include <time.h>
+
+/* Number of steps kept, older ones are overwritten */
+#ifndef RBP_PROF_FRAMES
+#define RBP_PROF_FRAMES 256
+#endif
+
+#define RBP_PROF_SHAPES (COMPOUND + 1)
+
+/* Profile of one step, times in microseconds:
+ * start, time = start and duration of each phase;
+ * bodies = bodies integrated;
+ * pairs = pairs tested by the narrowphase;
+ * contacts = contacts solved;
+ * iterations = solver iterations run;
+ * hits = colliding pairs by shape types, first body first;
+ */
+typedef struct rbp_prof_frame {
+	double start[RBP_PHASES];
+	double time[RBP_PHASES];
+	int bodies;
+	int pairs;
+	int contacts;
+	int iterations;
+	int hits[RBP_PROF_SHAPES][RBP_PROF_SHAPES];
+} rbp_prof_frame;
+
+/* Ring buffer of the last RBP_PROF_FRAMES steps, nframes counts every step
+ * profiled so far */
+typedef struct rbp_prof {
+	int nframes;
+	rbp_prof_frame frames[RBP_PROF_FRAMES];
+} rbp_prof;
+
+rbp_prof rbp_profile;
+
+const char *rbp_phase_names[RBP_PHASES] = {"step", "integrate",
+    "broadphase", "pairs", "collide", "resolve", "update"};
+
+const char *rbp_shape_names[RBP_PROF_SHAPES] = {"heightmap", "sphere",
+    "cuboid", "capsule", "convex", "trimesh", "compound"};
+
+/* Monotonic time in microseconds, or processor time when the monotonic
+ * clock is not exposed by the compile flags */
+double
+rbp_prof_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return 1e6*ts.tv_sec + 1e-3*ts.tv_nsec;
+#else
+	return 1e6*clock()/CLOCKS_PER_SEC;
+#endif
+}
+
+/* Step being profiled */
+rbp_prof_frame *
+rbp_prof_current(void)
+{
+	return &rbp_profile.frames[rbp_profile.nframes % RBP_PROF_FRAMES];
+}
+
+/* Starts timing phase, RBP_PHASE_STEP clears the slot of a new step */
+void
+rbp_prof_begin(rbp_phase phase)
+{
+	rbp_prof_frame *f = rbp_prof_current();
+
+	if (phase == RBP_PHASE_STEP) {
+		memset(f, 0, sizeof(*f));
+	}
+	f->start[phase] = rbp_prof_now();
+}
+
+/* Stops timing phase, RBP_PHASE_STEP moves on to the next slot */
+void
+rbp_prof_end(rbp_phase phase)
+{
+	rbp_prof_frame *f = rbp_prof_current();
+
+	f->time[phase] = rbp_prof_now() - f->start[phase];
+	if (phase == RBP_PHASE_STEP) {
+		rbp_profile.nframes++;
+	}
+}
+
+void
+rbp_prof_reset(void)
+{
+	rbp_profile.nframes = 0;
+}
+
+/* Writes the steps in the ring buffer to f in the Chrome trace event
+ * format, which chrome://tracing and Perfetto load. Phases are complete
+ * events, the counters of a step are attached to its step event. Returns 0
+ * on a write error. */
+int
+rbp_prof_export(FILE *f)
+{
+	int first = rbp_profile.nframes > RBP_PROF_FRAMES ?
+	    rbp_profile.nframes - RBP_PROF_FRAMES : 0;
+	int i, k, s1, s2;
+	const char *sep = "";
+
+	fprintf(f, "{\"traceEvents\":[");
+	for (i = first; i < rbp_profile.nframes; i++) {
+		rbp_prof_frame *fr = &rbp_profile.frames[i % RBP_PROF_FRAMES];
+
+		for (k = 0; k < RBP_PHASES; k++) {
+			fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,"
+			    "\"tid\":0,\"ts\":%.3f,\"dur\":%.3f", sep,
+			    rbp_phase_names[k], fr->start[k], fr->time[k]);
+			sep = ",";
+			if (k != RBP_PHASE_STEP) {
+				fprintf(f, "}");
+				continue;
+			}
+			fprintf(f, ",\"args\":{\"step\":%d,\"bodies\":%d,"
+			    "\"pairs\":%d,\"contacts\":%d,\"iterations\":%d", i,
+			    fr->bodies, fr->pairs, fr->contacts, fr->iterations);
+			for (s1 = 0; s1 < RBP_PROF_SHAPES; s1++)
+			for (s2 = 0; s2 < RBP_PROF_SHAPES; s2++) {
+				if (fr->hits[s1][s2] > 0) {
+					fprintf(f, ",\"%s-%s\":%d",
+					    rbp_shape_names[s1],
+					    rbp_shape_names[s2],
+					    fr->hits[s1][s2]);
+				}
+			}
+			fprintf(f, "}}");
+		}
+
+		/* counter track of the step */
+		fprintf(f, ",\n{\"name\":\"work\",\"ph\":\"C\",\"pid\":0,"
+		    "\"ts\":%.3f,\"args\":{\"pairs\":%d,\"contacts\":%d}}",
+		    fr->start[RBP_PHASE_STEP], fr->pairs, fr->contacts);
+	}
+	fprintf(f, "\n]}\n");
+	return !ferror(f);
+}
+
+#define RBP_PROF_BEGIN(phase) rbp_prof_begin(phase)
+#define RBP_PROF_END(phase) rbp_prof_end(phase)
+#define RBP_PROF_COUNT(counter, n) (rbp_prof_current()->counter += (n))
+#define RBP_PROF_HIT(t1, t2) (rbp_prof_current()->hits[t1][t2]++)
+
+#else
+
+#define RBP_PROF_BEGIN(phase)
+#define RBP_PROF_END(phase)
+#define RBP_PROF_COUNT(counter, n)
+#define RBP_PROF_HIT(t1, t2)
+
+#endif
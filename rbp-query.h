@@ -0,0 +1,1132 @@
+/* Ray and shape queries for rbphys */
+
+/* Number of rays traversing the broadphase together */
+#ifndef RBP_RAY_PACKET
+#define RBP_RAY_PACKET 4
+#endif
+
+/* Distance at which a shape cast considers two shapes touching */
+#ifndef RBP_SHAPECAST_TOLERANCE
+#define RBP_SHAPECAST_TOLERANCE 1e-3f
+#endif
+
+/* Maximum number of conservative advancement steps per body in a shape
+ * cast, reaching it reports a hit where the advancement stopped */
+#ifndef RBP_SHAPECAST_STEPS
+#define RBP_SHAPECAST_STEPS 64
+#endif
+
+/* Number of overlap query volumes traversing the broadphase together, at
+ * most 32 */
+#ifndef RBP_OVERLAP_PACKET
+#define RBP_OVERLAP_PACKET 32
+#endif
+
+/* Ray data type: points origin + t*dir for t in [0, maxt] */
+typedef struct rbp_ray {
+	Vector3 origin;
+	Vector3 dir;
+	float maxt;
+} rbp_ray;
+
+/* Ray hit data type:
+ * body = first body hit by the ray, NULL on a miss;
+ * t = ray parameter of the hit;
+ * point = hit point in world space;
+ * normal = surface normal at point, rays starting inside a body hit it at
+ * t = 0 with the normal against dir;
+ */
+typedef struct rbp_hit {
+	rbp_body *body;
+	float t;
+	Vector3 point;
+	Vector3 normal;
+} rbp_hit;
+
+/* Kinds of overlap query volumes */
+typedef enum {
+	RBP_OVERLAP_AABB = 0,
+	RBP_OVERLAP_SPHERE,
+	RBP_OVERLAP_BOX
+} rbp_overlap_type;
+
+/* Overlap query volume:
+ * type = kind of volume, AABB queries only test against the body bounds;
+ * pos = center of the volume in world space;
+ * dir = orientation of a box;
+ * size = full extents of an AABB or box along its axes;
+ * radius = radius of a sphere;
+ */
+typedef struct rbp_overlap {
+	rbp_overlap_type type;
+	Vector3 pos;
+	Quaternion dir;
+	Vector3 size;
+	float radius;
+} rbp_overlap;
+
+/* Ray vs shape intersections. They all take a ray o + t*d in world space
+ * and look for the first hit with t in [0, maxt], writing t and the normal
+ * on success. */
+int
+rbp_raycast_sphere(Vector3 pos, float radius, Vector3 o, Vector3 d,
+    float maxt, float *t, Vector3 *n)
+{
+	Vector3 m = Vector3Subtract(o, pos);
+	float a = DOT(d, d);
+	float b = DOT(m, d);
+	float c = DOT(m, m) - radius*radius;
+
+	if (c <= 0.0f) {
+		/* starts inside */
+		*t = 0.0f;
+		*n = Vector3Normalize(NEG(d));
+		return 1;
+	}
+	if (b > 0.0f || a == 0.0f) {
+		/* outside and moving away */
+		return 0;
+	}
+	float disc = b*b - a*c;
+	if (disc < 0.0f) {
+		return 0;
+	}
+	float tt = (-b - sqrtf(disc)) / a;
+	if (tt > maxt) {
+		return 0;
+	}
+	*t = tt;
+	*n = Vector3Normalize(Vector3Add(m, Vector3Scale(d, tt)));
+	return 1;
+}
+
+int
+rbp_raycast_cuboid(rbp_body *b, Vector3 o, Vector3 d, float maxt, float *t,
+    Vector3 *n)
+{
+	rbp_collider *c = rbp_body_collider(b);
+	rbp_shape_cuboid *s = c->shape;
+	Quaternion dir = QuaternionNormalize(QuaternionMultiply(s->dir, b->dir));
+	Quaternion inv = QuaternionInvert(dir);
+	Vector3 lo = Vector3RotateByQuaternion(Vector3Subtract(o,
+	    Vector3Add(b->pos, c->offset)), inv);
+	Vector3 ld = Vector3RotateByQuaternion(d, inv);
+	float h[3] = {0.5f*s->xsize, 0.5f*s->ysize, 0.5f*s->zsize};
+	float po[3] = {lo.x, lo.y, lo.z};
+	float pd[3] = {ld.x, ld.y, ld.z};
+	float tmin = 0.0f;
+	float tmax = maxt;
+	int axis = -1;
+	int i;
+
+	/* Slab test in the cuboid frame */
+	for (i = 0; i < 3; i++) {
+		if (fabsf(pd[i]) < 1e-12f) {
+			if (po[i] < -h[i] || po[i] > h[i]) {
+				return 0;
+			}
+			continue;
+		}
+		float inv_d = 1.0f / pd[i];
+		float t1 = (-h[i] - po[i]) * inv_d;
+		float t2 = (h[i] - po[i]) * inv_d;
+		if (t1 > t2) {
+			float tmp = t1;
+			t1 = t2;
+			t2 = tmp;
+		}
+		if (t1 > tmin) {
+			tmin = t1;
+			axis = i;
+		}
+		tmax = fminf(tmax, t2);
+		if (tmin > tmax) {
+			return 0;
+		}
+	}
+
+	*t = tmin;
+	if (axis < 0) {
+		/* starts inside */
+		*n = Vector3Normalize(NEG(d));
+		return 1;
+	}
+	float ln[3] = {0.0f, 0.0f, 0.0f};
+	ln[axis] = pd[axis] > 0.0f ? -1.0f : 1.0f;
+	*n = Vector3RotateByQuaternion((Vector3) {ln[0], ln[1], ln[2]}, dir);
+	return 1;
+}
+
+/* Ray vs the points within radius of the segment p-q (a capsule) */
+int
+rbp_raycast_segment(Vector3 p, Vector3 q, float radius, Vector3 o, Vector3 d,
+    float maxt, float *t, Vector3 *n)
+{
+	Vector3 cn, bn;
+	float best = maxt;
+	float tt;
+	int hit = 0;
+
+	tt = rbp_closest_segment_point(p, q, o);
+	if (Vector3Distance(o, Vector3Lerp(p, q, tt)) <= radius) {
+		/* starts inside */
+		*t = 0.0f;
+		*n = Vector3Normalize(NEG(d));
+		return 1;
+	}
+
+	/* End caps */
+	if (rbp_raycast_sphere(p, radius, o, d, best, &tt, &cn)) {
+		best = tt;
+		bn = cn;
+		hit = 1;
+	}
+	if (rbp_raycast_sphere(q, radius, o, d, best, &tt, &cn)) {
+		best = tt;
+		bn = cn;
+		hit = 1;
+	}
+
+	/* Side of the cylinder between the caps */
+	Vector3 ab = Vector3Subtract(q, p);
+	Vector3 ao = Vector3Subtract(o, p);
+	float abab = DOT(ab, ab);
+	float abd = DOT(ab, d);
+	float abao = DOT(ab, ao);
+	float qa = abab*DOT(d, d) - abd*abd;
+	float qb = abab*DOT(ao, d) - abao*abd;
+	float qc = abab*DOT(ao, ao) - abao*abao - radius*radius*abab;
+	float disc = qb*qb - qa*qc;
+	if (qa > 1e-12f && disc >= 0.0f) {
+		tt = (-qb - sqrtf(disc)) / qa;
+		float y = abao + tt*abd;
+		if (tt >= 0.0f && tt <= best && y >= 0.0f && y <= abab) {
+			Vector3 x = Vector3Add(o, Vector3Scale(d, tt));
+			Vector3 a = Vector3Add(p, Vector3Scale(ab, y / abab));
+			best = tt;
+			bn = Vector3Normalize(Vector3Subtract(x, a));
+			hit = 1;
+		}
+	}
+	if (hit) {
+		*t = best;
+		*n = bn;
+	}
+	return hit;
+}
+
+int
+rbp_raycast_capsule(rbp_body *b, Vector3 o, Vector3 d, float maxt, float *t,
+    Vector3 *n)
+{
+	rbp_shape_capsule *s = rbp_body_collider(b)->shape;
+	Vector3 p, q;
+
+	rbp_capsule_segment(b, &p, &q);
+	return rbp_raycast_segment(p, q, s->radius, o, d, maxt, t, n);
+}
+
+/* Clips the ray against the planes of every triangle of the hull */
+int
+rbp_raycast_convex(rbp_body *b, Vector3 o, Vector3 d, float maxt, float *t,
+    Vector3 *n)
+{
+	rbp_collider *c = rbp_body_collider(b);
+	rbp_shape_convex *s = c->shape;
+	Quaternion dir = QuaternionNormalize(QuaternionMultiply(s->dir, b->dir));
+	Quaternion inv = QuaternionInvert(dir);
+	Vector3 lo = Vector3RotateByQuaternion(Vector3Subtract(o,
+	    Vector3Add(b->pos, c->offset)), inv);
+	Vector3 ld = Vector3RotateByQuaternion(d, inv);
+	Vector3 ln = NEG(ld);
+	float tenter = 0.0f;
+	float texit = maxt;
+	int i;
+
+	for (i = 0; i < s->ntris; i++) {
+		Vector3 a = s->verts[s->tris[3*i]];
+		Vector3 pb = s->verts[s->tris[3*i + 1]];
+		Vector3 pc = s->verts[s->tris[3*i + 2]];
+		Vector3 pn = X(Vector3Subtract(pb, a), Vector3Subtract(pc, a));
+		if (DOT(pn, Vector3Subtract(a, s->center)) < 0.0f) {
+			/* point the plane outwards */
+			pn = NEG(pn);
+		}
+		float num = DOT(pn, Vector3Subtract(a, lo));
+		float den = DOT(pn, ld);
+		if (den == 0.0f) {
+			if (num < 0.0f) {
+				/* parallel and outside */
+				return 0;
+			}
+			continue;
+		}
+		float tt = num / den;
+		if (den < 0.0f) {
+			if (tt > tenter) {
+				tenter = tt;
+				ln = pn;
+			}
+		} else {
+			texit = fminf(texit, tt);
+		}
+		if (tenter > texit) {
+			return 0;
+		}
+	}
+	*t = tenter;
+	*n = Vector3Normalize(Vector3RotateByQuaternion(ln, dir));
+	return 1;
+}
+
+/* Marches the ray over the heightmap cells and refines the first crossing
+ * of the surface by bisection */
+int
+rbp_raycast_heightmap(rbp_body *b, Vector3 o, Vector3 d, float maxt,
+    float *t, Vector3 *n)
+{
+	rbp_collider *c = rbp_body_collider(b);
+	rbp_shape_heightmap *s = c->shape;
+	Vector3 origin = Vector3Add(b->pos, c->offset);
+	float size[3] = {s->xsize, s->ysize, s->zsize};
+	float po[3] = {o.x - origin.x, o.y - origin.y, o.z - origin.z};
+	float pd[3] = {d.x, d.y, d.z};
+	float t0 = 0.0f;
+	float t1 = maxt;
+	float h;
+	Vector3 hn; /* t and n are only written on a hit */
+	int i, k;
+
+	/* Clip the ray to the bounds of the heightmap */
+	for (i = 0; i < 3; i++) {
+		if (fabsf(pd[i]) < 1e-12f) {
+			if (po[i] < 0.0f || po[i] > size[i]) {
+				return 0;
+			}
+			continue;
+		}
+		float ta = -po[i] / pd[i];
+		float tb = (size[i] - po[i]) / pd[i];
+		t0 = fmaxf(t0, fminf(ta, tb));
+		t1 = fminf(t1, fmaxf(ta, tb));
+	}
+	if (t0 > t1) {
+		return 0;
+	}
+
+	if (s->width < 2 || s->depth < 2) {
+		return 0;
+	}
+
+	/* Half a cell per step along the ground */
+	float cell = 0.5f*fminf(s->xsize / (s->width - 1),
+	    s->zsize / (s->depth - 1));
+	float dxz = sqrtf(d.x*d.x + d.z*d.z);
+	int steps = dxz*(t1 - t0) > cell ? (int) (dxz*(t1 - t0) / cell) + 1 : 1;
+	float dt = (t1 - t0) / steps;
+
+	float prev = t0;
+	for (k = 0; k <= steps; k++) {
+		float tt = t0 + k*dt;
+		Vector3 x = Vector3Add(o, Vector3Scale(d, tt));
+		if (!rbp_heightmap_sample(s, origin, x.x, x.z, &h, &hn) ||
+		    x.y > h) {
+			prev = tt;
+			continue;
+		}
+		if (k == 0) {
+			/* starts under the surface */
+			*t = tt;
+			*n = Vector3Normalize(NEG(d));
+			return 1;
+		}
+
+		/* The surface is crossed between prev and tt */
+		float lo = prev;
+		float hi = tt;
+		for (i = 0; i < 16; i++) {
+			float mid = 0.5f*(lo + hi);
+			x = Vector3Add(o, Vector3Scale(d, mid));
+			if (rbp_heightmap_sample(s, origin, x.x, x.z, &h, &hn) &&
+			    x.y <= h) {
+				hi = mid;
+			} else {
+				lo = mid;
+			}
+		}
+		x = Vector3Add(o, Vector3Scale(d, hi));
+		rbp_heightmap_sample(s, origin, x.x, x.z, &h, &hn);
+		*t = hi;
+		*n = hn;
+		return 1;
+	}
+	return 0;
+}
+
+/* Inverse of a ray direction component. Zero components get a huge finite
+ * inverse instead of infinity, which would turn slab tests into NaNs for
+ * rays starting exactly on a box face. */
+float
+rbp_ray_inv(float d)
+{
+	if (fabsf(d) < 1e-20f) {
+		return d < 0.0f ? -1e20f : 1e20f;
+	}
+	return 1.0f / d;
+}
+
+Vector3
+rbp_ray_invdir(Vector3 d)
+{
+	return (Vector3) {rbp_ray_inv(d.x), rbp_ray_inv(d.y), rbp_ray_inv(d.z)};
+}
+
+/* Returns the entry parameter of the ray o + t*d, with precomputed inverse
+ * direction invd, into the box min-max, or -1 if it misses within maxt */
+float
+rbp_raycast_aabb(Vector3 o, Vector3 invd, float *min, float *max, float maxt)
+{
+	float tx1 = (min[0] - o.x)*invd.x;
+	float tx2 = (max[0] - o.x)*invd.x;
+	float ty1 = (min[1] - o.y)*invd.y;
+	float ty2 = (max[1] - o.y)*invd.y;
+	float tz1 = (min[2] - o.z)*invd.z;
+	float tz2 = (max[2] - o.z)*invd.z;
+	float tmin = fmaxf(fmaxf(fminf(tx1, tx2), fminf(ty1, ty2)),
+	    fmaxf(fminf(tz1, tz2), 0.0f));
+	float tmax = fminf(fminf(fmaxf(tx1, tx2), fmaxf(ty1, ty2)),
+	    fminf(fmaxf(tz1, tz2), maxt));
+	return tmin <= tmax ? tmin : -1.0f;
+}
+
+/* Möller-Trumbore ray triangle intersection, two sided */
+int
+rbp_raycast_triangle(Vector3 a, Vector3 b, Vector3 c, Vector3 o, Vector3 d,
+    float maxt, float *t)
+{
+	Vector3 e1 = Vector3Subtract(b, a);
+	Vector3 e2 = Vector3Subtract(c, a);
+	Vector3 p = X(d, e2);
+	float det = DOT(e1, p);
+
+	if (fabsf(det) < 1e-12f) {
+		return 0;
+	}
+	float inv = 1.0f / det;
+	Vector3 s = Vector3Subtract(o, a);
+	float u = DOT(s, p)*inv;
+	if (u < 0.0f || u > 1.0f) {
+		return 0;
+	}
+	Vector3 q = X(s, e1);
+	float v = DOT(d, q)*inv;
+	if (v < 0.0f || u + v > 1.0f) {
+		return 0;
+	}
+	float tt = DOT(e2, q)*inv;
+	if (tt < 0.0f || tt > maxt) {
+		return 0;
+	}
+	*t = tt;
+	return 1;
+}
+
+int
+rbp_raycast_trimesh(rbp_body *b, Vector3 o, Vector3 d, float maxt, float *t,
+    Vector3 *n)
+{
+	rbp_collider *c = rbp_body_collider(b);
+	rbp_shape_trimesh *s = c->shape;
+	Quaternion inv = QuaternionInvert(b->dir);
+	Vector3 lo = Vector3RotateByQuaternion(Vector3Subtract(o,
+	    Vector3Add(b->pos, c->offset)), inv);
+	Vector3 ld = Vector3RotateByQuaternion(d, inv);
+	Vector3 invd = rbp_ray_invdir(ld);
+	Vector3 ln = {0.0f, 0.0f, 0.0f};
+	int stack[64];
+	int top = 0;
+	int hit = 0;
+
+	if (s->nnodes == 0) {
+		return 0;
+	}
+	stack[top++] = 0;
+	while (top > 0) {
+		int i = stack[--top];
+		rbp_bvh_node *node = &s->nodes[i];
+
+		if (rbp_raycast_aabb(lo, invd, node->min, node->max, maxt) < 0.0f) {
+			continue;
+		}
+		if (node->count == 0) {
+			stack[top++] = node->first; /* right */
+			stack[top++] = i + 1; /* left */
+			continue;
+		}
+		for (i = node->first; i < node->first + node->count; i++) {
+			Vector3 a = s->verts[s->tris[3*i]];
+			Vector3 pb = s->verts[s->tris[3*i + 1]];
+			Vector3 pc = s->verts[s->tris[3*i + 2]];
+			float tt;
+			if (rbp_raycast_triangle(a, pb, pc, lo, ld, maxt, &tt)) {
+				maxt = tt;
+				ln = X(Vector3Subtract(pb, a), Vector3Subtract(pc, a));
+				hit = 1;
+			}
+		}
+	}
+	if (!hit) {
+		return 0;
+	}
+	if (DOT(ln, ld) > 0.0f) {
+		/* face the ray */
+		ln = NEG(ln);
+	}
+	*t = maxt;
+	*n = Vector3Normalize(Vector3RotateByQuaternion(ln, b->dir));
+	return 1;
+}
+
+int rbp_raycast_body(rbp_body *b, Vector3 o, Vector3 d, float maxt, float *t,
+    Vector3 *n);
+
+int
+rbp_raycast_compound(rbp_body *b, Vector3 o, Vector3 d, float maxt, float *t,
+    Vector3 *n)
+{
+	rbp_collider *c = rbp_body_collider(b);
+	rbp_shape_compound *s = c->shape;
+	Quaternion inv = QuaternionInvert(b->dir);
+	Vector3 lo = Vector3RotateByQuaternion(Vector3Subtract(o,
+	    Vector3Add(b->pos, c->offset)), inv);
+	Vector3 ld = Vector3RotateByQuaternion(d, inv);
+	Vector3 invd = rbp_ray_invdir(ld);
+	rbp_body proxy;
+	rbp_body_props pp;
+	rbp_collider pc;
+	float ct;
+	Vector3 cn;
+	int stack[64];
+	int top = 0;
+	int hit = 0;
+
+	if (s->nnodes == 0) {
+		return 0;
+	}
+	stack[top++] = 0;
+	while (top > 0) {
+		int i = stack[--top];
+		rbp_bvh_node *node = &s->nodes[i];
+
+		if (rbp_raycast_aabb(lo, invd, node->min, node->max, maxt) < 0.0f) {
+			continue;
+		}
+		if (node->count == 0) {
+			stack[top++] = node->first; /* right */
+			stack[top++] = i + 1; /* left */
+			continue;
+		}
+		rbp_compound_proxy(b, c, &s->children[node->first], &proxy,
+		    &pp, &pc);
+		/* children cast into locals, only a closer hit is reported */
+		if (rbp_raycast_body(&proxy, o, d, maxt, &ct, &cn)) {
+			maxt = ct;
+			*t = ct;
+			*n = cn;
+			hit = 1;
+		}
+	}
+	return hit;
+}
+
+/* Casts the ray o + t*d, t in [0, maxt], against the collider of body b.
+ * Returns 1 on a hit, writing the ray parameter to t and the normal to n. */
+int
+rbp_raycast_body(rbp_body *b, Vector3 o, Vector3 d, float maxt, float *t,
+    Vector3 *n)
+{
+	rbp_collider *c = rbp_body_collider(b);
+
+	switch (rbp_shape_type(b)) {
+	case SPHERE: {
+		rbp_shape_sphere *s = c->shape;
+		return rbp_raycast_sphere(Vector3Add(b->pos, c->offset), s->radius,
+		    o, d, maxt, t, n);
+	}
+	case CUBOID:
+		return rbp_raycast_cuboid(b, o, d, maxt, t, n);
+	case CAPSULE:
+		return rbp_raycast_capsule(b, o, d, maxt, t, n);
+	case CONVEX:
+		return rbp_raycast_convex(b, o, d, maxt, t, n);
+	case HEIGHTMAP:
+		return rbp_raycast_heightmap(b, o, d, maxt, t, n);
+	case TRIMESH:
+		return rbp_raycast_trimesh(b, o, d, maxt, t, n);
+	case COMPOUND:
+		return rbp_raycast_compound(b, o, d, maxt, t, n);
+	default:
+		return 0;
+	}
+}
+
+/* Casts the n rays in rays against the bodies of w and writes the first
+ * hit of each to hits. Returns the number of rays that hit something.
+ * Rays go down the broadphase BVH in packets of RBP_RAY_PACKET: each node
+ * is slab-tested against the whole packet at once, in a loop simple enough
+ * for the compiler to vectorize, and the packet only descends while some
+ * of its rays still overlap the node. Uses the BVHs of the last
+ * rbp_world_broadphase call. */
+int
+rbp_raycast_batch(rbp_world *w, rbp_ray *rays, int n, rbp_hit *hits)
+{
+	float ox[RBP_RAY_PACKET], oy[RBP_RAY_PACKET], oz[RBP_RAY_PACKET];
+	float ix[RBP_RAY_PACKET], iy[RBP_RAY_PACKET], iz[RBP_RAY_PACKET];
+	float tmax[RBP_RAY_PACKET];
+	int stack[64];
+	rbp_bvh_node *nodes;
+	int *leaves;
+	int nhits = 0;
+	int p, k, tree;
+
+	for (p = 0; p < n; p += RBP_RAY_PACKET) {
+		int m = n - p < RBP_RAY_PACKET ? n - p : RBP_RAY_PACKET;
+		int top = 0;
+
+		/* Load the packet, unused lanes never hit anything */
+		for (k = 0; k < RBP_RAY_PACKET; k++) {
+			rbp_ray *r = &rays[p + (k < m ? k : 0)];
+			ox[k] = r->origin.x;
+			oy[k] = r->origin.y;
+			oz[k] = r->origin.z;
+			ix[k] = rbp_ray_inv(r->dir.x);
+			iy[k] = rbp_ray_inv(r->dir.y);
+			iz[k] = rbp_ray_inv(r->dir.z);
+			tmax[k] = k < m ? r->maxt : -1.0f;
+		}
+		for (k = 0; k < m; k++) {
+			hits[p + k].body = NULL;
+		}
+
+		for (tree = 0; tree < 2; tree++) {
+			if (rbp_world_tree(w, tree, &nodes, &leaves) > 0) {
+				stack[top++] = 0;
+			}
+			while (top > 0) {
+				int i = stack[--top];
+				rbp_bvh_node *node = &nodes[i];
+				int mask = 0;
+
+				/* Slab test of the whole packet */
+				for (k = 0; k < RBP_RAY_PACKET; k++) {
+					float tx1 = (node->min[0] - ox[k])*ix[k];
+					float tx2 = (node->max[0] - ox[k])*ix[k];
+					float ty1 = (node->min[1] - oy[k])*iy[k];
+					float ty2 = (node->max[1] - oy[k])*iy[k];
+					float tz1 = (node->min[2] - oz[k])*iz[k];
+					float tz2 = (node->max[2] - oz[k])*iz[k];
+					float t0 = fmaxf(fmaxf(fminf(tx1, tx2),
+					    fminf(ty1, ty2)),
+					    fmaxf(fminf(tz1, tz2), 0.0f));
+					float t1 = fminf(fminf(fmaxf(tx1, tx2),
+					    fmaxf(ty1, ty2)),
+					    fminf(fmaxf(tz1, tz2), tmax[k]));
+					mask |= (t0 <= t1) << k;
+				}
+				if (mask == 0) {
+					continue;
+				}
+				if (node->count == 0) {
+					stack[top++] = node->first; /* right */
+					stack[top++] = i + 1; /* left */
+					continue;
+				}
+
+				/* Leaf: exact tests for the rays that reached it */
+				for (int j = node->first;
+				    j < node->first + node->count; j++) {
+					int body = leaves[j];
+					rbp_body *b = w->bodies[body];
+					float bmin[3] = {w->min[body].x,
+					    w->min[body].y, w->min[body].z};
+					float bmax[3] = {w->max[body].x,
+					    w->max[body].y, w->max[body].z};
+					for (k = 0; k < m; k++) {
+						rbp_ray *r = &rays[p + k];
+						rbp_hit *h = &hits[p + k];
+						Vector3 invd = {ix[k], iy[k], iz[k]};
+						float t;
+						Vector3 normal;
+						if (!(mask & (1 << k)) ||
+						    rbp_raycast_aabb(r->origin, invd,
+						    bmin, bmax, tmax[k]) < 0.0f) {
+							continue;
+						}
+						if (rbp_raycast_body(b, r->origin,
+						    r->dir, tmax[k], &t, &normal)) {
+							tmax[k] = t;
+							h->body = b;
+							h->t = t;
+							h->normal = normal;
+						}
+					}
+				}
+			}
+		}
+
+		for (k = 0; k < m; k++) {
+			rbp_hit *h = &hits[p + k];
+			rbp_ray *r = &rays[p + k];
+			if (h->body != NULL) {
+				h->point = Vector3Add(r->origin, Vector3Scale(r->dir,
+				    h->t));
+				nhits++;
+			}
+		}
+	}
+	return nhits;
+}
+
+/* Casts a single ray, see rbp_raycast_batch. Returns 1 on a hit. */
+int
+rbp_raycast(rbp_world *w, Vector3 origin, Vector3 dir, float maxt,
+    rbp_hit *hit)
+{
+	rbp_ray ray = {origin, dir, maxt};
+	return rbp_raycast_batch(w, &ray, 1, hit);
+}
+
+/* Shape casts: sweep a body along a translation and report the first body
+ * it would touch. During a sweep b->pos is moved along the path and put
+ * back before returning. */
+
+/* Conservative advancement against a body with a support mapping. The GJK
+ * distance is a distance b can travel towards target without touching it,
+ * b moves that far and the distance is measured again until it is within
+ * RBP_SHAPECAST_TOLERANCE. */
+int
+rbp_shapecast_convex(rbp_body *b, rbp_body *target, Vector3 d, float t0,
+    float maxt, float *t, Vector3 *n, Vector3 *point)
+{
+	Vector3 pos = b->pos;
+	Vector3 v;
+	float tt = t0;
+	int hit = 0;
+	int i;
+
+	for (i = 0; i < RBP_SHAPECAST_STEPS; i++) {
+		b->pos = Vector3Add(pos, Vector3Scale(d, tt));
+		float dist = rbp_gjk_distance(b, target, &v);
+		if (dist == 0.0f) {
+			/* overlapping where the sweep starts */
+			rbp_contact c;
+			if (rbp_collide(b, target, &c) &&
+			    Vector3LengthSqr(c.cn) > 0.0f) {
+				*n = c.b1 == b ? NEG(c.cn) : c.cn;
+				*point = c.b1 == b ? c.p2 : c.p1;
+			} else {
+				*n = Vector3Normalize(NEG(d));
+				*point = b->pos;
+			}
+			hit = 1;
+			break;
+		}
+
+		/* v points from target to b */
+		v = Vector3Scale(v, 1.0f / dist);
+		if (dist <= RBP_SHAPECAST_TOLERANCE || i == RBP_SHAPECAST_STEPS - 1) {
+			*n = v;
+			*point = rbp_shape_type(b) == SPHERE ?
+			    rbp_support_body(b, NEG(v)) :
+			    rbp_support_body(target, v);
+			hit = 1;
+			break;
+		}
+		float closing = -DOT(d, v);
+		if (closing <= 0.0f) {
+			/* moving away from the closest points */
+			break;
+		}
+		tt += dist / closing;
+		if (tt > maxt) {
+			break;
+		}
+	}
+	b->pos = pos;
+	*t = tt;
+	return hit;
+}
+
+/* Sweep against a body without a support mapping (heightmap, trimesh,
+ * compound) using rbp_collide. Steps are as long as the gap between the
+ * bounds of both bodies, and never shorter than the inner radius of b so
+ * that it can't step over thin surfaces. The first overlapping step is
+ * then bisected down to RBP_SHAPECAST_TOLERANCE. */
+int
+rbp_shapecast_collide(rbp_body *b, rbp_body *target, Vector3 d, float t0,
+    float maxt, float inner, float *t, Vector3 *n, Vector3 *point)
+{
+	Vector3 pos = b->pos;
+	Vector3 min1, max1, min2, max2;
+	rbp_contact c, cc;
+	float len = Vector3Length(d);
+	float lo = t0;
+	float hi = t0;
+	int hit = 0;
+
+	if (len == 0.0f) {
+		return 0;
+	}
+	rbp_collider_aabb(target, &min2, &max2);
+	for (;;) {
+		b->pos = Vector3Add(pos, Vector3Scale(d, hi));
+		if (rbp_collide(b, target, &c)) {
+			hit = 1;
+			break;
+		}
+		if (hi >= maxt) {
+			break;
+		}
+		lo = hi;
+		rbp_collider_aabb(b, &min1, &max1);
+		float dx = fmaxf(0.0f, fmaxf(min2.x - max1.x, min1.x - max2.x));
+		float dy = fmaxf(0.0f, fmaxf(min2.y - max1.y, min1.y - max2.y));
+		float dz = fmaxf(0.0f, fmaxf(min2.z - max1.z, min1.z - max2.z));
+		hi = fminf(hi + fmaxf(sqrtf(dx*dx + dy*dy + dz*dz), inner)/len,
+		    maxt);
+	}
+
+	if (hit) {
+		/* lo is free and hi overlaps, unless the sweep starts inside */
+		while (hi > t0 && (hi - lo)*len > RBP_SHAPECAST_TOLERANCE) {
+			float mid = 0.5f*(lo + hi);
+			b->pos = Vector3Add(pos, Vector3Scale(d, mid));
+			if (rbp_collide(b, target, &cc)) {
+				hi = mid;
+				c = cc;
+			} else {
+				lo = mid;
+			}
+		}
+		*t = hi > t0 ? lo : t0;
+		*n = c.b1 == b ? NEG(c.cn) : c.cn;
+		*point = c.b1 == b ? c.p2 : c.p1;
+	}
+	b->pos = pos;
+	return hit;
+}
+
+/* Sweeps the collider of b against the collider of target. d is the
+ * translation per unit t and t0 a lower bound for the time of impact. */
+int
+rbp_shapecast_body(rbp_body *b, rbp_body *target, Vector3 d, float t0,
+    float maxt, float *t, Vector3 *n, Vector3 *point)
+{
+	rbp_collider *c = rbp_body_collider(b);
+	rbp_collider_type type = rbp_shape_type(b);
+	float inner;
+
+	if (type == SPHERE) {
+		/* Analytic: a ray against target grown by the radius */
+		rbp_shape_sphere *s = c->shape;
+		Vector3 o = Vector3Add(b->pos, c->offset);
+		rbp_collider *c2 = rbp_body_collider(target);
+		switch (rbp_shape_type(target)) {
+		case SPHERE: {
+			rbp_shape_sphere *s2 = c2->shape;
+			Vector3 pos2 = Vector3Add(target->pos, c2->offset);
+			if (!rbp_raycast_sphere(pos2, s->radius + s2->radius, o, d,
+			    maxt, t, n)) {
+				return 0;
+			}
+			*point = Vector3Add(pos2, Vector3Scale(*n, s2->radius));
+			return 1;
+		}
+		case CAPSULE: {
+			rbp_shape_capsule *s2 = c2->shape;
+			Vector3 p, q;
+			rbp_capsule_segment(target, &p, &q);
+			if (!rbp_raycast_segment(p, q, s->radius + s2->radius, o, d,
+			    maxt, t, n)) {
+				return 0;
+			}
+			*point = Vector3Subtract(Vector3Add(o, Vector3Scale(d, *t)),
+			    Vector3Scale(*n, s->radius));
+			return 1;
+		}
+		default:
+			break;
+		}
+		inner = s->radius;
+	} else if (type == CUBOID) {
+		rbp_shape_cuboid *s = c->shape;
+		inner = 0.5f*fminf(s->xsize, fminf(s->ysize, s->zsize));
+	} else {
+		return 0;
+	}
+
+	switch (rbp_shape_type(target)) {
+	case SPHERE:
+	case CUBOID:
+	case CAPSULE:
+	case CONVEX:
+		return rbp_shapecast_convex(b, target, d, t0, maxt, t, n, point);
+	default:
+		return rbp_shapecast_collide(b, target, d, t0, maxt, inner, t, n,
+		    point);
+	}
+}
+
+/* Sweeps body b from its current position along b->pos + t*d, t in
+ * [0, maxt], keeping its orientation, and writes the first body of w it
+ * touches to hit: t is the time of impact, point the contact point and
+ * normal the surface normal of the body hit, facing b. b must have a sphere
+ * or cuboid collider and may be one of the bodies of w, it doesn't hit
+ * itself. Returns 1 on a hit. Uses the BVHs of the last
+ * rbp_world_broadphase call.
+ * The BVH is walked with the ray of the center of b against nodes grown by
+ * the half extents of b, which also gives each body a lower bound for the
+ * time of impact. Sphere vs sphere and capsule are solved analytically,
+ * the rest by conservative advancement. */
+int
+rbp_shapecast(rbp_world *w, rbp_body *b, Vector3 d, float maxt, rbp_hit *hit)
+{
+	Vector3 min, max;
+	rbp_bvh_node *nodes;
+	int *leaves;
+	int stack[64];
+	int top = 0;
+	int tree;
+
+	hit->body = NULL;
+	if (rbp_shape_type(b) != SPHERE && rbp_shape_type(b) != CUBOID) {
+		return 0;
+	}
+
+	rbp_collider_aabb(b, &min, &max);
+	Vector3 o = Vector3Scale(Vector3Add(min, max), 0.5f);
+	Vector3 e = Vector3Scale(Vector3Subtract(max, min), 0.5f);
+	Vector3 invd = rbp_ray_invdir(d);
+
+	for (tree = 0; tree < 2; tree++) {
+		if (rbp_world_tree(w, tree, &nodes, &leaves) > 0) {
+			stack[top++] = 0;
+		}
+		while (top > 0) {
+			int i = stack[--top];
+			rbp_bvh_node *node = &nodes[i];
+			float nmin[3] = {node->min[0] - e.x, node->min[1] - e.y,
+			    node->min[2] - e.z};
+			float nmax[3] = {node->max[0] + e.x, node->max[1] + e.y,
+			    node->max[2] + e.z};
+
+			if (rbp_raycast_aabb(o, invd, nmin, nmax, maxt) < 0.0f) {
+				continue;
+			}
+			if (node->count == 0) {
+				stack[top++] = node->first; /* right */
+				stack[top++] = i + 1; /* left */
+				continue;
+			}
+
+			for (int j = node->first;
+			    j < node->first + node->count; j++) {
+				int body = leaves[j];
+				rbp_body *target = w->bodies[body];
+				float bmin[3] = {w->min[body].x - e.x,
+				    w->min[body].y - e.y, w->min[body].z - e.z};
+				float bmax[3] = {w->max[body].x + e.x,
+				    w->max[body].y + e.y, w->max[body].z + e.z};
+				float t0, t;
+				Vector3 normal, point;
+
+				if (target == b) {
+					continue;
+				}
+				t0 = rbp_raycast_aabb(o, invd, bmin, bmax, maxt);
+				if (t0 < 0.0f) {
+					continue;
+				}
+				if (rbp_shapecast_body(b, target, d, t0, maxt,
+				    &t, &normal, &point)) {
+					maxt = t;
+					hit->body = target;
+					hit->t = t;
+					hit->point = point;
+					hit->normal = normal;
+				}
+			}
+		}
+	}
+	return hit->body != NULL;
+}
+
+/* Overlap queries */
+/* World space bounds of the overlap query volume q */
+void
+rbp_overlap_aabb(rbp_overlap *q, Vector3 *min, Vector3 *max)
+{
+	switch (q->type) {
+	case RBP_OVERLAP_SPHERE: {
+		Vector3 r = {q->radius, q->radius, q->radius};
+		*min = Vector3Subtract(q->pos, r);
+		*max = Vector3Add(q->pos, r);
+		return;
+	}
+	case RBP_OVERLAP_BOX:
+		*max = Vector3Scale(q->size, 0.5f);
+		*min = NEG(*max);
+		rbp_aabb_transform(min, max, QuaternionNormalize(q->dir), q->pos);
+		return;
+	default:
+		*max = Vector3Scale(q->size, 0.5f);
+		*min = NEG(*max);
+		*min = Vector3Add(q->pos, *min);
+		*max = Vector3Add(q->pos, *max);
+		return;
+	}
+}
+
+/* Exact test of the query volume q against the collider of body b, whose
+ * bounds are known to overlap q. Spheres and boxes go through rbp_collide
+ * as a temporary body, so e.g. a sphere against a cuboid is the
+ * closest-point test of rbp_collide_sphere_cuboid. */
+int
+rbp_overlap_body(rbp_overlap *q, rbp_body *b)
+{
+	rbp_shape_sphere sphere = {0};
+	rbp_shape_cuboid cuboid = {0};
+	rbp_collider qc = {0};
+	rbp_body_props qp = {0};
+	rbp_body qb = {0};
+	rbp_contact c;
+
+	switch (q->type) {
+	case RBP_OVERLAP_SPHERE:
+		sphere.shape_type = SPHERE;
+		sphere.radius = q->radius;
+		qc.shape = &sphere;
+		break;
+	case RBP_OVERLAP_BOX:
+		cuboid.shape_type = CUBOID;
+		cuboid.dir = q->dir;
+		cuboid.xsize = q->size.x;
+		cuboid.ysize = q->size.y;
+		cuboid.zsize = q->size.z;
+		qc.shape = &cuboid;
+		break;
+	default:
+		return 1;
+	}
+	qb.pos = q->pos;
+	qb.dir = QuaternionIdentity();
+	qp.collider = &qc;
+	qb.props = &qp;
+	return rbp_collide(&qb, b, &c);
+}
+
+/* Finds the bodies of w overlapping each of the n query volumes in
+ * queries. Every overlapping pair is written as the index of the query to
+ * query[i] and the index of the body in w->bodies to body[i], for up to max
+ * pairs. Returns the number of pairs found, which may exceed max if the
+ * buffers were too small. Uses the BVHs of the last rbp_world_broadphase
+ * call.
+ * Queries go down the BVH in packets of RBP_OVERLAP_PACKET, carrying a
+ * bitmask of the queries of the packet still overlapping the node, so the
+ * broadphase is traversed once per packet instead of once per query. */
+int
+rbp_overlap_batch(rbp_world *w, rbp_overlap *queries, int n, int *query,
+    int *body, int max)
+{
+	float qmin[3][RBP_OVERLAP_PACKET], qmax[3][RBP_OVERLAP_PACKET];
+	int stack[64];
+	unsigned int masks[64];
+	rbp_bvh_node *nodes;
+	int *leaves;
+	int npairs = 0;
+	int p, k, tree;
+
+	for (p = 0; p < n; p += RBP_OVERLAP_PACKET) {
+		int m = n - p < RBP_OVERLAP_PACKET ? n - p : RBP_OVERLAP_PACKET;
+		int top = 0;
+
+		for (k = 0; k < m; k++) {
+			Vector3 min, max;
+			rbp_overlap_aabb(&queries[p + k], &min, &max);
+			qmin[0][k] = min.x;
+			qmin[1][k] = min.y;
+			qmin[2][k] = min.z;
+			qmax[0][k] = max.x;
+			qmax[1][k] = max.y;
+			qmax[2][k] = max.z;
+		}
+
+		for (tree = 0; tree < 2; tree++) {
+			if (rbp_world_tree(w, tree, &nodes, &leaves) > 0) {
+				stack[top] = 0;
+				masks[top] = m == 32 ?
+				    0xffffffffu : (1u << m) - 1u;
+				top++;
+			}
+			while (top > 0) {
+				top--;
+				int i = stack[top];
+				unsigned int active = masks[top];
+				rbp_bvh_node *node = &nodes[i];
+				unsigned int mask = 0;
+
+				/* Bounds test of the whole packet */
+				for (k = 0; k < m; k++) {
+					int in = qmin[0][k] <= node->max[0] &&
+					    qmax[0][k] >= node->min[0] &&
+					    qmin[1][k] <= node->max[1] &&
+					    qmax[1][k] >= node->min[1] &&
+					    qmin[2][k] <= node->max[2] &&
+					    qmax[2][k] >= node->min[2];
+					mask |= (unsigned int) in << k;
+				}
+				mask &= active;
+				if (mask == 0) {
+					continue;
+				}
+				if (node->count == 0) {
+					stack[top] = node->first; /* right */
+					masks[top] = mask;
+					top++;
+					stack[top] = i + 1; /* left */
+					masks[top] = mask;
+					top++;
+					continue;
+				}
+
+				/* Leaf: body bounds, then the exact test */
+				for (int j = node->first;
+				    j < node->first + node->count; j++) {
+					int bi = leaves[j];
+					rbp_body *b = w->bodies[bi];
+					Vector3 bmin = w->min[bi];
+					Vector3 bmax = w->max[bi];
+					for (k = 0; k < m; k++) {
+						Vector3 lo = {qmin[0][k],
+						    qmin[1][k], qmin[2][k]};
+						Vector3 hi = {qmax[0][k],
+						    qmax[1][k], qmax[2][k]};
+						if (!(mask & (1u << k)) ||
+						    !rbp_aabb_overlap(lo, hi,
+						    bmin, bmax) ||
+						    !rbp_overlap_body(&queries[p + k],
+						    b)) {
+							continue;
+						}
+						if (npairs < max) {
+							query[npairs] = p + k;
+							body[npairs] = bi;
+						}
+						npairs++;
+					}
+				}
+			}
+		}
+	}
+	return npairs;
+}
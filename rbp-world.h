@@ -0,0 +1,1040 @@
+/* World and broadphase for rbphys */
+
+/* Initial number of bodies a world makes room for */
+#ifndef RBP_WORLD_CAPACITY
+#define RBP_WORLD_CAPACITY 64
+#endif
+
+/* Default number of solver iterations of a world step */
+#ifndef RBP_WORLD_ITERATIONS
+#define RBP_WORLD_ITERATIONS 16
+#endif
+
+/* Pair of body indices with overlapping bounds, a < b */
+typedef struct rbp_pair {
+	int a;
+	int b;
+} rbp_pair;
+
+/* Pair of body indices as one sortable number, a << 32 | b */
+typedef unsigned long long rbp_pair_key;
+
+/* World data type: the bodies simulated together and the broadphase over
+ * them. Static bodies (m = 0) get a BVH of their own, built once and only
+ * rebuilt when static bodies are added, removed or marked dirty, and a step
+ * only walks the list of dynamic bodies, so while the static bodies stay
+ * put the per step work only depends on the dynamic bodies.
+ * nbodies = number of bodies in the world;
+ * capacity = number of bodies the arrays below have room for;
+ * bodies = pointers to the bodies, which belong to the caller;
+ * fixed = whether each body is static, read from m when it is added or
+ * marked dirty;
+ * category, mask, group = collision filter of each body, read from its
+ * collider at the same times, one array per field so that the broadphase
+ * tests a leaf with plain integer loads;
+ * min, max = world space bounds of each body;
+ * apos, adir = pose of each body when its bounds were computed;
+ * stale = whether the bounds of each body must be computed again whatever
+ * its pose, see rbp_world_dirty;
+ * todo = scratch list of rbp_world_bounds;
+ * nnodes, nodes = BVH over the dynamic body bounds, with the trimesh BVH
+ * layout;
+ * ndynamic, leaves = dynamic body indices in BVH leaf order, referenced by
+ * the leaf nodes;
+ * dynamic = the same indices in increasing order, the bodies a step moves,
+ * copied to leaves before each build;
+ * ddirty = whether dynamic must be listed again, after bodies were added,
+ * removed or turned static or dynamic;
+ * nsnodes, snodes, nstatic, sleaves = the same for the static bodies;
+ * sdirty = whether the static BVH must be rebuilt;
+ * Bounds and BVHs are refreshed by rbp_world_broadphase.
+ * gravity = acceleration of every dynamic body, applied by rbp_world_step;
+ * iterations = solver iterations per step;
+ * integrator = method moving the bodies at the end of a step;
+ * arena = transient data of the current step, reset by rbp_world_step;
+ * npairs, pairs = pairs found by the last rbp_world_pairs call;
+ * ncontacts, contacts = contacts found by the last rbp_world_collide call;
+ * pcapacity, ccapacity = room in pairs and contacts, which live in arena
+ * until the next step;
+ * nkeys, keys = pairs touching after the last step, sorted, kept across
+ * steps;
+ * nnext, next = pairs touching in the current step, gathered by
+ * rbp_world_collide;
+ * kcapacity, ncapacity = room in keys and next;
+ * nbegin, begin = pairs that started touching in the last step;
+ * npersist, persist = pairs that were touching before and still are;
+ * nend, end = pairs that stopped touching;
+ * The events are made by rbp_world_events and live in arena until the next
+ * step. Pairs of a removed body end without an event.
+ */
+typedef struct rbp_world {
+	int nbodies;
+	int capacity;
+	rbp_body **bodies;
+	unsigned char *fixed;
+	unsigned int *category;
+	unsigned int *mask;
+	int *group;
+	Vector3 *min;
+	Vector3 *max;
+	Vector3 *apos;
+	Quaternion *adir;
+	unsigned char *stale;
+	int *todo;
+	int nnodes;
+	rbp_bvh_node *nodes;
+	int ndynamic;
+	int *leaves;
+	int *dynamic;
+	int ddirty;
+	void *mem; /* unaligned allocation of nodes */
+	int nsnodes;
+	rbp_bvh_node *snodes;
+	int nstatic;
+	int *sleaves;
+	void *smem; /* unaligned allocation of snodes */
+	int sdirty;
+
+	Vector3 gravity;
+	int iterations;
+	rbp_integrator integrator;
+	rbp_arena arena;
+	int npairs;
+	int pcapacity;
+	rbp_pair *pairs;
+	int ncontacts;
+	int ccapacity;
+	rbp_contact *contacts;
+	int nkeys;
+	int kcapacity;
+	rbp_pair_key *keys;
+	int nnext;
+	int ncapacity;
+	rbp_pair_key *next;
+	int nbegin;
+	rbp_pair *begin;
+	int npersist;
+	rbp_pair *persist;
+	int nend;
+	rbp_pair *end;
+} rbp_world;
+
+void
+rbp_world_init(rbp_world *w)
+{
+	w->nbodies = 0;
+	w->capacity = 0;
+	w->bodies = NULL;
+	w->fixed = NULL;
+	w->category = NULL;
+	w->mask = NULL;
+	w->group = NULL;
+	w->min = NULL;
+	w->max = NULL;
+	w->apos = NULL;
+	w->adir = NULL;
+	w->stale = NULL;
+	w->todo = NULL;
+	w->nnodes = 0;
+	w->nodes = NULL;
+	w->ndynamic = 0;
+	w->leaves = NULL;
+	w->dynamic = NULL;
+	w->ddirty = 0;
+	w->mem = NULL;
+	w->nsnodes = 0;
+	w->snodes = NULL;
+	w->nstatic = 0;
+	w->sleaves = NULL;
+	w->smem = NULL;
+	w->sdirty = 0;
+	w->gravity = Vector3Zero();
+	w->iterations = RBP_WORLD_ITERATIONS;
+	w->integrator = RBP_SEMI_IMPLICIT_EULER;
+	rbp_arena_init(&w->arena);
+	w->npairs = 0;
+	w->pcapacity = 0;
+	w->pairs = NULL;
+	w->ncontacts = 0;
+	w->ccapacity = 0;
+	w->contacts = NULL;
+	w->nkeys = 0;
+	w->kcapacity = 0;
+	w->keys = NULL;
+	w->nnext = 0;
+	w->ncapacity = 0;
+	w->next = NULL;
+	w->nbegin = 0;
+	w->begin = NULL;
+	w->npersist = 0;
+	w->persist = NULL;
+	w->nend = 0;
+	w->end = NULL;
+}
+
+void
+rbp_world_free(rbp_world *w)
+{
+	free(w->bodies);
+	free(w->fixed);
+	free(w->category);
+	free(w->mask);
+	free(w->group);
+	free(w->min);
+	free(w->max);
+	free(w->apos);
+	free(w->adir);
+	free(w->stale);
+	free(w->todo);
+	free(w->leaves);
+	free(w->dynamic);
+	free(w->mem);
+	free(w->sleaves);
+	free(w->smem);
+	free(w->keys);
+	free(w->next);
+	rbp_arena_free(&w->arena);
+	rbp_world_init(w);
+}
+
+/* Makes room for capacity bodies in w. Returns 0 if out of memory, leaving
+ * w as it was. */
+int
+rbp_world_reserve(rbp_world *w, int capacity)
+{
+	rbp_body **bodies;
+	Vector3 *min, *max, *apos;
+	Quaternion *adir;
+	unsigned char *stale, *fixed;
+	unsigned int *category, *mask;
+	int *group, *leaves, *dynamic, *todo;
+	void *mem;
+
+	if (capacity <= w->capacity) {
+		return 1;
+	}
+	bodies = realloc(w->bodies, capacity*sizeof(*bodies));
+	if (bodies == NULL) {
+		return 0;
+	}
+	w->bodies = bodies;
+	fixed = realloc(w->fixed, capacity*sizeof(*fixed));
+	if (fixed == NULL) {
+		return 0;
+	}
+	w->fixed = fixed;
+	category = realloc(w->category, capacity*sizeof(*category));
+	if (category == NULL) {
+		return 0;
+	}
+	w->category = category;
+	mask = realloc(w->mask, capacity*sizeof(*mask));
+	if (mask == NULL) {
+		return 0;
+	}
+	w->mask = mask;
+	group = realloc(w->group, capacity*sizeof(*group));
+	if (group == NULL) {
+		return 0;
+	}
+	w->group = group;
+	min = realloc(w->min, capacity*sizeof(*min));
+	if (min == NULL) {
+		return 0;
+	}
+	w->min = min;
+	max = realloc(w->max, capacity*sizeof(*max));
+	if (max == NULL) {
+		return 0;
+	}
+	w->max = max;
+	apos = realloc(w->apos, capacity*sizeof(*apos));
+	if (apos == NULL) {
+		return 0;
+	}
+	w->apos = apos;
+	adir = realloc(w->adir, capacity*sizeof(*adir));
+	if (adir == NULL) {
+		return 0;
+	}
+	w->adir = adir;
+	stale = realloc(w->stale, capacity*sizeof(*stale));
+	if (stale == NULL) {
+		return 0;
+	}
+	w->stale = stale;
+	todo = realloc(w->todo, capacity*sizeof(*todo));
+	if (todo == NULL) {
+		return 0;
+	}
+	w->todo = todo;
+	leaves = realloc(w->leaves, capacity*sizeof(*leaves));
+	if (leaves == NULL) {
+		return 0;
+	}
+	w->leaves = leaves;
+	dynamic = realloc(w->dynamic, capacity*sizeof(*dynamic));
+	if (dynamic == NULL) {
+		return 0;
+	}
+	w->dynamic = dynamic;
+
+	/* The BVH is rebuilt from scratch, so the nodes aren't copied */
+	mem = malloc(2*capacity*sizeof(rbp_bvh_node) + RBP_CACHE_LINE);
+	if (mem == NULL) {
+		return 0;
+	}
+	free(w->mem);
+	w->mem = mem;
+	w->nodes = (rbp_bvh_node *) (((size_t) mem + RBP_CACHE_LINE - 1) &
+	    ~((size_t) RBP_CACHE_LINE - 1));
+	w->nnodes = 0;
+	w->capacity = capacity;
+	return 1;
+}
+
+/* Reads the collision filter of body i of w from its collider */
+void
+rbp_world_filter(rbp_world *w, int i)
+{
+	rbp_collider *c = rbp_body_collider(w->bodies[i]);
+
+	rbp_collider_bits(c, &w->category[i], &w->mask[i]);
+	w->group[i] = c->group;
+}
+
+/* Adds body b to w and returns its index, or -1 if out of memory */
+int
+rbp_world_add(rbp_world *w, rbp_body *b)
+{
+	if (w->nbodies == w->capacity) {
+		int capacity = w->capacity ? 2*w->capacity : RBP_WORLD_CAPACITY;
+		if (!rbp_world_reserve(w, capacity)) {
+			return -1;
+		}
+	}
+	w->bodies[w->nbodies] = b;
+	rbp_collider_aabb(b, &w->min[w->nbodies], &w->max[w->nbodies]);
+	w->apos[w->nbodies] = b->pos;
+	w->adir[w->nbodies] = b->dir;
+	w->stale[w->nbodies] = 0;
+	w->fixed[w->nbodies] = rbp_body_mass(b) == 0.0f;
+	w->sdirty |= w->fixed[w->nbodies];
+	w->ddirty |= !w->fixed[w->nbodies];
+	rbp_world_filter(w, w->nbodies);
+	return w->nbodies++;
+}
+
+/* Key of the pair of bodies a and b */
+rbp_pair_key
+rbp_pair_key_make(int a, int b)
+{
+	return (rbp_pair_key) a << 32 | (unsigned int) b;
+}
+
+/* Pair of key k */
+rbp_pair
+rbp_pair_key_pair(rbp_pair_key k)
+{
+	rbp_pair p = {(int) (k >> 32), (int) (k & 0xffffffffu)};
+	return p;
+}
+
+int
+rbp_pair_key_compare(const void *a, const void *b)
+{
+	rbp_pair_key ka = *(const rbp_pair_key *) a;
+	rbp_pair_key kb = *(const rbp_pair_key *) b;
+
+	return (ka > kb) - (ka < kb);
+}
+
+/* Sorts the n keys of keys in O(n) by a least significant byte first radix
+ * sort with tmp as scratch space. Bytes that are 0 in every key, like the
+ * high bytes of the indices of any world of fewer than 2^24 bodies, are
+ * skipped. Returns the array holding the result, keys or tmp. */
+rbp_pair_key *
+rbp_pair_key_sort(rbp_pair_key *keys, rbp_pair_key *tmp, int n)
+{
+	rbp_pair_key any = 0;
+	rbp_pair_key *t;
+	int count[256];
+	int shift, i, sum;
+
+	for (i = 0; i < n; i++) {
+		any |= keys[i];
+	}
+	for (shift = 0; shift < 64; shift += 8) {
+		if (((any >> shift) & 0xff) == 0) {
+			continue;
+		}
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++) {
+			count[(keys[i] >> shift) & 0xff]++;
+		}
+		for (i = 0, sum = 0; i < 256; i++) {
+			int c = count[i];
+			count[i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++) {
+			tmp[count[(keys[i] >> shift) & 0xff]++] = keys[i];
+		}
+		t = keys;
+		keys = tmp;
+		tmp = t;
+	}
+	return keys;
+}
+
+/* Renames the bodies of the touching pairs of w after the bodies moved
+ * between steps, body k becoming body map[k], and drops the pairs of the
+ * bodies mapped to -1 */
+void
+rbp_world_remap(rbp_world *w, int *map)
+{
+	int i, n = 0;
+
+	for (i = 0; i < w->nkeys; i++) {
+		rbp_pair p = rbp_pair_key_pair(w->keys[i]);
+		int a = map[p.a];
+		int b = map[p.b];
+		if (a < 0 || b < 0) {
+			continue;
+		}
+		w->keys[n++] = a < b ? rbp_pair_key_make(a, b) :
+		    rbp_pair_key_make(b, a);
+	}
+	w->nkeys = n;
+	qsort(w->keys, n, sizeof(*w->keys), rbp_pair_key_compare);
+}
+
+/* Removes body b from w, the last body takes its index */
+void
+rbp_world_remove(rbp_world *w, rbp_body *b)
+{
+	int i, k, n;
+
+	for (i = 0; i < w->nbodies; i++) {
+		if (w->bodies[i] == b) {
+			w->nbodies--;
+			/* static indices change if either body is static */
+			w->sdirty |= w->fixed[i] | w->fixed[w->nbodies];
+			w->ddirty = 1;
+			w->bodies[i] = w->bodies[w->nbodies];
+			w->fixed[i] = w->fixed[w->nbodies];
+			w->category[i] = w->category[w->nbodies];
+			w->mask[i] = w->mask[w->nbodies];
+			w->group[i] = w->group[w->nbodies];
+			w->min[i] = w->min[w->nbodies];
+			w->max[i] = w->max[w->nbodies];
+			w->apos[i] = w->apos[w->nbodies];
+			w->adir[i] = w->adir[w->nbodies];
+			w->stale[i] = w->stale[w->nbodies];
+			w->nnodes = 0; /* stale until the next rebuild */
+			if (w->sdirty) {
+				w->nsnodes = 0;
+			}
+
+			/* same as rbp_world_remap, without a map */
+			for (k = 0, n = 0; k < w->nkeys; k++) {
+				rbp_pair p = rbp_pair_key_pair(w->keys[k]);
+				if (p.a == i || p.b == i) {
+					continue;
+				}
+				p.a = p.a == w->nbodies ? i : p.a;
+				p.b = p.b == w->nbodies ? i : p.b;
+				w->keys[n++] = p.a < p.b ?
+				    rbp_pair_key_make(p.a, p.b) :
+				    rbp_pair_key_make(p.b, p.a);
+			}
+			w->nkeys = n;
+			qsort(w->keys, n, sizeof(*w->keys),
+			    rbp_pair_key_compare);
+			return;
+		}
+	}
+}
+
+/* Returns the center of the box min-max along axis */
+float
+rbp_aabb_center(Vector3 min, Vector3 max, int axis)
+{
+	float c[3] = {min.x + max.x, min.y + max.y, min.z + max.z};
+	return c[axis];
+}
+
+/* Builds a BVH in nodes over the n boxes min[index[i]]-max[index[i]], with
+ * up to leaf boxes per leaf node. index is reordered so that leaf nodes
+ * refer to ranges of it. nodes must hold 2*n - 1 nodes, returns the number
+ * of nodes used. */
+int
+rbp_bvh_build(rbp_bvh_node *nodes, Vector3 *min, Vector3 *max, int *index,
+    int n, int leaf)
+{
+	int stack[64][3]; /* parent to patch, first and last box */
+	int top = 0;
+	int nnodes = 0;
+	int i;
+
+	if (n == 0) {
+		return 0;
+	}
+
+	/* Same layout as the trimesh BVH */
+	stack[top][0] = -1;
+	stack[top][1] = 0;
+	stack[top][2] = n;
+	top++;
+
+	while (top > 0) {
+		top--;
+		int parent = stack[top][0];
+		int first = stack[top][1];
+		int last = stack[top][2];
+		int current = nnodes++;
+		rbp_bvh_node *node = &nodes[current];
+		Vector3 bmin = {FLT_MAX, FLT_MAX, FLT_MAX};
+		Vector3 bmax = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+		Vector3 cmin = bmin;
+		Vector3 cmax = bmax;
+
+		if (parent >= 0) {
+			/* this is a right child */
+			nodes[parent].first = current;
+		}
+
+		for (i = first; i < last; i++) {
+			Vector3 c = Vector3Add(min[index[i]], max[index[i]]);
+			bmin = Vector3Min(bmin, min[index[i]]);
+			bmax = Vector3Max(bmax, max[index[i]]);
+			cmin = Vector3Min(cmin, c);
+			cmax = Vector3Max(cmax, c);
+		}
+		node->min[0] = bmin.x;
+		node->min[1] = bmin.y;
+		node->min[2] = bmin.z;
+		node->max[0] = bmax.x;
+		node->max[1] = bmax.y;
+		node->max[2] = bmax.z;
+
+		if (last - first <= leaf || top >= 62) {
+			/* leaf */
+			node->first = first;
+			node->count = last - first;
+			continue;
+		}
+
+		/* Partial sort around the median along the longest axis */
+		Vector3 ext = Vector3Subtract(cmax, cmin);
+		int axis = ext.x > ext.y ? (ext.x > ext.z ? 0 : 2) :
+		    (ext.y > ext.z ? 1 : 2);
+		int mid = (first + last) / 2;
+		int lo = first;
+		int hi = last - 1;
+		while (lo < hi) {
+			int p = index[(lo + hi)/2];
+			float pivot = rbp_aabb_center(min[p], max[p], axis);
+			int l = lo;
+			int r = hi;
+			while (l <= r) {
+				while (rbp_aabb_center(min[index[l]], max[index[l]],
+				    axis) < pivot)
+					l++;
+				while (rbp_aabb_center(min[index[r]], max[index[r]],
+				    axis) > pivot)
+					r--;
+				if (l <= r) {
+					int t = index[l];
+					index[l] = index[r];
+					index[r] = t;
+					l++;
+					r--;
+				}
+			}
+			if (mid <= r) {
+				hi = r;
+			} else if (mid >= l) {
+				lo = l;
+			} else {
+				break;
+			}
+		}
+		node->count = 0;
+
+		/* Push the right range first so the left one is built next */
+		stack[top][0] = current;
+		stack[top][1] = mid;
+		stack[top][2] = last;
+		top++;
+		stack[top][0] = -1;
+		stack[top][1] = first;
+		stack[top][2] = mid;
+		top++;
+	}
+	return nnodes;
+}
+
+/* Makes the bounds of body i of w be computed again by the next
+ * rbp_world_bounds call and reads its collision filter again. Needed after
+ * moving a static body, changing a collider or its filter or turning a body
+ * static or dynamic, moving dynamic bodies is noticed on its own. */
+void
+rbp_world_dirty(rbp_world *w, int i)
+{
+	unsigned char fixed = w->fixed[i];
+
+	w->sdirty |= fixed;
+	w->stale[i] = 1;
+	w->fixed[i] = rbp_body_mass(w->bodies[i]) == 0.0f;
+	w->sdirty |= w->fixed[i];
+	w->ddirty |= fixed != w->fixed[i];
+	if (fixed && !w->fixed[i]) {
+		/* steps don't clear the forces of static bodies */
+		rbp_clear_forces(w->bodies[i]);
+	}
+	rbp_world_filter(w, i);
+}
+
+/* Lists the dynamic bodies of w again if they changed since the last call */
+void
+rbp_world_dynamic(rbp_world *w)
+{
+	int i;
+
+	if (!w->ddirty) {
+		return;
+	}
+	w->ndynamic = 0;
+	for (i = 0; i < w->nbodies; i++) {
+		w->dynamic[w->ndynamic] = i;
+		w->ndynamic += !w->fixed[i];
+	}
+	w->ddirty = 0;
+}
+
+/* Computes again the bounds of the bodies of w that moved since their last
+ * computation. Static bodies are skipped unless marked by rbp_world_dirty,
+ * which also marks the static BVH dirty, so they are only looked at then.
+ * The bodies to do are listed first, then their bounds are computed in a
+ * single tight loop. Returns the number of bounds computed. */
+int
+rbp_world_bounds(rbp_world *w)
+{
+	int *todo = w->todo;
+	int d, i, n = 0;
+
+	rbp_world_dynamic(w);
+	if (w->sdirty) {
+		for (i = 0; i < w->nbodies; i++) {
+			/* static, the body itself isn't even read */
+			todo[n] = i;
+			n += w->fixed[i] & w->stale[i];
+		}
+	}
+	for (d = 0; d < w->ndynamic; d++) {
+		i = w->dynamic[d];
+		rbp_body *b = w->bodies[i];
+		Vector3 p = w->apos[i];
+		Quaternion q = w->adir[i];
+		int moved = b->pos.x != p.x || b->pos.y != p.y ||
+		    b->pos.z != p.z || b->dir.x != q.x || b->dir.y != q.y ||
+		    b->dir.z != q.z || b->dir.w != q.w;
+		todo[n] = i;
+		n += moved | w->stale[i];
+	}
+
+	for (i = 0; i < n; i++) {
+		int k = todo[i];
+		rbp_body *b = w->bodies[k];
+		rbp_collider_aabb(b, &w->min[k], &w->max[k]);
+		w->apos[k] = b->pos;
+		w->adir[k] = b->dir;
+		w->stale[k] = 0;
+	}
+	return n;
+}
+
+/* Rebuilds the BVH of the static bodies of w. Returns 0 if out of memory,
+ * the static bodies are then left out of the broadphase until a rebuild
+ * succeeds. */
+int
+rbp_world_statics(rbp_world *w)
+{
+	int i, n = 0;
+
+	for (i = 0; i < w->nbodies; i++) {
+		n += w->fixed[i];
+	}
+	free(w->sleaves);
+	free(w->smem);
+	w->sleaves = NULL;
+	w->smem = NULL;
+	w->nsnodes = 0;
+	w->nstatic = 0;
+	w->sdirty = 0;
+	if (n == 0) {
+		return 1;
+	}
+
+	w->sleaves = malloc(n*sizeof(*w->sleaves));
+	w->smem = malloc(2*n*sizeof(rbp_bvh_node) + RBP_CACHE_LINE);
+	if (w->sleaves == NULL || w->smem == NULL) {
+		w->sdirty = 1; /* try again next time */
+		return 0;
+	}
+	w->snodes = (rbp_bvh_node *) (((size_t) w->smem + RBP_CACHE_LINE - 1) &
+	    ~((size_t) RBP_CACHE_LINE - 1));
+	for (i = 0; i < w->nbodies; i++) {
+		if (w->fixed[i]) {
+			w->sleaves[w->nstatic++] = i;
+		}
+	}
+	w->nsnodes = rbp_bvh_build(w->snodes, w->min, w->max, w->sleaves,
+	    w->nstatic, RBP_BVH_LEAF);
+	return 1;
+}
+
+/* Updates the bounds of the bodies of w that moved and rebuilds the BVH
+ * over the dynamic ones, the static BVH only when it is dirty. Call it once
+ * per step, after the bodies moved. */
+void
+rbp_world_broadphase(rbp_world *w)
+{
+	int d;
+
+	rbp_world_bounds(w);
+	if (w->sdirty) {
+		rbp_world_statics(w);
+	}
+	for (d = 0; d < w->ndynamic; d++) {
+		w->leaves[d] = w->dynamic[d];
+	}
+	w->nnodes = rbp_bvh_build(w->nodes, w->min, w->max, w->leaves,
+	    w->ndynamic, RBP_BVH_LEAF);
+}
+
+/* Gets BVH t of w, 0 for the dynamic bodies and 1 for the static ones, and
+ * returns its number of nodes. Queries walk both. */
+int
+rbp_world_tree(rbp_world *w, int t, rbp_bvh_node **nodes, int **leaves)
+{
+	if (t == 0) {
+		*nodes = w->nodes;
+		*leaves = w->leaves;
+		return w->nnodes;
+	}
+	*nodes = w->snodes;
+	*leaves = w->sleaves;
+	return w->nsnodes;
+}
+
+/* Starts a new step of w: the pairs and contacts of the last one are
+ * dropped along with the rest of its arena */
+void
+rbp_world_begin(rbp_world *w)
+{
+	rbp_arena_reset(&w->arena);
+	w->npairs = 0;
+	w->pcapacity = 0;
+	w->pairs = NULL;
+	w->ncontacts = 0;
+	w->ccapacity = 0;
+	w->contacts = NULL;
+	w->nnext = 0;
+	w->nbegin = 0;
+	w->begin = NULL;
+	w->npersist = 0;
+	w->persist = NULL;
+	w->nend = 0;
+	w->end = NULL;
+}
+
+/* Makes room for n elements of size bytes in the array *p holding
+ * *capacity elements, in the arena of w. Returns 0 if out of memory,
+ * leaving *p as it was. */
+int
+rbp_world_grow(rbp_world *w, void **p, int *capacity, int n, size_t size)
+{
+	int c = *capacity ? *capacity : RBP_WORLD_CAPACITY;
+	void *q;
+
+	if (n <= *capacity) {
+		return 1;
+	}
+	while (c < n) {
+		c *= 2;
+	}
+	q = rbp_arena_resize(&w->arena, *p, *capacity*size, c*size);
+	if (q == NULL) {
+		return 0;
+	}
+	*p = q;
+	*capacity = c;
+	return 1;
+}
+
+/* Makes room for n keys in the array *p holding *capacity keys, on the
+ * heap since keys outlive the step. Returns 0 if out of memory, leaving *p
+ * as it was. */
+int
+rbp_world_grow_keys(rbp_pair_key **p, int *capacity, int n)
+{
+	int c = *capacity ? *capacity : RBP_WORLD_CAPACITY;
+	rbp_pair_key *q;
+
+	if (n <= *capacity) {
+		return 1;
+	}
+	while (c < n) {
+		c *= 2;
+	}
+	q = realloc(*p, c*sizeof(*q));
+	if (q == NULL) {
+		return 0;
+	}
+	*p = q;
+	*capacity = c;
+	return 1;
+}
+
+/* Appends to w->pairs the bodies of BVH t of w whose bounds overlap those
+ * of dynamic body i and whose collision filter lets them collide with it.
+ * Returns 0 if out of memory. */
+int
+rbp_world_pairs_tree(rbp_world *w, int i, int t)
+{
+	unsigned int category = w->category[i];
+	unsigned int mask = w->mask[i];
+	int group = w->group[i];
+	rbp_bvh_node *nodes;
+	int *leaves;
+	int stack[64];
+	int top = 0;
+	int j;
+
+	if (rbp_world_tree(w, t, &nodes, &leaves) > 0) {
+		stack[top++] = 0;
+	}
+	while (top > 0) {
+		int k = stack[--top];
+		rbp_bvh_node *node = &nodes[k];
+		Vector3 nmin = {node->min[0], node->min[1], node->min[2]};
+		Vector3 nmax = {node->max[0], node->max[1], node->max[2]};
+
+		if (!rbp_aabb_overlap(w->min[i], w->max[i], nmin, nmax)) {
+			continue;
+		}
+		if (node->count == 0) {
+			stack[top++] = node->first; /* right */
+			stack[top++] = k + 1; /* left */
+			continue;
+		}
+		for (j = node->first; j < node->first + node->count; j++) {
+			int other = leaves[j];
+			/* dynamic pairs are found from both ends, keep one */
+			if ((t == 0 && other <= i) ||
+			    !rbp_filter_test(category, mask, group,
+			    w->category[other], w->mask[other],
+			    w->group[other]) ||
+			    !rbp_aabb_overlap(w->min[i], w->max[i],
+			    w->min[other], w->max[other])) {
+				continue;
+			}
+			if (!rbp_world_grow(w, (void **) &w->pairs,
+			    &w->pcapacity, w->npairs + 1, sizeof(*w->pairs))) {
+				return 0;
+			}
+			w->pairs[w->npairs].a = i < other ? i : other;
+			w->pairs[w->npairs].b = i < other ? other : i;
+			w->npairs++;
+		}
+	}
+	return 1;
+}
+
+/* Finds every pair of bodies of w whose bounds overlap by querying both
+ * BVHs with the bounds of each dynamic body, and stores them in w->pairs,
+ * in the arena of w. Static bodies never query, so pairs of two static
+ * bodies are never even looked at. Pairs rejected by the collision filters
+ * of the bodies are left out, the narrowphase never sees them. Returns the
+ * number of pairs, or -1 if out of memory. */
+int
+rbp_world_pairs(rbp_world *w)
+{
+	int d;
+
+	w->npairs = 0;
+	for (d = 0; d < w->ndynamic; d++) {
+		if (!rbp_world_pairs_tree(w, w->leaves[d], 0) ||
+		    !rbp_world_pairs_tree(w, w->leaves[d], 1)) {
+			return -1;
+		}
+	}
+	return w->npairs;
+}
+
+/* Runs the narrowphase over the pairs of w and stores every contact point
+ * in w->contacts, in the arena of w, and the touching pairs in w->next.
+ * Returns the number of contacts, or -1 if out of memory. */
+int
+rbp_world_collide(rbp_world *w)
+{
+	rbp_manifold m;
+	int i, k;
+
+	w->ncontacts = 0;
+	w->nnext = 0;
+	if (!rbp_world_grow_keys(&w->next, &w->ncapacity, w->npairs)) {
+		return -1;
+	}
+	for (i = 0; i < w->npairs; i++) {
+		rbp_body *b1 = w->bodies[w->pairs[i].a];
+		rbp_body *b2 = w->bodies[w->pairs[i].b];
+		int n = rbp_collide_manifold(b1, b2, &m);
+		if (n == 0) {
+			continue;
+		}
+		RBP_PROF_HIT(rbp_shape_type(b1), rbp_shape_type(b2));
+		w->next[w->nnext++] = rbp_pair_key_make(w->pairs[i].a,
+		    w->pairs[i].b);
+		if (!rbp_world_grow(w, (void **) &w->contacts, &w->ccapacity,
+		    w->ncontacts + n, sizeof(*w->contacts))) {
+			return -1;
+		}
+		for (k = 0; k < n; k++) {
+			rbp_manifold_contact(&m, k, &w->contacts[w->ncontacts++]);
+		}
+	}
+	return w->ncontacts;
+}
+
+/* Makes the contact events of the step of w out of the pairs touching
+ * after the last step and those gathered by rbp_world_collide. Both sets
+ * are sorted, so a single merge splits them into begin, persist and end in
+ * O(pairs), and the events take three arena allocations whatever their
+ * number. The touching pairs of this step then become those of the last
+ * one. Returns 0 if out of memory, there are then no events and the last
+ * pairs are kept. */
+int
+rbp_world_events(rbp_world *w)
+{
+	rbp_pair_key *next, *tmp, *t;
+	int i = 0, j = 0;
+
+	/* one spare element each, so that no size is 0 */
+	tmp = rbp_arena_alloc(&w->arena, (w->nnext + 1)*sizeof(*tmp));
+	w->begin = rbp_arena_alloc(&w->arena, (w->nnext + 1)*sizeof(*w->begin));
+	w->persist = rbp_arena_alloc(&w->arena,
+	    (w->nnext + 1)*sizeof(*w->persist));
+	w->end = rbp_arena_alloc(&w->arena, (w->nkeys + 1)*sizeof(*w->end));
+	w->nbegin = 0;
+	w->npersist = 0;
+	w->nend = 0;
+	if (tmp == NULL || w->begin == NULL || w->persist == NULL ||
+	    w->end == NULL) {
+		return 0;
+	}
+
+	next = rbp_pair_key_sort(w->next, tmp, w->nnext);
+	while (i < w->nkeys || j < w->nnext) {
+		if (j == w->nnext || (i < w->nkeys && w->keys[i] < next[j])) {
+			w->end[w->nend++] = rbp_pair_key_pair(w->keys[i++]);
+		} else if (i == w->nkeys || next[j] < w->keys[i]) {
+			w->begin[w->nbegin++] = rbp_pair_key_pair(next[j++]);
+		} else {
+			w->persist[w->npersist++] =
+			    rbp_pair_key_pair(next[j++]);
+			i++;
+		}
+	}
+
+	/* the sorted keys may be in tmp, bring them home before the swap */
+	if (next != w->next) {
+		memcpy(w->next, next, w->nnext*sizeof(*next));
+	}
+	t = w->keys;
+	w->keys = w->next;
+	w->next = t;
+	i = w->kcapacity;
+	w->kcapacity = w->ncapacity;
+	w->ncapacity = i;
+	w->nkeys = w->nnext;
+	w->nnext = 0;
+	return 1;
+}
+
+/* Advances every body of w by dt, starting with rbp_world_begin:
+ * 1. accumulated forces and world gravity turn into momentum;
+ * 2. the broadphase finds the pairs with overlapping bounds;
+ * 3. the narrowphase finds their contacts, which are resolved together,
+ * and the contact events, see rbp_world_events;
+ * 4. the bodies move with their new velocities, see w->integrator.
+ * Returns 0 if out of memory, the step is then done without collisions or
+ * at least without events. */
+int
+rbp_world_step(rbp_world *w, float dt)
+{
+	rbp_body **moving;
+	int d, ok = 1;
+
+	RBP_PROF_BEGIN(RBP_PHASE_STEP);
+	rbp_world_begin(w);
+	RBP_PROF_BEGIN(RBP_PHASE_INTEGRATE);
+	/* static bodies are left alone, forces on them are never read */
+	rbp_world_dynamic(w);
+	moving = rbp_arena_alloc(&w->arena, w->ndynamic*sizeof(*moving));
+	for (d = 0; d < w->ndynamic; d++) {
+		rbp_body *b = w->bodies[w->dynamic[d]];
+		rbp_integrate(b, w->gravity, dt);
+		if (moving != NULL) {
+			moving[d] = b;
+		}
+	}
+	RBP_PROF_COUNT(bodies, w->ndynamic);
+	RBP_PROF_END(RBP_PHASE_INTEGRATE);
+
+	RBP_PROF_BEGIN(RBP_PHASE_BROADPHASE);
+	rbp_world_broadphase(w);
+	RBP_PROF_END(RBP_PHASE_BROADPHASE);
+	RBP_PROF_BEGIN(RBP_PHASE_PAIRS);
+	ok = rbp_world_pairs(w) >= 0;
+	RBP_PROF_END(RBP_PHASE_PAIRS);
+	RBP_PROF_BEGIN(RBP_PHASE_COLLIDE);
+	ok = ok && rbp_world_collide(w) >= 0;
+	if (!ok) {
+		w->ncontacts = 0;
+	} else if (!rbp_world_events(w)) {
+		ok = 0; /* the contacts are still good */
+	}
+	RBP_PROF_COUNT(pairs, w->npairs);
+	RBP_PROF_END(RBP_PHASE_COLLIDE);
+
+	RBP_PROF_BEGIN(RBP_PHASE_RESOLVE);
+	if (w->ncontacts > 0) {
+		/* solver scratch in the arena, so worlds step independently */
+		void *mem = rbp_arena_alloc(&w->arena,
+		    rbp_constraints_size(w->ncontacts));
+		if (mem != NULL) {
+			rbp_resolve_contacts(mem, w->contacts, w->ncontacts,
+			    w->iterations, dt);
+			RBP_PROF_COUNT(contacts, w->ncontacts);
+			RBP_PROF_COUNT(iterations, w->iterations);
+		} else {
+			ok = 0;
+		}
+	}
+	RBP_PROF_END(RBP_PHASE_RESOLVE);
+
+	RBP_PROF_BEGIN(RBP_PHASE_UPDATE);
+	if (moving != NULL) {
+		rbp_update_bodies(moving, w->ndynamic, w->integrator, dt);
+	} else {
+		/* no list, rbp_update_bodies skips the static bodies itself */
+		rbp_update_bodies(w->bodies, w->nbodies, w->integrator, dt);
+		ok = 0;
+	}
+	RBP_PROF_END(RBP_PHASE_UPDATE);
+	RBP_PROF_END(RBP_PHASE_STEP);
+	return ok;
+}
@@ -26,6 +26,10 @@ DEALINGS IN THE SOFTWARE.
 rbphys is a simple rigid body physics library based on raymath.
 */
 
+#include <float.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <raymath.h>
 
 /* Shorthands for raymath functions */
@@ -38,78 +42,289 @@ typedef enum {
 	HEIGHTMAP = 0,
 	SPHERE,
 	CUBOID,
+	CAPSULE,
+	CONVEX,
+	TRIMESH,
+	COMPOUND,
 } rbp_collider_type;
 
-/*  This is the 'parent' struct that should be 'inherited' by all collider
- * types.
- * collider_type = shape of the collider;
- * offset = position of the collider relative to body position;
- * e = partial coefficient of restitution;
- * uf_s = coefficient of friction (static);
- * uf_d = coefficient of friction (dynamic);
+/*  This is the 'parent' struct that should be 'inherited' by all shape
+ * types. Shapes hold only geometry, they are never modified by the engine
+ * and can be shared by any number of colliders.
+ * shape_type = kind of shape;
+ * refs = number of colliders using the shape, see rbp_shape_retain;
  */
-typedef struct rbp_collider {
+typedef struct rbp_shape {
 #define \
-	RBP_COLLIDER_PROPS \
-	rbp_collider_type collider_type; \
-	Vector3 offset; \
-	float e; \
-	float uf_s; \
-	float uf_d; 
-
-	RBP_COLLIDER_PROPS
-} rbp_collider;
+	RBP_SHAPE_PROPS \
+	rbp_collider_type shape_type; \
+	int refs;
 
-typedef struct rbp_collider_sphere {
-	RBP_COLLIDER_PROPS /* inherit from rbp_collider */
+	RBP_SHAPE_PROPS
+} rbp_shape;
+
+typedef struct rbp_shape_sphere {
+	RBP_SHAPE_PROPS /* inherit from rbp_shape */
 
 	float radius;
-} rbp_collider_sphere;
+} rbp_shape_sphere;
 
-typedef struct rbp_collider_cuboid {
-	RBP_COLLIDER_PROPS /* inherit from rbp_collider */
+typedef struct rbp_shape_cuboid {
+	RBP_SHAPE_PROPS /* inherit from rbp_shape */
 
 	Quaternion dir;
 	float xsize;
 	float ysize;
 	float zsize;
-} rbp_collider_cuboid;
+} rbp_shape_cuboid;
 
-typedef struct rbp_collider_heightmap {
-	RBP_COLLIDER_PROPS /* inherit from rbp_collider */
-} rbp_collider_heightmap;
+/* Capsule: a segment of the given length along the collider y axis, rotated
+ * by dir, swept by a sphere of the given radius */
+typedef struct rbp_shape_capsule {
+	RBP_SHAPE_PROPS /* inherit from rbp_shape */
 
-/* Body data type */
-typedef struct rbp_body {
-	/* Mass, and its inverse, inertia tensor and its inverse in body space */
-	float m;
-	float minv;
+	Quaternion dir;
+	float radius;
+	float length;
+} rbp_shape_capsule;
+
+/* Convex hull: nverts vertices in collider space, rotated by dir, and the
+ * ntris triangles between them (3 vertex indices each). The neighbors of
+ * vertex i are adj[adj_start[i]] to adj[adj_start[i+1] - 1]. center is an
+ * interior point. Use rbp_convex_init to fill adj_start, adj and center.
+ */
+typedef struct rbp_shape_convex {
+	RBP_SHAPE_PROPS /* inherit from rbp_shape */
+
+	Quaternion dir;
+	int nverts;
+	Vector3 *verts;
+	int ntris;
+	int *tris;
+	int *adj_start;
+	int *adj;
+	Vector3 center;
+} rbp_shape_convex;
+
+/* Triangle mesh BVH node, 32 bytes so that 2 nodes fit a cache line.
+ * min, max = bounds of the node
+ * count = number of triangles of a leaf, 0 for inner nodes
+ * first = first triangle of a leaf, or index of the right child of an
+ * inner node (the left child is always the next node)
+ */
+typedef struct rbp_bvh_node {
+	float min[3];
+	int first;
+	float max[3];
+	int count;
+} rbp_bvh_node;
+
+#ifndef RBP_CACHE_LINE
+#define RBP_CACHE_LINE 64
+#endif
+#ifndef RBP_BVH_LEAF
+#define RBP_BVH_LEAF 4
+#endif
+/* Number of candidate triangles gathered at a time when testing a shape
+ * against a trimesh, more are taken in further rounds */
+#ifndef RBP_TRIMESH_CANDIDATES
+#define RBP_TRIMESH_CANDIDATES 256
+#endif
+
+/* Static triangle mesh, placed by the position and orientation of its
+ * body. Built once by rbp_trimesh_build, tris holds 3 vertex indices per
+ * triangle.
+ */
+typedef struct rbp_shape_trimesh {
+	RBP_SHAPE_PROPS /* inherit from rbp_shape */
+
+	int nverts;
+	Vector3 *verts;
+	int ntris;
+	int *tris;
+	int nnodes;
+	rbp_bvh_node *nodes;
+	void *mem; /* unaligned allocation of nodes */
+} rbp_shape_trimesh;
+
+/* Maximum number of spheres used to sample a capsule against a heightmap,
+ * the two ends at least */
+#ifndef RBP_CAPSULE_SAMPLES
+#define RBP_CAPSULE_SAMPLES 16
+#endif
+#if RBP_CAPSULE_SAMPLES < 2
+#error "RBP_CAPSULE_SAMPLES must be at least 2"
+#endif
+
+/* Heightmap: a grid of width*depth samples spanning xsize and zsize along
+ * the x and z axes from the collider position, like raylib's
+ * GenMeshHeightmap. heights are in [0, 1] and scaled by ysize. Heightmaps
+ * are axis aligned, the orientation of their body is ignored.
+ */
+typedef struct rbp_shape_heightmap {
+	RBP_SHAPE_PROPS /* inherit from rbp_shape */
+
+	int width;
+	int depth;
+	float xsize;
+	float ysize;
+	float zsize;
+	float *heights;
+} rbp_shape_heightmap;
+
+/* Material data type:
+ * e = partial coefficient of restitution;
+ * uf_s = coefficient of friction (static);
+ * uf_d = coefficient of friction (dynamic);
+ */
+typedef struct rbp_material {
+	float e;
+	float uf_s;
+	float uf_d;
+} rbp_material;
+
+/* How the coefficients of two materials combine into those of a contact */
+typedef enum {
+	RBP_COMBINE_MULTIPLY = 0,
+	RBP_COMBINE_SUM,
+	RBP_COMBINE_AVERAGE,
+	RBP_COMBINE_MIN,
+	RBP_COMBINE_MAX,
+} rbp_combine_rule;
+
+#ifndef RBP_MAX_MATERIALS
+#define RBP_MAX_MATERIALS 16
+#endif
+
+/* Material table: materials are registered with rbp_material_add and
+ * every pair of them is combined up front, so contacts only carry the
+ * index of their pair, see rbp_material_pair.
+ * n = number of materials in use;
+ * e_rule, uf_s_rule, uf_d_rule = combine rule of each coefficient;
+ * pairs = combined coefficients of every pair of materials;
+ * Material 0 is the default one. With the default rules it is neutral: a
+ * pair with it takes the coefficients of the other material.
+ */
+typedef struct rbp_material_table {
+	int n;
+	rbp_material materials[RBP_MAX_MATERIALS];
+	rbp_combine_rule e_rule;
+	rbp_combine_rule uf_s_rule;
+	rbp_combine_rule uf_d_rule;
+	rbp_material pairs[RBP_MAX_MATERIALS*RBP_MAX_MATERIALS];
+} rbp_material_table;
+
+rbp_material_table rbp_materials = {
+	1,
+	{{1.0f, 0.0f, 0.0f}},
+	RBP_COMBINE_MULTIPLY,
+	RBP_COMBINE_SUM,
+	RBP_COMBINE_SUM,
+	{{1.0f, 0.0f, 0.0f}}};
+
+/* A collider places a shape on a body, one per body while the shape itself
+ * is shared.
+ * shape = pointer to the shape;
+ * offset = position of the collider relative to body position;
+ * material = index of the collider material in rbp_materials;
+ * hint = vertex where the next support search of a convex shape starts,
+ * written by collision queries, one reason a collider belongs to a single
+ * body. The children of a compound are shared and only read, queries work
+ * on copies of them;
+ * category, mask, group = collision filter, see rbp_filter_test. A zero
+ * category, as in a zeroed collider, stands for category 1 colliding with
+ * every category;
+ */
+typedef struct rbp_collider {
+	void *shape;
+	Vector3 offset;
+	int material;
+	int hint;
+	unsigned int category;
+	unsigned int mask;
+	int group;
+} rbp_collider;
+
+/* Compound: a set of child colliders moving with a single body. The offset
+ * of a child is its position in the body frame and turns with the body,
+ * children with a dir use it as their orientation relative to the body.
+ * Contacts use the materials of the children.
+ * nodes = local AABB tree over the children, built by rbp_compound_init
+ */
+typedef struct rbp_shape_compound {
+	RBP_SHAPE_PROPS /* inherit from rbp_shape */
+
+	int nchildren;
+	rbp_collider *children;
+	int nnodes;
+	rbp_bvh_node *nodes;
+} rbp_shape_compound;
+
+/* Body properties, set once and rarely read while stepping, kept apart
+ * from the body state so that the loops over bodies don't drag them through
+ * the cache. Arrays of bodies keep them in an array of their own, see
+ * rbp_pool.
+ * m = mass, 0 for a static body
+ * Ib = inertia tensor in body space
+ * collider = the body collider
+ */
+typedef struct rbp_body_props {
 	Matrix Ib;
-	Matrix Ibinv;
+	rbp_collider *collider;
+	float m;
+} rbp_body_props;
 
+/* Body data type: the state read and written by every step. props points
+ * to the properties of the body and must be set before
+ * rbp_calculate_properties, they are read through rbp_body_mass,
+ * rbp_body_inertia and rbp_body_collider. */
+typedef struct rbp_body {
 	/* state:
+	 * dir = orientation quaternion
 	 * pos = position in world space
 	 * p = linear momentum
-	 * dir = orientation quaternion
 	 * L = angular momentum
 	 */
-
+	Quaternion dir;
 	Vector3 pos;
 	Vector3 p;
-	Quaternion dir;
 	Vector3 L;
 
-	/* Function pointer to support-mapping for collision detection
-	 * Attention: must return support points in world space! */
-	/* Vector3 (*support)(struct rbp_body *self, Vector3 direction); */
+	/* Inverse mass, 0 for a static body, and inverse inertia tensor in
+	 * body space, set by rbp_calculate_properties */
+	float minv;
+	Matrix Ibinv;
+
+	/* bias velocities used for position correction, see
+	 * rbp_resolve_penetration:
+	 * vb = linear bias velocity
+	 * wb = angular bias velocity
+	 */
+	Vector3 vb;
+	Vector3 wb;
+
+	/* force accumulators, turned into momentum and cleared by
+	 * rbp_integrate:
+	 * F = force in world space
+	 * T = torque in world space, about pos
+	 * Fb = force in body space
+	 * Tb = torque in body space, about pos
+	 */
+	Vector3 F;
+	Vector3 T;
+	Vector3 Fb;
+	Vector3 Tb;
 
-	/* Pointer to a body collider */
-	void *collider;
+	/* Properties of the body */
+	rbp_body_props *props;
 } rbp_body;
 
-/* Ditching gjk and mpr in favor of a simple analytical collision system */
-/* #include "rbp-gjk.h" */
-/* #include "rbp-mpr.h" */
+/* Force batch entry: force applied to body at world space coordinate pos */
+typedef struct rbp_force {
+	rbp_body *body;
+	Vector3 force;
+	Vector3 pos;
+} rbp_force;
 
 /* Collision contact data type */
 typedef struct rbp_contact {
@@ -119,9 +334,7 @@ typedef struct rbp_contact {
 	 * p2 = contact point for b2 in world space
 	 * cn = collision normal (b1->b2, interior points)
 	 * depth = penetration depth
-	 * e = coefficient of restitution of the collision
-	 * uf_s = coefficient of friction (static)
-	 * uf_d = coefficient of friction (dynamic)
+	 * pair = material pair of the collision, index of rbp_materials.pairs
 	 */
 	rbp_body *b1;
 	rbp_body *b2;
@@ -129,11 +342,49 @@ typedef struct rbp_contact {
 	Vector3 p2;
 	Vector3 cn;
 	float depth;
-	float e;
-	float uf_s;
-	float uf_d;
+	int pair;
 } rbp_contact;
 
+/* Collision manifold data type: all the contact points between a pair of
+ * bodies that share a single collision normal (e.g. a box resting on a face).
+ */
+#define RBP_MANIFOLD_MAX 4
+typedef struct rbp_manifold {
+
+	/* b1, b2, cn and pair = same as in rbp_contact
+	 * n = number of contact points in use
+	 * p1[i] = i-th contact point for b1 in world space
+	 * p2[i] = i-th contact point for b2 in world space
+	 * depth[i] = penetration depth at the i-th contact point
+	 */
+	rbp_body *b1;
+	rbp_body *b2;
+	Vector3 cn;
+	int pair;
+	int n;
+	Vector3 p1[RBP_MANIFOLD_MAX];
+	Vector3 p2[RBP_MANIFOLD_MAX];
+	float depth[RBP_MANIFOLD_MAX];
+} rbp_manifold;
+
+/* Solver settings:
+ * baumgarte = fraction of the penetration corrected per step;
+ * slop = penetration depth that is tolerated without correction;
+ */
+#ifndef RBP_BAUMGARTE
+#define RBP_BAUMGARTE 0.2f
+#endif
+#ifndef RBP_SLOP
+#define RBP_SLOP 0.01f
+#endif
+
+typedef struct rbp_solver_settings {
+	float baumgarte;
+	float slop;
+} rbp_solver_settings;
+
+rbp_solver_settings rbp_solver = {RBP_BAUMGARTE, RBP_SLOP};
+
 /* Additional math functions */
 Vector4
 MatrixVectorMultiply(Matrix m, Vector4 v)
@@ -163,50 +414,86 @@ rbp_wtobspace(rbp_body *b, Vector3 v)
 	return Vector3Add(b->pos, Vector3RotateByQuaternion(v, b->dir));
 }
 
+/* Properties of body b */
+float
+rbp_body_mass(rbp_body *b)
+{
+	return b->props->m;
+}
+
+Matrix
+rbp_body_inertia(rbp_body *b)
+{
+	return b->props->Ib;
+}
+
+rbp_collider *
+rbp_body_collider(rbp_body *b)
+{
+	return b->props->collider;
+}
+
+/* Derives the inverse mass and inertia of body b from its properties.
+ * Static bodies get zero ones, which is what the step loops test. */
 void
 rbp_calculate_properties(rbp_body *b)
 {
-	if (b->m == 0.0f) {
+	rbp_body_props *props = b->props;
+
+	b->vb = Vector3Zero();
+	b->wb = Vector3Zero();
+
+	if (props->m == 0.0f) {
 		/* static body */
 		b->minv = 0.0f;
-		b->Ib = MatrixScale(0.0f, 0.0f, 0.0f);
-		b->Ibinv = b->Ib;
+		props->Ib = MatrixScale(0.0f, 0.0f, 0.0f);
+		b->Ibinv = props->Ib;
 		return;
 	}
 	/* dynamic body */
-	b->minv = 1.0f/b->m;
-	b->Ibinv = MatrixInvert(b->Ib);
+	b->minv = 1.0f/props->m;
+	b->Ibinv = MatrixInvert(props->Ib);
 }
 
 /* Auxiliary variables */
 Vector3
 rbp_v(rbp_body *b)
 {
-	if (b->m == 0.0f) {
+	if (b->minv == 0.0f) {
 		/* static body */
 		return Vector3Zero();
 	}
 	return Vector3Scale(b->p, b->minv);
 }
 
+/* Inverse inertia tensor in world space, R * Ibinv * R^T. MatrixMultiply
+ * takes its factors right to left. */
 Matrix
 rbp_Iinv(rbp_body *b)
 {
 	Matrix R = QuaternionToMatrix(b->dir);
-	Matrix m1 = MatrixMultiply(R, b->Ibinv);
-	return MatrixMultiply(m1, MatrixTranspose(R));
+	Matrix m1 = MatrixMultiply(MatrixTranspose(R), b->Ibinv);
+	return MatrixMultiply(m1, R);
 }
 
+/* Angular velocity of body b if it had orientation dir. L is taken to body
+ * space and back with two rotations instead of building rbp_Iinv. */
 Vector3
-rbp_w(rbp_body *b)
+rbp_w_dir(rbp_body *b, Quaternion dir)
 {
-	if (b->m == 0.0f) {
+	if (b->minv == 0.0f) {
 		/* static body */
 		return Vector3Zero();
 	}
-	Vector4 L = (Vector4) {b->L.x, b->L.y, b->L.z, 0.0f};
-	Vector4 r = MatrixVectorMultiply(rbp_Iinv(b), L);
-	return (Vector3) {r.x, r.y, r.z};
+	Vector3 l = Vector3RotateByQuaternion(b->L, QuaternionInvert(dir));
+	l = MatrixVector3Multiply(b->Ibinv, l);
+	return Vector3RotateByQuaternion(l, dir);
+}
+
+Vector3
+rbp_w(rbp_body *b)
+{
+	return rbp_w_dir(b, b->dir);
 }
 
 /* Movement functions */
@@ -217,25 +504,137 @@ rbp_displace(rbp_body *b, float dt)
 	return Vector3Add(b->pos, Vector3Scale(rbp_v(b), dt));
 }
 
+/* Returns the derivative of orientation dir under angular velocity w,
+ * 1/2 * (w, 0) * dir */
+Quaternion
+rbp_dir_dt(Quaternion dir, Vector3 w)
+{
+	return (Quaternion) {
+		0.5f*(w.x*dir.w + w.y*dir.z - w.z*dir.y),
+		0.5f*(w.y*dir.w + w.z*dir.x - w.x*dir.z),
+		0.5f*(w.z*dir.w + w.x*dir.y - w.y*dir.x),
+		-0.5f*(w.x*dir.x + w.y*dir.y + w.z*dir.z)};
+}
+
+/* Returns dir + dq*dt */
+Quaternion
+rbp_dir_step(Quaternion dir, Quaternion dq, float dt)
+{
+	return (Quaternion) {dir.x + dq.x*dt, dir.y + dq.y*dt, dir.z + dq.z*dt,
+	    dir.w + dq.w*dt};
+}
+
+/* Returns orientation dir rotated by angular velocity w during dt. First
+ * order step along the quaternion derivative plus normalization, no trig. */
+Quaternion
+rbp_spin(Quaternion dir, Vector3 w, float dt)
+{
+	return QuaternionNormalize(rbp_dir_step(dir, rbp_dir_dt(dir, w), dt));
+}
+
 /* Returns the new orientation of body b after integrating by dt */
 Quaternion
 rbp_rotate(rbp_body *b, float dt)
 {
-	Vector3 w3dt = Vector3Scale(rbp_w(b), dt);
-	Quaternion rot = QuaternionFromAxisAngle(w3dt, Vector3Length(w3dt));
-	return QuaternionNormalize(QuaternionMultiply(rot, b->dir));
+	return rbp_spin(b->dir, rbp_w(b), dt);
+}
+
+/* Applies and discards the position correction of body b */
+void
+rbp_apply_bias(rbp_body *b, float dt)
+{
+	b->pos = Vector3Add(b->pos, Vector3Scale(b->vb, dt));
+	b->dir = rbp_spin(b->dir, b->wb, dt);
+	b->vb = Vector3Zero();
+	b->wb = Vector3Zero();
 }
 
 /* Simple shortcut to call both functions above and update the body */
 void
 rbp_update(rbp_body *b, float dt)
 {
-	if (b->m == 0.0f) {
+	if (b->minv == 0.0f) {
 		/* static body, skip update */
 		return;
 	}
 	b->pos = rbp_displace(b, dt);
 	b->dir = rbp_rotate(b, dt);
+	rbp_apply_bias(b, dt);
+}
+
+/* Integrators. Momenta are already up to date (see rbp_integrate), so they
+ * are constant over the step and every method moves the position along
+ * v = p/m exactly. They differ in the orientation update. */
+typedef enum {
+	RBP_SEMI_IMPLICIT_EULER = 0, /* one step with w at the start */
+	RBP_SYMPLECTIC_GYRO, /* one step with w at the half step orientation */
+	RBP_RK4 /* classic Runge-Kutta on the orientation */
+} rbp_integrator;
+
+/* Symplectic Euler with gyroscopic correction: the inertia tensor turns
+ * with the body during the step, so w is taken at the orientation of the
+ * half step. With L held constant this keeps the rotational energy of
+ * torque free bodies from drifting the way the plain step does. */
+void
+rbp_update_gyro(rbp_body *b, float dt)
+{
+	if (b->minv == 0.0f) {
+		return;
+	}
+	Quaternion half = rbp_spin(b->dir, rbp_w(b), 0.5f*dt);
+	b->pos = rbp_displace(b, dt);
+	b->dir = rbp_spin(b->dir, rbp_w_dir(b, half), dt);
+	rbp_apply_bias(b, dt);
+}
+
+void
+rbp_update_rk4(rbp_body *b, float dt)
+{
+	if (b->minv == 0.0f) {
+		return;
+	}
+	Quaternion q = b->dir;
+	Quaternion k1 = rbp_dir_dt(q, rbp_w_dir(b, q));
+	Quaternion q2 = QuaternionNormalize(rbp_dir_step(q, k1, 0.5f*dt));
+	Quaternion k2 = rbp_dir_dt(q2, rbp_w_dir(b, q2));
+	Quaternion q3 = QuaternionNormalize(rbp_dir_step(q, k2, 0.5f*dt));
+	Quaternion k3 = rbp_dir_dt(q3, rbp_w_dir(b, q3));
+	Quaternion q4 = QuaternionNormalize(rbp_dir_step(q, k3, dt));
+	Quaternion k4 = rbp_dir_dt(q4, rbp_w_dir(b, q4));
+
+	q = rbp_dir_step(q, k1, dt/6.0f);
+	q = rbp_dir_step(q, k2, dt/3.0f);
+	q = rbp_dir_step(q, k3, dt/3.0f);
+	q = rbp_dir_step(q, k4, dt/6.0f);
+	b->pos = rbp_displace(b, dt);
+	b->dir = QuaternionNormalize(q);
+	rbp_apply_bias(b, dt);
+}
+
+/* Moves the n bodies by dt with integrator method. The method is picked
+ * once for the whole batch, each loop runs a single kernel. */
+void
+rbp_update_bodies(rbp_body **bodies, int n, rbp_integrator method, float dt)
+{
+	int i;
+
+	switch (method) {
+	case RBP_SYMPLECTIC_GYRO:
+		for (i = 0; i < n; i++) {
+			rbp_update_gyro(bodies[i], dt);
+		}
+		break;
+	case RBP_RK4:
+		for (i = 0; i < n; i++) {
+			rbp_update_rk4(bodies[i], dt);
+		}
+		break;
+	default:
+		for (i = 0; i < n; i++) {
+			rbp_update(bodies[i], dt);
+		}
+		break;
+	}
 }
 
 void
@@ -269,14 +668,292 @@ rbp_bspace_force(rbp_body *b, Vector3 force, Vector3 pos, float dt)
 	rbp_wspace_force(b, wspace_force, wspace_pos, dt);
 }
 
+/* Force accumulation functions. Forces only add up in the accumulators of
+ * the body, rbp_integrate applies their sum once per step. */
+/* Adds the force applied at world space coordinate pos to body b */
+void
+rbp_add_force(rbp_body *b, Vector3 force, Vector3 pos)
+{
+	Vector3 r = Vector3Subtract(pos, b->pos);
+
+	b->F = Vector3Add(b->F, force);
+	b->T = Vector3Add(b->T, X(r, force));
+}
+
+/* Adds the force applied at body space coordinate pos to body b, with force
+ * in body space too. Nothing is rotated until rbp_integrate. */
+void
+rbp_add_bforce(rbp_body *b, Vector3 force, Vector3 pos)
+{
+	b->Fb = Vector3Add(b->Fb, force);
+	b->Tb = Vector3Add(b->Tb, X(pos, force));
+}
+
+/* Adds a world space torque to body b */
+void
+rbp_add_torque(rbp_body *b, Vector3 torque)
+{
+	b->T = Vector3Add(b->T, torque);
+}
+
+/* Adds the n forces of a batch to the accumulators of their bodies */
+void
+rbp_add_forces(rbp_force *forces, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		rbp_body *b = forces[i].body;
+		Vector3 r = Vector3Subtract(forces[i].pos, b->pos);
+		b->F = Vector3Add(b->F, forces[i].force);
+		b->T = Vector3Add(b->T, X(r, forces[i].force));
+	}
+}
+
+void
+rbp_clear_forces(rbp_body *b)
+{
+	b->F = Vector3Zero();
+	b->T = Vector3Zero();
+	b->Fb = Vector3Zero();
+	b->Tb = Vector3Zero();
+}
+
+/* Turns the forces accumulated by body b, plus the gravity acceleration g,
+ * into momentum over dt and clears the accumulators. Call it before
+ * rbp_update. */
+void
+rbp_integrate(rbp_body *b, Vector3 g, float dt)
+{
+	if (b->minv != 0.0f) {
+		/* Body space sums are rotated once here. The mass is taken
+		 * from minv, the properties stay out of the cache. */
+		Vector3 F = Vector3Add(b->F, Vector3RotateByQuaternion(b->Fb,
+		    b->dir));
+		Vector3 T = Vector3Add(b->T, Vector3RotateByQuaternion(b->Tb,
+		    b->dir));
+		F = Vector3Add(F, Vector3Scale(g, 1.0f/b->minv));
+		b->p = Vector3Add(b->p, Vector3Scale(F, dt));
+		b->L = Vector3Add(b->L, Vector3Scale(T, dt));
+	}
+	rbp_clear_forces(b);
+}
+
+/* Materials */
+/* Combines the coefficients a and b of two materials with rule */
+float
+rbp_combine(rbp_combine_rule rule, float a, float b)
+{
+	switch (rule) {
+	case RBP_COMBINE_SUM:
+		return a + b;
+	case RBP_COMBINE_AVERAGE:
+		return 0.5f*(a + b);
+	case RBP_COMBINE_MIN:
+		return fminf(a, b);
+	case RBP_COMBINE_MAX:
+		return fmaxf(a, b);
+	default:
+		return a * b;
+	}
+}
+
+/* Whether m is a valid material index */
+#define RBP_MATERIAL_VALID(m) ((m) >= 0 && (m) < RBP_MAX_MATERIALS)
+
+/* Sets the coefficients of the pair of materials m1 and m2. This overrides
+ * the combine rules for that pair until the next rbp_materials_combine.
+ * Does nothing if either index is out of range. */
+void
+rbp_material_pair_set(int m1, int m2, float e, float uf_s, float uf_d)
+{
+	rbp_material m = {e, uf_s, uf_d};
+
+	if (!RBP_MATERIAL_VALID(m1) || !RBP_MATERIAL_VALID(m2)) {
+		return;
+	}
+	rbp_materials.pairs[m1*RBP_MAX_MATERIALS + m2] = m;
+	rbp_materials.pairs[m2*RBP_MAX_MATERIALS + m1] = m;
+}
+
+/* Combines material i with every material, filling its row and column of
+ * the pair table */
+void
+rbp_material_combine(int i)
+{
+	rbp_material_table *t = &rbp_materials;
+	rbp_material *a = &t->materials[i];
+	int j;
+
+	for (j = 0; j < t->n; j++) {
+		rbp_material *b = &t->materials[j];
+		rbp_material_pair_set(i, j,
+		    rbp_combine(t->e_rule, a->e, b->e),
+		    rbp_combine(t->uf_s_rule, a->uf_s, b->uf_s),
+		    rbp_combine(t->uf_d_rule, a->uf_d, b->uf_d));
+	}
+}
+
+/* Recombines every pair of materials, call it after changing the rules */
+void
+rbp_materials_combine(void)
+{
+	int i;
+	for (i = 0; i < rbp_materials.n; i++) {
+		rbp_material_combine(i);
+	}
+}
+
+/* Registers a material and returns its index, or -1 if the table is full */
+int
+rbp_material_add(float e, float uf_s, float uf_d)
+{
+	rbp_material_table *t = &rbp_materials;
+
+	if (t->n >= RBP_MAX_MATERIALS) {
+		return -1;
+	}
+	t->materials[t->n] = (rbp_material) {e, uf_s, uf_d};
+	t->n++;
+	rbp_material_combine(t->n - 1);
+	return t->n - 1;
+}
+
+/* Returns the index of the pair of materials m1 and m2 in
+ * rbp_materials.pairs. An index out of range, like the -1 of a full
+ * table, stands for the default material 0. */
+int
+rbp_material_pair(int m1, int m2)
+{
+	m1 = RBP_MATERIAL_VALID(m1) ? m1 : 0;
+	m2 = RBP_MATERIAL_VALID(m2) ? m2 : 0;
+	return m1*RBP_MAX_MATERIALS + m2;
+}
+
+/* Shapes and colliders */
+/* Returns the kind of shape of the collider of body b */
+rbp_collider_type
+rbp_shape_type(rbp_body *b)
+{
+	rbp_shape *s = rbp_body_collider(b)->shape;
+	return s->shape_type;
+}
+
+/* Takes a reference to shape s and returns it */
+void *
+rbp_shape_retain(void *s)
+{
+	rbp_shape *shape = s;
+	shape->refs++;
+	return s;
+}
+
+/* Drops a reference to shape s and returns how many are left. Memory
+ * allocated by the engine for the shape (the BVH of a trimesh) is freed
+ * along with the last reference, the shape itself belongs to the caller.
+ */
+int
+rbp_shape_release(void *s)
+{
+	rbp_shape *shape = s;
+
+	if (--shape->refs > 0) {
+		return shape->refs;
+	}
+	if (shape->shape_type == TRIMESH) {
+		rbp_shape_trimesh *mesh = s;
+		free(mesh->mem);
+		mesh->mem = NULL;
+		mesh->nodes = NULL;
+		mesh->nnodes = 0;
+	}
+	return 0;
+}
+
+/* Initializes collider c placing shape with the given offset and material
+ * index, taking a reference to the shape */
+void
+rbp_collider_init(rbp_collider *c, void *shape, Vector3 offset, int material)
+{
+	c->shape = rbp_shape_retain(shape);
+	c->offset = offset;
+	c->material = material;
+	c->hint = 0;
+	c->category = 1;
+	c->mask = ~0u;
+	c->group = 0;
+}
+
+/* Sets the collision filter of collider c, see rbp_filter_test */
+void
+rbp_collider_filter(rbp_collider *c, unsigned int category, unsigned int mask,
+    int group)
+{
+	c->category = category;
+	c->mask = mask;
+	c->group = group;
+}
+
+/* Gets the category and mask bits of collider c, a zero category standing
+ * for the default filter */
+void
+rbp_collider_bits(rbp_collider *c, unsigned int *category,
+    unsigned int *mask)
+{
+	*category = c->category ? c->category : 1;
+	*mask = c->category ? c->mask : ~0u;
+}
+
+/* Returns whether two colliders with the given filters may collide.
+ * Colliders of the same nonzero group always collide if the group is
+ * positive and never if it is negative. Otherwise each one must have a
+ * category bit in the mask of the other. */
+int
+rbp_filter_test(unsigned int category1, unsigned int mask1, int group1,
+    unsigned int category2, unsigned int mask2, int group2)
+{
+	int same = (group1 == group2) & (group1 != 0);
+	int masks = ((category1 & mask2) != 0) & ((category2 & mask1) != 0);
+
+	return same ? group1 > 0 : masks;
+}
+
+/* Returns whether bodies b1 and b2 may collide according to the filters of
+ * their colliders. rbp_collide itself doesn't filter, worlds do it in the
+ * broadphase. */
+int
+rbp_should_collide(rbp_body *b1, rbp_body *b2)
+{
+	rbp_collider *c1 = rbp_body_collider(b1);
+	rbp_collider *c2 = rbp_body_collider(b2);
+	unsigned int category1, mask1, category2, mask2;
+
+	rbp_collider_bits(c1, &category1, &mask1);
+	rbp_collider_bits(c2, &category2, &mask2);
+	return rbp_filter_test(category1, mask1, c1->group,
+	    category2, mask2, c2->group);
+}
+
+/* Detaches the shape of collider c, releasing its reference */
+void
+rbp_collider_release(rbp_collider *c)
+{
+	if (c->shape != NULL) {
+		rbp_shape_release(c->shape);
+		c->shape = NULL;
+	}
+}
+
 /* Collision functions */
 int
 rbp_collide_sphere_sphere(rbp_body *b1, rbp_body *b2, rbp_contact *c)
 {
-	rbp_collider_sphere *c1 = b1->collider;
-	rbp_collider_sphere *c2 = b2->collider;
-	float r1 = c1->radius;
-	float r2 = c2->radius;
+	rbp_collider *c1 = rbp_body_collider(b1);
+	rbp_shape_sphere *s1 = c1->shape;
+	rbp_collider *c2 = rbp_body_collider(b2);
+	rbp_shape_sphere *s2 = c2->shape;
+	float r1 = s1->radius;
+	float r2 = s2->radius;
 	Vector3 pos1 = Vector3Add(b1->pos, c1->offset);
 	Vector3 pos2 = Vector3Add(b2->pos, c2->offset);
 
@@ -298,27 +975,27 @@ rbp_collide_sphere_sphere(rbp_body *b1, rbp_body *b2, rbp_contact *c)
 	c->depth = depth;
 	c->p1 = Vector3Add(pos1, Vector3Scale(cn, +1.0f*r1));
 	c->p2 = Vector3Add(pos2, Vector3Scale(cn, -1.0f*r2));
-	c->e= c1->e * c2->e;
-	c->uf_s = c1->uf_s + c2->uf_s;
-	c->uf_d = c1->uf_d + c2->uf_d;
+	c->pair = rbp_material_pair(c1->material, c2->material);
 	return 1;
 }
 
 int
 rbp_collide_sphere_cuboid(rbp_body *b1, rbp_body *b2, rbp_contact *c)
 {
-	rbp_collider_sphere *c1 = b1->collider;
-	rbp_collider_cuboid *c2 = b2->collider;
+	rbp_collider *c1 = rbp_body_collider(b1);
+	rbp_shape_sphere *s1 = c1->shape;
+	rbp_collider *c2 = rbp_body_collider(b2);
+	rbp_shape_cuboid *s2 = c2->shape;
 
 	Vector3 pos1 = Vector3Add(b1->pos, c1->offset);
-	float radius = c1->radius;
+	float radius = s1->radius;
 
 	Vector3 pos2 = Vector3Add(b2->pos, c2->offset);
-	Quaternion dir2 = QuaternionMultiply(c2->dir, b2->dir);
+	Quaternion dir2 = QuaternionMultiply(s2->dir, b2->dir);
 	dir2 = QuaternionNormalize(dir2);
-	float xsize = c2->xsize * 0.5;
-	float ysize = c2->ysize * 0.5;
-	float zsize = c2->zsize * 0.5;
+	float xsize = s2->xsize * 0.5;
+	float ysize = s2->ysize * 0.5;
+	float zsize = s2->zsize * 0.5;
 
 	/* Calculate relative position of the sphere in relation to the cuboid */
 	Vector3 r21 = Vector3Subtract(pos1, pos2);
@@ -347,9 +1024,7 @@ rbp_collide_sphere_cuboid(rbp_body *b1, rbp_body *b2, rbp_contact *c)
 	c->p2 = p2;
 	c->b1 = b1;
 	c->b2 = b2;
-	c->e = c1->e * c2->e;
-	c->uf_s = c1->uf_s + c2->uf_s;
-	c->uf_d = c1->uf_d + c2->uf_d;
+	c->pair = rbp_material_pair(c1->material, c2->material);
 
 	/* Send the contact normal and points to world space */
 	c->cn = Vector3RotateByQuaternion(c->cn, dir2);
@@ -361,53 +1036,1938 @@ rbp_collide_sphere_cuboid(rbp_body *b1, rbp_body *b2, rbp_contact *c)
 	return 1;
 }
 
-int
-rbp_collide_cuboid_cuboid(rbp_body *b1, rbp_body *b2, rbp_contact *c)
+/* Returns the world space axes of a cuboid with orientation dir */
+void
+rbp_cuboid_axes(Quaternion dir, Vector3 *axes)
 {
-	/* IMPLEMENT */
-	return 0;
+	axes[0] = Vector3RotateByQuaternion((Vector3) {1.0f, 0.0f, 0.0f}, dir);
+	axes[1] = Vector3RotateByQuaternion((Vector3) {0.0f, 1.0f, 0.0f}, dir);
+	axes[2] = Vector3RotateByQuaternion((Vector3) {0.0f, 0.0f, 1.0f}, dir);
 }
 
-/* shapes vs heigthmap collisions */
-int
-rbp_collide_sphere_heightmap()
+/* Returns how much two cuboids overlap when projected on axis L. Negative
+ * values mean L is a separating axis. */
+float
+rbp_sat_overlap(Vector3 L, Vector3 d, Vector3 *a1, float *h1, Vector3 *a2,
+    float *h2)
 {
-	/* IMPLEMENT */
-	return 0;
+	float ra = fabsf(DOT(a1[0], L))*h1[0] + fabsf(DOT(a1[1], L))*h1[1] +
+	    fabsf(DOT(a1[2], L))*h1[2];
+	float rb = fabsf(DOT(a2[0], L))*h2[0] + fabsf(DOT(a2[1], L))*h2[1] +
+	    fabsf(DOT(a2[2], L))*h2[2];
+	return ra + rb - fabsf(DOT(d, L));
 }
 
+/* Clips the polygon in (n vertices) against the plane dot(p, pn) <= pd and
+ * writes the result to out. Returns the number of vertices in out. */
 int
-rbp_collide_cuboid_heightmap()
+rbp_clip_polygon(Vector3 *in, int n, Vector3 *out, Vector3 pn, float pd)
 {
-	/* IMPLEMENT */
-	return 0;
+	int i, m = 0;
+
+	for (i = 0; i < n; i++) {
+		Vector3 a = in[i];
+		Vector3 b = in[(i+1) % n];
+		float da = DOT(a, pn) - pd;
+		float db = DOT(b, pn) - pd;
+
+		if (da <= 0.0f) {
+			out[m++] = a;
+		}
+		if ((da < 0.0f && db > 0.0f) || (da > 0.0f && db < 0.0f)) {
+			/* edge crosses the plane, keep the intersection */
+			out[m++] = Vector3Lerp(a, b, da / (da - db));
+		}
+	}
+	return m;
 }
 
+/* Contact reduction: selects at most RBP_MANIFOLD_MAX of the n candidate
+ * points. The deepest point is always kept, the others are chosen so that
+ * the kept points span the largest area in the plane normal to cn.
+ * Indices of the selected points are written to keep, returns their count.
+ */
 int
-rbp_collide(rbp_body *b1, rbp_body *b2, rbp_contact *c)
+rbp_manifold_reduce(Vector3 *p, float *depth, int n, Vector3 cn, int *keep)
 {
-	rbp_body *a;
-	rbp_body *b;
-	int (*collide)(rbp_body*, rbp_body*, rbp_contact*);
+	int i, a, b, c, d;
+	float best, s;
 
-	rbp_collider *ca = (rbp_collider *) b1->collider;
-	rbp_collider *cb = (rbp_collider *) b2->collider;
-	rbp_collider_type a_type = ca->collider_type;
-	rbp_collider_type b_type = cb->collider_type;
-
-	/* Ensure smallest collider_type goes in as b1 */
-	a = b1;
-	b = b2;
-	if (a_type > b_type) {
-		a = b2;
-		b = b1;
+	if (n <= RBP_MANIFOLD_MAX) {
+		for (i = 0; i < n; i++) {
+			keep[i] = i;
+		}
+		return n;
+	}
+
+	/* a = deepest point */
+	a = 0;
+	for (i = 1; i < n; i++) {
+		if (depth[i] > depth[a]) {
+			a = i;
+		}
+	}
+
+	/* b = point farthest from a */
+	b = a;
+	best = -1.0f;
+	for (i = 0; i < n; i++) {
+		Vector3 ai = Vector3Subtract(p[i], p[a]);
+		s = DOT(ai, ai);
+		if (s > best) {
+			best = s;
+			b = i;
+		}
+	}
+
+	/* c = point that makes the largest triangle with a and b */
+	c = a;
+	best = -1.0f;
+	for (i = 0; i < n; i++) {
+		Vector3 ab = Vector3Subtract(p[b], p[a]);
+		Vector3 ai = Vector3Subtract(p[i], p[a]);
+		s = fabsf(DOT(X(ab, ai), cn));
+		if (s > best) {
+			best = s;
+			c = i;
+		}
+	}
+
+	/* Wind abc counter-clockwise around cn */
+	if (DOT(X(Vector3Subtract(p[b], p[a]), Vector3Subtract(p[c], p[a])),
+	    cn) < 0.0f) {
+		i = b;
+		b = c;
+		c = i;
+	}
+
+	/* d = point farthest outside of the triangle abc, which is the one
+	 * that adds the most area to the manifold */
+	d = -1;
+	best = 0.0f;
+	for (i = 0; i < n; i++) {
+		float sab = DOT(X(Vector3Subtract(p[b], p[a]),
+		    Vector3Subtract(p[i], p[a])), cn);
+		float sbc = DOT(X(Vector3Subtract(p[c], p[b]),
+		    Vector3Subtract(p[i], p[b])), cn);
+		float sca = DOT(X(Vector3Subtract(p[a], p[c]),
+		    Vector3Subtract(p[i], p[c])), cn);
+		s = -fminf(sab, fminf(sbc, sca));
+		if (s > best) {
+			best = s;
+			d = i;
+		}
+	}
+
+	keep[0] = a;
+	keep[1] = b;
+	keep[2] = c;
+	if (d < 0) {
+		/* every other point lies inside abc */
+		return 3;
+	}
+	keep[3] = d;
+	return 4;
+}
+
+int
+rbp_collide_cuboid_cuboid_manifold(rbp_body *b1, rbp_body *b2, rbp_manifold *m)
+{
+	rbp_collider *c1 = rbp_body_collider(b1);
+	rbp_shape_cuboid *s1 = c1->shape;
+	rbp_collider *c2 = rbp_body_collider(b2);
+	rbp_shape_cuboid *s2 = c2->shape;
+
+	Vector3 pos1 = Vector3Add(b1->pos, c1->offset);
+	Vector3 pos2 = Vector3Add(b2->pos, c2->offset);
+	Quaternion dir1 = QuaternionNormalize(QuaternionMultiply(s1->dir, b1->dir));
+	Quaternion dir2 = QuaternionNormalize(QuaternionMultiply(s2->dir, b2->dir));
+	float h1[3] = {s1->xsize*0.5f, s1->ysize*0.5f, s1->zsize*0.5f};
+	float h2[3] = {s2->xsize*0.5f, s2->ysize*0.5f, s2->zsize*0.5f};
+	Vector3 a1[3];
+	Vector3 a2[3];
+	rbp_cuboid_axes(dir1, a1);
+	rbp_cuboid_axes(dir2, a2);
+
+	Vector3 d = Vector3Subtract(pos2, pos1);
+	Vector3 cn = a1[0];
+	float depth = FLT_MAX;
+	int axis = -1;
+	int i, j, k;
+
+	/* Separating axis test: the 3 face normals of each cuboid... */
+	for (i = 0; i < 6; i++) {
+		Vector3 L = i < 3 ? a1[i] : a2[i-3];
+		float pen = rbp_sat_overlap(L, d, a1, h1, a2, h2);
+		if (pen < 0.0f) {
+			/* Miss, return 0, don't touch m. */
+			return 0;
+		}
+		if (pen < depth) {
+			depth = pen;
+			cn = L;
+			axis = i;
+		}
+	}
+
+	/* ...and the 9 edge-edge cross products. Edge axes are only preferred
+	 * if they are clearly better, face contacts give stabler manifolds. */
+	float face_depth = depth;
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+			Vector3 L = X(a1[i], a2[j]);
+			float len = Vector3Length(L);
+			if (len < 1e-4f) {
+				/* parallel edges, already covered by the faces */
+				continue;
+			}
+			L = Vector3Scale(L, 1.0f/len);
+			float pen = rbp_sat_overlap(L, d, a1, h1, a2, h2);
+			if (pen < 0.0f) {
+				return 0;
+			}
+			if (pen < depth && pen < 0.95f*face_depth - 1e-3f) {
+				depth = pen;
+				cn = L;
+				axis = 6 + 3*i + j;
+			}
+		}
+	}
+
+	/* Orient the normal b1->b2 */
+	if (DOT(d, cn) < 0.0f) {
+		cn = NEG(cn);
+	}
+
+	m->b1 = b1;
+	m->b2 = b2;
+	m->cn = cn;
+	m->pair = rbp_material_pair(c1->material, c2->material);
+
+	if (axis >= 6) {
+		/* Edge-edge contact: find the closest points between the
+		 * supporting edges of each cuboid */
+		i = (axis - 6) / 3;
+		j = (axis - 6) % 3;
+		Vector3 pa = pos1;
+		Vector3 pb = pos2;
+		for (k = 0; k < 3; k++) {
+			if (k != i) {
+				float s = DOT(a1[k], cn) > 0.0f ? h1[k] : -h1[k];
+				pa = Vector3Add(pa, Vector3Scale(a1[k], s));
+			}
+			if (k != j) {
+				float s = DOT(a2[k], cn) > 0.0f ? -h2[k] : h2[k];
+				pb = Vector3Add(pb, Vector3Scale(a2[k], s));
+			}
+		}
+		Vector3 r = Vector3Subtract(pa, pb);
+		float b = DOT(a1[i], a2[j]);
+		float e = DOT(a1[i], r);
+		float f = DOT(a2[j], r);
+		float s = (b*f - e) / (1.0f - b*b);
+		s = Clamp(s, -h1[i], h1[i]);
+		float t = Clamp(f + s*b, -h2[j], h2[j]);
+
+		m->n = 1;
+		m->p1[0] = Vector3Add(pa, Vector3Scale(a1[i], s));
+		m->p2[0] = Vector3Add(pb, Vector3Scale(a2[j], t));
+		m->depth[0] = depth;
+		return 1;
+	}
+
+	/* Face contact: the reference face is the one whose normal is the
+	 * separating axis, the incident face is the face of the other cuboid
+	 * most anti-parallel to it. The incident face is clipped against the
+	 * side planes of the reference face. */
+	int ref1 = axis < 3; /* reference face belongs to b1? */
+	Vector3 pr = ref1 ? pos1 : pos2;
+	Vector3 pi = ref1 ? pos2 : pos1;
+	Vector3 *ar = ref1 ? a1 : a2;
+	Vector3 *ai = ref1 ? a2 : a1;
+	float *hr = ref1 ? h1 : h2;
+	float *hi = ref1 ? h2 : h1;
+	Vector3 nr = ref1 ? cn : NEG(cn); /* points from reference to incident */
+	k = ref1 ? axis : axis - 3;
+	Vector3 fc = Vector3Add(pr, Vector3Scale(nr, hr[k]));
+
+	j = 0;
+	for (i = 1; i < 3; i++) {
+		if (fabsf(DOT(ai[i], nr)) > fabsf(DOT(ai[j], nr))) {
+			j = i;
+		}
+	}
+	float s = DOT(ai[j], nr) > 0.0f ? -hi[j] : hi[j];
+	Vector3 ic = Vector3Add(pi, Vector3Scale(ai[j], s));
+	Vector3 u = Vector3Scale(ai[(j+1) % 3], hi[(j+1) % 3]);
+	Vector3 v = Vector3Scale(ai[(j+2) % 3], hi[(j+2) % 3]);
+
+	Vector3 poly[16];
+	Vector3 clip[16];
+	int n = 4;
+	poly[0] = Vector3Add(ic, Vector3Add(u, v));
+	poly[1] = Vector3Add(ic, Vector3Subtract(v, u));
+	poly[2] = Vector3Subtract(ic, Vector3Add(u, v));
+	poly[3] = Vector3Add(ic, Vector3Subtract(u, v));
+
+	for (i = 1; i < 3 && n > 0; i++) {
+		Vector3 e = ar[(k+i) % 3];
+		float pe = DOT(pr, e);
+		float he = hr[(k+i) % 3];
+		n = rbp_clip_polygon(poly, n, clip, e, pe + he);
+		n = rbp_clip_polygon(clip, n, poly, NEG(e), -pe + he);
+	}
+
+	/* Keep the clipped points below the reference face */
+	Vector3 pref[16];
+	Vector3 pinc[16];
+	float pdepth[16];
+	int np = 0;
+	for (i = 0; i < n; i++) {
+		float sep = DOT(Vector3Subtract(poly[i], fc), nr);
+		if (sep <= 0.0f) {
+			pinc[np] = poly[i];
+			pref[np] = Vector3Subtract(poly[i], Vector3Scale(nr, sep));
+			pdepth[np] = -sep;
+			np++;
+		}
+	}
+
+	if (np == 0) {
+		/* Numerical corner case, report the SAT depth at the face */
+		pinc[0] = ic;
+		pref[0] = Vector3Add(ic, Vector3Scale(nr, depth));
+		pdepth[0] = depth;
+		np = 1;
+	}
+
+	int keep[RBP_MANIFOLD_MAX];
+	m->n = rbp_manifold_reduce(pinc, pdepth, np, cn, keep);
+	for (i = 0; i < m->n; i++) {
+		m->p1[i] = ref1 ? pref[keep[i]] : pinc[keep[i]];
+		m->p2[i] = ref1 ? pinc[keep[i]] : pref[keep[i]];
+		m->depth[i] = pdepth[keep[i]];
+	}
+	return m->n;
+}
+
+/* Copies the i-th point of manifold m into the single point contact c */
+void
+rbp_manifold_contact(rbp_manifold *m, int i, rbp_contact *c)
+{
+	c->b1 = m->b1;
+	c->b2 = m->b2;
+	c->p1 = m->p1[i];
+	c->p2 = m->p2[i];
+	c->cn = m->cn;
+	c->depth = m->depth[i];
+	c->pair = m->pair;
+}
+
+int
+rbp_collide_cuboid_cuboid(rbp_body *b1, rbp_body *b2, rbp_contact *c)
+{
+	rbp_manifold m;
+	int i, deepest = 0;
+
+	if (!rbp_collide_cuboid_cuboid_manifold(b1, b2, &m)) {
+		return 0;
+	}
+
+	/* Single point interface: report the deepest point */
+	for (i = 1; i < m.n; i++) {
+		if (m.depth[i] > m.depth[deepest]) {
+			deepest = i;
+		}
+	}
+	rbp_manifold_contact(&m, deepest, c);
+	return 1;
+}
+
+/* Segment helpers */
+/* Returns the parameter t in [0, 1] of the point of segment ab closest to p */
+float
+rbp_closest_segment_point(Vector3 a, Vector3 b, Vector3 p)
+{
+	Vector3 ab = Vector3Subtract(b, a);
+	float len2 = DOT(ab, ab);
+	if (len2 <= 0.0f) {
+		/* degenerate segment */
+		return 0.0f;
+	}
+	return Clamp(DOT(Vector3Subtract(p, a), ab) / len2, 0.0f, 1.0f);
+}
+
+/* Finds the closest points between segments p1q1 and p2q2, returns their
+ * parameters in s (along p1q1) and t (along p2q2). */
+void
+rbp_closest_segment_segment(Vector3 p1, Vector3 q1, Vector3 p2, Vector3 q2,
+    float *s, float *t)
+{
+	Vector3 d1 = Vector3Subtract(q1, p1);
+	Vector3 d2 = Vector3Subtract(q2, p2);
+	Vector3 r = Vector3Subtract(p1, p2);
+	float a = DOT(d1, d1);
+	float e = DOT(d2, d2);
+	float f = DOT(d2, r);
+
+	if (a <= 1e-12f && e <= 1e-12f) {
+		/* both segments are points */
+		*s = *t = 0.0f;
+		return;
+	}
+	if (a <= 1e-12f) {
+		*s = 0.0f;
+		*t = Clamp(f / e, 0.0f, 1.0f);
+		return;
+	}
+
+	float c = DOT(d1, r);
+	if (e <= 1e-12f) {
+		*t = 0.0f;
+		*s = Clamp(-c / a, 0.0f, 1.0f);
+		return;
+	}
+
+	float b = DOT(d1, d2);
+	float denom = a*e - b*b;
+
+	/* closest point on the first line to the second one, any point if
+	 * they are parallel */
+	*s = denom != 0.0f ? Clamp((b*f - c*e) / denom, 0.0f, 1.0f) : 0.0f;
+	*t = (b*(*s) + f) / e;
+
+	/* clamp t and recompute s if needed */
+	if (*t < 0.0f) {
+		*t = 0.0f;
+		*s = Clamp(-c / a, 0.0f, 1.0f);
+	} else if (*t > 1.0f) {
+		*t = 1.0f;
+		*s = Clamp((b - c) / a, 0.0f, 1.0f);
+	}
+}
+
+/* Returns the parameter t in [0, 1] of the point of segment pq closest to
+ * the box of half extents h centered at the origin. The squared distance to
+ * the box is a convex piecewise quadratic of t, with breaks where the
+ * segment crosses the planes of the box faces, so each piece is minimized
+ * in closed form and the best one kept. */
+float
+rbp_closest_segment_box(Vector3 p, Vector3 q, float h[3])
+{
+	float pa[3] = {p.x, p.y, p.z};
+	float da[3] = {q.x - p.x, q.y - p.y, q.z - p.z};
+	float ts[8] = {0.0f, 1.0f};
+	float best = FLT_MAX, best_t = 0.0f;
+	int i, j, k, n = 2;
+
+	for (i = 0; i < 3; i++) {
+		if (fabsf(da[i]) < 1e-12f) {
+			continue;
+		}
+		for (k = -1; k <= 1; k += 2) {
+			float t = (k*h[i] - pa[i]) / da[i];
+			if (t > 0.0f && t < 1.0f) {
+				ts[n++] = t;
+			}
+		}
+	}
+	for (i = 1; i < n; i++) {
+		float t = ts[i];
+		for (j = i; j > 0 && ts[j - 1] > t; j--) {
+			ts[j] = ts[j - 1];
+		}
+		ts[j] = t;
+	}
+
+	for (j = 0; j + 1 < n; j++) {
+		/* On a piece every axis is inside its slab or past one face:
+		 * f(t) = sum of (pa + da*t - face)^2 over the axes past a face */
+		float m = 0.5f*(ts[j] + ts[j + 1]);
+		float a = 0.0f, b = 0.0f, f = 0.0f;
+		for (i = 0; i < 3; i++) {
+			float x = pa[i] + da[i]*m;
+			if (x > h[i] || x < -h[i]) {
+				float face = x > h[i] ? h[i] : -h[i];
+				a += da[i]*da[i];
+				b += da[i]*(pa[i] - face);
+			}
+		}
+		float t = a > 0.0f ? Clamp(-b/a, ts[j], ts[j + 1]) : ts[j];
+		for (i = 0; i < 3; i++) {
+			float x = pa[i] + da[i]*t;
+			float e = fmaxf(fabsf(x) - h[i], 0.0f);
+			f += e*e;
+		}
+		if (f < best) {
+			best = f;
+			best_t = t;
+		}
+	}
+	return best_t;
+}
+
+/* Returns the world space end points of the segment of the capsule collider
+ * of body b */
+void
+rbp_capsule_segment(rbp_body *b, Vector3 *p, Vector3 *q)
+{
+	rbp_collider *c = rbp_body_collider(b);
+	rbp_shape_capsule *s = c->shape;
+	Vector3 pos = Vector3Add(b->pos, c->offset);
+	Quaternion dir = QuaternionNormalize(QuaternionMultiply(s->dir, b->dir));
+	Vector3 axis = Vector3RotateByQuaternion((Vector3) {0.0f, 0.5f*s->length,
+	    0.0f}, dir);
+	*p = Vector3Subtract(pos, axis);
+	*q = Vector3Add(pos, axis);
+}
+
+/* Fills c for two spheres at pos1 and pos2 with radii r1 and r2, which is
+ * what every capsule collision reduces to once the closest points between
+ * the inner segments are known. Returns 0 on a miss without touching c. */
+int
+rbp_contact_spheres(Vector3 pos1, float r1, Vector3 pos2, float r2,
+    Vector3 axis, rbp_contact *c)
+{
+	Vector3 cn = Vector3Subtract(pos2, pos1);
+	float distance = Vector3Length(cn);
+	float depth = r1 + r2 - distance;
+
+	if (depth <= 0.0f) {
+		return 0;
+	}
+
+	if (distance > 1e-6f) {
+		cn = Vector3Scale(cn, 1.0f/distance);
+	} else {
+		/* Centers overlap, push orthogonally to axis */
+		Vector3 ax = {1.0f, 0.0f, 0.0f};
+		Vector3 ay = {0.0f, 1.0f, 0.0f};
+		cn = Vector3Normalize(X(axis, fabsf(axis.x) < 0.57735f ? ax : ay));
+	}
+
+	c->cn = cn;
+	c->depth = depth;
+	c->p1 = Vector3Add(pos1, Vector3Scale(cn, +1.0f*r1));
+	c->p2 = Vector3Add(pos2, Vector3Scale(cn, -1.0f*r2));
+	return 1;
+}
+
+int
+rbp_collide_sphere_capsule(rbp_body *b1, rbp_body *b2, rbp_contact *c)
+{
+	rbp_collider *c1 = rbp_body_collider(b1);
+	rbp_shape_sphere *s1 = c1->shape;
+	rbp_collider *c2 = rbp_body_collider(b2);
+	rbp_shape_capsule *s2 = c2->shape;
+	Vector3 pos1 = Vector3Add(b1->pos, c1->offset);
+	Vector3 p, q;
+
+	rbp_capsule_segment(b2, &p, &q);
+	float t = rbp_closest_segment_point(p, q, pos1);
+	Vector3 pos2 = Vector3Lerp(p, q, t);
+
+	if (!rbp_contact_spheres(pos1, s1->radius, pos2, s2->radius,
+	    Vector3Subtract(q, p), c)) {
+		return 0;
+	}
+	c->b1 = b1;
+	c->b2 = b2;
+	c->pair = rbp_material_pair(c1->material, c2->material);
+	return 1;
+}
+
+int
+rbp_collide_capsule_capsule(rbp_body *b1, rbp_body *b2, rbp_contact *c)
+{
+	rbp_collider *c1 = rbp_body_collider(b1);
+	rbp_shape_capsule *s1 = c1->shape;
+	rbp_collider *c2 = rbp_body_collider(b2);
+	rbp_shape_capsule *s2 = c2->shape;
+	Vector3 p1, q1, p2, q2;
+	float s, t;
+
+	rbp_capsule_segment(b1, &p1, &q1);
+	rbp_capsule_segment(b2, &p2, &q2);
+	rbp_closest_segment_segment(p1, q1, p2, q2, &s, &t);
+
+	if (!rbp_contact_spheres(Vector3Lerp(p1, q1, s), s1->radius,
+	    Vector3Lerp(p2, q2, t), s2->radius, Vector3Subtract(q1, p1), c)) {
+		return 0;
+	}
+	c->b1 = b1;
+	c->b2 = b2;
+	c->pair = rbp_material_pair(c1->material, c2->material);
+	return 1;
+}
+
+int
+rbp_collide_cuboid_capsule(rbp_body *b1, rbp_body *b2, rbp_contact *c)
+{
+	rbp_collider *c1 = rbp_body_collider(b1);
+	rbp_shape_cuboid *s1 = c1->shape;
+	rbp_collider *c2 = rbp_body_collider(b2);
+	rbp_shape_capsule *s2 = c2->shape;
+	float radius = s2->radius;
+	int i;
+
+	Vector3 pos1 = Vector3Add(b1->pos, c1->offset);
+	Quaternion dir1 = QuaternionMultiply(s1->dir, b1->dir);
+	dir1 = QuaternionNormalize(dir1);
+	Quaternion unrot = QuaternionInvert(dir1);
+	float h[3] = {s1->xsize*0.5f, s1->ysize*0.5f, s1->zsize*0.5f};
+
+	/* Work in the space of the cuboid */
+	Vector3 p, q;
+	rbp_capsule_segment(b2, &p, &q);
+	p = Vector3RotateByQuaternion(Vector3Subtract(p, pos1), unrot);
+	q = Vector3RotateByQuaternion(Vector3Subtract(q, pos1), unrot);
+
+	/* Closest points between the segment and the cuboid */
+	float t = rbp_closest_segment_box(p, q, h);
+	Vector3 s = Vector3Lerp(p, q, t);
+	Vector3 b;
+	b.x = Clamp(s.x, -h[0], h[0]);
+	b.y = Clamp(s.y, -h[1], h[1]);
+	b.z = Clamp(s.z, -h[2], h[2]);
+
+	Vector3 d = Vector3Subtract(s, b);
+	float distance = Vector3Length(d);
+	Vector3 cn, p1, p2;
+	float depth;
+
+	if (distance > 1e-6f) {
+		/* The segment is outside of the cuboid */
+		depth = radius - distance;
+		if (depth <= 0.0f) {
+			/* Miss, don't touch c */
+			return 0;
+		}
+		cn = Vector3Scale(d, 1.0f/distance);
+		p1 = b;
+		p2 = Vector3Subtract(s, Vector3Scale(cn, radius));
+	} else {
+		/* The segment crosses the cuboid, push the capsule out through
+		 * the face that needs the least displacement */
+		float pa[3] = {p.x, p.y, p.z};
+		float qa[3] = {q.x, q.y, q.z};
+		float best = FLT_MAX;
+		int axis = 0;
+		float sign = 1.0f;
+		for (i = 0; i < 3; i++) {
+			/* +face and -face */
+			float pen_pos = h[i] - fminf(pa[i], qa[i]) + radius;
+			float pen_neg = h[i] + fmaxf(pa[i], qa[i]) + radius;
+			if (pen_pos < best) {
+				best = pen_pos;
+				axis = i;
+				sign = 1.0f;
+			}
+			if (pen_neg < best) {
+				best = pen_neg;
+				axis = i;
+				sign = -1.0f;
+			}
+		}
+		float na[3] = {0.0f, 0.0f, 0.0f};
+		na[axis] = sign;
+		cn = (Vector3) {na[0], na[1], na[2]};
+		depth = best;
+
+		/* deepest end of the segment along the face normal */
+		float dp = DOT(p, cn);
+		float dq = DOT(q, cn);
+		s = fabsf(dp - dq) < 1e-6f ? Vector3Lerp(p, q, 0.5f) :
+		    (dp < dq ? p : q);
+		p2 = Vector3Subtract(s, Vector3Scale(cn, radius));
+		p1 = Vector3Add(p2, Vector3Scale(cn, depth));
+	}
+
+	/* Hit! Send everything back to world space */
+	c->cn = Vector3Normalize(Vector3RotateByQuaternion(cn, dir1));
+	c->p1 = Vector3Add(pos1, Vector3RotateByQuaternion(p1, dir1));
+	c->p2 = Vector3Add(pos1, Vector3RotateByQuaternion(p2, dir1));
+	c->depth = depth;
+	c->b1 = b1;
+	c->b2 = b2;
+	c->pair = rbp_material_pair(c1->material, c2->material);
+	return 1;
+}
+
+/* shapes vs heigthmap collisions */
+/* Initializes heightmap shape c over the width*depth samples of heights,
+ * which c keeps a pointer to. Returns 0 if the grid has fewer than 2
+ * samples along x or z: it has no cells, heightmaps like that never
+ * collide. */
+int
+rbp_heightmap_init(rbp_shape_heightmap *c, int width, int depth,
+    float xsize, float ysize, float zsize, float *heights)
+{
+	memset(c, 0, sizeof(*c));
+	c->shape_type = HEIGHTMAP;
+	c->width = width;
+	c->depth = depth;
+	c->xsize = xsize;
+	c->ysize = ysize;
+	c->zsize = zsize;
+	c->heights = heights;
+	return width >= 2 && depth >= 2;
+}
+
+/* Samples heightmap shape c, placed at origin, at world coordinates
+ * (x, z). Writes the interpolated height to h and the surface normal to n.
+ * Returns 0 if (x, z) falls outside of the heightmap. */
+int
+rbp_heightmap_sample(rbp_shape_heightmap *c, Vector3 origin, float x,
+    float z, float *h, Vector3 *n)
+{
+	if (c->width < 2 || c->depth < 2) {
+		return 0;
+	}
+	float dx = c->xsize / (c->width - 1);
+	float dz = c->zsize / (c->depth - 1);
+	float u = (x - origin.x) / dx;
+	float v = (z - origin.z) / dz;
+
+	if (u < 0.0f || v < 0.0f || u > c->width - 1 || v > c->depth - 1) {
+		return 0;
+	}
+
+	int i = (int) u;
+	int j = (int) v;
+	i = i < c->width - 1 ? i : c->width - 2;
+	j = j < c->depth - 1 ? j : c->depth - 2;
+	u -= i;
+	v -= j;
+
+	/* bilinear interpolation of the 4 samples of the cell */
+	float *row = c->heights + j*c->width + i;
+	float h00 = row[0]*c->ysize;
+	float h10 = row[1]*c->ysize;
+	float h01 = row[c->width]*c->ysize;
+	float h11 = row[c->width + 1]*c->ysize;
+	float h0 = h00 + u*(h10 - h00);
+	float h1 = h01 + u*(h11 - h01);
+	*h = origin.y + h0 + v*(h1 - h0);
+
+	float dhdx = ((h10 - h00) + v*((h11 - h01) - (h10 - h00))) / dx;
+	float dhdz = (h1 - h0) / dz;
+	*n = Vector3Normalize((Vector3) {-dhdx, 1.0f, -dhdz});
+	return 1;
+}
+
+/* Fills c with the contact of a sphere at pos with the given radius against
+ * heightmap body b2. The sphere is b1, returns 0 on a miss. */
+int
+rbp_contact_sphere_heightmap(Vector3 pos, float radius, rbp_body *b2,
+    rbp_contact *c)
+{
+	rbp_collider *c2 = rbp_body_collider(b2);
+	rbp_shape_heightmap *s2 = c2->shape;
+	Vector3 origin = Vector3Add(b2->pos, c2->offset);
+	Vector3 n;
+	float h;
+
+	if (!rbp_heightmap_sample(s2, origin, pos.x, pos.z, &h, &n)) {
+		return 0;
+	}
+
+	/* distance from the center to the tangent plane under it */
+	float distance = (pos.y - h) * n.y;
+	float depth = radius - distance;
+	if (depth <= 0.0f) {
+		return 0;
+	}
+
+	c->cn = NEG(n);
+	c->depth = depth;
+	c->p1 = Vector3Subtract(pos, Vector3Scale(n, radius));
+	c->p2 = Vector3Subtract(pos, Vector3Scale(n, distance));
+	return 1;
+}
+
+int
+rbp_collide_sphere_heightmap(rbp_body *b1, rbp_body *b2, rbp_contact *c)
+{
+	rbp_collider *c1 = rbp_body_collider(b1);
+	rbp_shape_sphere *s1 = c1->shape;
+	rbp_collider *c2 = rbp_body_collider(b2);
+	Vector3 pos1 = Vector3Add(b1->pos, c1->offset);
+
+	if (!rbp_contact_sphere_heightmap(pos1, s1->radius, b2, c)) {
+		return 0;
+	}
+	c->b1 = b1;
+	c->b2 = b2;
+	c->pair = rbp_material_pair(c1->material, c2->material);
+	return 1;
+}
+
+int
+rbp_collide_cuboid_heightmap(rbp_body *b1, rbp_body *b2, rbp_contact *c)
+{
+	rbp_collider *c1 = rbp_body_collider(b1);
+	rbp_shape_cuboid *s1 = c1->shape;
+	rbp_collider *c2 = rbp_body_collider(b2);
+	rbp_shape_heightmap *s2 = c2->shape;
+	Vector3 origin = Vector3Add(b2->pos, c2->offset);
+	Vector3 pos1 = Vector3Add(b1->pos, c1->offset);
+	Quaternion dir1 = QuaternionMultiply(s1->dir, b1->dir);
+	dir1 = QuaternionNormalize(dir1);
+	float best = 0.0f;
+	int i;
+
+	/* Test the 8 corners against the surface, keep the deepest */
+	for (i = 0; i < 8; i++) {
+		Vector3 corner = {
+			(i & 1 ? 0.5f : -0.5f)*s1->xsize,
+			(i & 2 ? 0.5f : -0.5f)*s1->ysize,
+			(i & 4 ? 0.5f : -0.5f)*s1->zsize};
+		corner = Vector3Add(pos1, Vector3RotateByQuaternion(corner, dir1));
+
+		Vector3 n;
+		float h;
+		if (!rbp_heightmap_sample(s2, origin, corner.x, corner.z, &h, &n)) {
+			continue;
+		}
+		float distance = (corner.y - h) * n.y;
+		if (-distance > best) {
+			best = -distance;
+			c->cn = NEG(n);
+			c->depth = best;
+			c->p1 = corner;
+			c->p2 = Vector3Subtract(corner, Vector3Scale(n, distance));
+		}
+	}
+
+	if (best <= 0.0f) {
+		/* No corner below the surface */
+		return 0;
+	}
+	c->b1 = b1;
+	c->b2 = b2;
+	c->pair = rbp_material_pair(c1->material, c2->material);
+	return 1;
+}
+
+/* Capsules are tested against the heightmap as spheres placed along the
+ * segment, one more than the heightmap cells it spans and at most
+ * RBP_CAPSULE_SAMPLES, keeping the deepest contact. */
+int
+rbp_collide_capsule_heightmap(rbp_body *b1, rbp_body *b2, rbp_contact *c)
+{
+	rbp_collider *c1 = rbp_body_collider(b1);
+	rbp_shape_capsule *s1 = c1->shape;
+	rbp_collider *c2 = rbp_body_collider(b2);
+	rbp_shape_heightmap *s2 = c2->shape;
+	rbp_contact sample;
+	Vector3 p, q;
+	int i, n, hit = 0;
+
+	if (s2->width < 2 || s2->depth < 2) {
+		return 0;
+	}
+	rbp_capsule_segment(b1, &p, &q);
+	float dx = s2->xsize / (s2->width - 1);
+	float dz = s2->zsize / (s2->depth - 1);
+	float span = fmaxf(fabsf(q.x - p.x) / dx, fabsf(q.z - p.z) / dz);
+	n = 1 + (int) ceilf(fminf(span, RBP_CAPSULE_SAMPLES));
+	n = n < RBP_CAPSULE_SAMPLES - 1 ? n : RBP_CAPSULE_SAMPLES - 1;
+
+	for (i = 0; i <= n; i++) {
+		Vector3 s = Vector3Lerp(p, q, (float) i / n);
+		if (rbp_contact_sphere_heightmap(s, s1->radius, b2, &sample) &&
+		    (!hit || sample.depth > c->depth)) {
+			*c = sample;
+			hit = 1;
+		}
+	}
+
+	if (!hit) {
+		return 0;
+	}
+	c->b1 = b1;
+	c->b2 = b2;
+	c->pair = rbp_material_pair(c1->material, c2->material);
+	return 1;
+}
+
+/* Convex hulls */
+/* Initializes convex shape c from the nv vertices verts and the nt
+ * triangles tris (3 vertex indices each) of a convex hull, building the
+ * vertex adjacency used by the support mapping. adj_start must hold nv+1
+ * ints and adj 6*nt ints, c keeps pointers to verts, tris, adj_start and
+ * adj.
+ */
+void
+rbp_convex_init(rbp_shape_convex *c, Vector3 *verts, int nv, int *tris,
+    int nt, int *adj_start, int *adj)
+{
+	int i, j, k, n;
+
+	c->shape_type = CONVEX;
+	c->nverts = nv;
+	c->verts = verts;
+	c->ntris = nt;
+	c->tris = tris;
+	c->adj_start = adj_start;
+	c->adj = adj;
+
+	/* Upper bound of the neighbors of each vertex: 2 per triangle */
+	for (i = 0; i <= nv; i++) {
+		adj_start[i] = 0;
+	}
+	for (i = 0; i < 3*nt; i++) {
+		adj_start[tris[i] + 1] += 2;
+	}
+	for (i = 0; i < nv; i++) {
+		adj_start[i + 1] += adj_start[i];
+	}
+	for (i = 0; i < 6*nt; i++) {
+		adj[i] = -1;
+	}
+
+	/* Add the edges of every triangle, skipping the ones already known */
+	for (i = 0; i < nt; i++) {
+		for (j = 0; j < 3; j++) {
+			int a = tris[3*i + j];
+			int e[2] = {tris[3*i + (j+1) % 3], tris[3*i + (j+2) % 3]};
+			for (k = 0; k < 2; k++) {
+				for (n = adj_start[a]; adj[n] >= 0 && adj[n] != e[k]; n++)
+					;
+				adj[n] = e[k];
+			}
+		}
+	}
+
+	/* Compact the lists */
+	n = 0;
+	for (i = 0; i < nv; i++) {
+		int start = adj_start[i];
+		int end = adj_start[i + 1];
+		adj_start[i] = n;
+		for (k = start; k < end && adj[k] >= 0; k++) {
+			adj[n++] = adj[k];
+		}
+	}
+	adj_start[nv] = n;
+
+	/* The centroid of the vertices is an interior point of the hull */
+	c->center = Vector3Zero();
+	for (i = 0; i < nv; i++) {
+		c->center = Vector3Add(c->center, verts[i]);
+	}
+	c->center = Vector3Scale(c->center, 1.0f / nv);
+}
+
+/* Support mapping of convex shape c in collider space: returns the index of
+ * the vertex furthest along d. The search hill-climbs the vertex graph from
+ * hint, the result of the previous query of the same collider, which is
+ * usually at or next to the answer when the body moved little since then.
+ */
+int
+rbp_convex_support(rbp_shape_convex *c, int *hint, Vector3 d)
+{
+	int v = *hint;
+	float best = DOT(c->verts[v], d);
+	int moved = 1;
+
+	while (moved) {
+		moved = 0;
+		for (int i = c->adj_start[v]; i < c->adj_start[v + 1]; i++) {
+			float s = DOT(c->verts[c->adj[i]], d);
+			if (s > best) {
+				best = s;
+				v = c->adj[i];
+				moved = 1;
+			}
+		}
+	}
+	*hint = v;
+	return v;
+}
+
+/* Support mappings */
+/* Returns an interior point of the collider of body b in world space */
+Vector3
+rbp_collider_center(rbp_body *b)
+{
+	rbp_collider *c = rbp_body_collider(b);
+	Vector3 pos = Vector3Add(b->pos, c->offset);
+
+	if (rbp_shape_type(b) == CONVEX) {
+		rbp_shape_convex *cv = c->shape;
+		Quaternion dir = QuaternionMultiply(cv->dir, b->dir);
+		dir = QuaternionNormalize(dir);
+		return Vector3Add(pos, Vector3RotateByQuaternion(cv->center, dir));
+	}
+	return pos;
+}
+
+/* Returns the point of the collider of body b furthest along d, in world
+ * space */
+Vector3
+rbp_support_body(rbp_body *b, Vector3 d)
+{
+	rbp_collider *c = rbp_body_collider(b);
+	Vector3 pos = Vector3Add(b->pos, c->offset);
+
+	switch (rbp_shape_type(b)) {
+	case SPHERE: {
+		rbp_shape_sphere *s = c->shape;
+		return Vector3Add(pos, Vector3Scale(Vector3Normalize(d), s->radius));
+	}
+	case CUBOID: {
+		rbp_shape_cuboid *s = c->shape;
+		Quaternion dir = QuaternionMultiply(s->dir, b->dir);
+		dir = QuaternionNormalize(dir);
+		Vector3 l = Vector3RotateByQuaternion(d, QuaternionInvert(dir));
+		l.x = l.x >= 0.0f ? 0.5f*s->xsize : -0.5f*s->xsize;
+		l.y = l.y >= 0.0f ? 0.5f*s->ysize : -0.5f*s->ysize;
+		l.z = l.z >= 0.0f ? 0.5f*s->zsize : -0.5f*s->zsize;
+		return Vector3Add(pos, Vector3RotateByQuaternion(l, dir));
+	}
+	case CAPSULE: {
+		rbp_shape_capsule *s = c->shape;
+		Vector3 p, q;
+		rbp_capsule_segment(b, &p, &q);
+		p = DOT(p, d) > DOT(q, d) ? p : q;
+		return Vector3Add(p, Vector3Scale(Vector3Normalize(d), s->radius));
+	}
+	case CONVEX: {
+		rbp_shape_convex *s = c->shape;
+		Quaternion dir = QuaternionMultiply(s->dir, b->dir);
+		dir = QuaternionNormalize(dir);
+		Vector3 l = Vector3RotateByQuaternion(d, QuaternionInvert(dir));
+		l = s->verts[rbp_convex_support(s, &c->hint, l)];
+		return Vector3Add(pos, Vector3RotateByQuaternion(l, dir));
+	}
+	default:
+		/* no support mapping (heightmap) */
+		return pos;
+	}
+}
+
+/* Calls the support-mappings from each body and returns the
+ * minkowski difference.
+ */
+Vector3
+rbp_support(rbp_body *a, rbp_body *b, Vector3 d)
+{
+	Vector3 sa = rbp_support_body(a, d);
+	Vector3 sb = rbp_support_body(b, NEG(d));
+	return Vector3Subtract(sa, sb);
+}
+
+#include "rbp-gjk.h"
+#include "rbp-mpr.h"
+
+/* Convex hulls collide with the other convex shapes through MPR */
+int
+rbp_collide_convex(rbp_body *b1, rbp_body *b2, rbp_contact *c)
+{
+	rbp_collider *c1 = rbp_body_collider(b1);
+	rbp_collider *c2 = rbp_body_collider(b2);
+
+	if (!rbp_mpr_contact(b1, b2, c)) {
+		/* Miss, c is untouched */
+		return 0;
+	}
+	c->b1 = b1;
+	c->b2 = b2;
+	c->pair = rbp_material_pair(c1->material, c2->material);
+	return 1;
+}
+
+int
+rbp_collide_convex_heightmap(rbp_body *b1, rbp_body *b2, rbp_contact *c)
+{
+	rbp_collider *c1 = rbp_body_collider(b1);
+	rbp_shape_convex *s1 = c1->shape;
+	rbp_collider *c2 = rbp_body_collider(b2);
+	rbp_shape_heightmap *s2 = c2->shape;
+	Vector3 origin = Vector3Add(b2->pos, c2->offset);
+	Vector3 pos1 = Vector3Add(b1->pos, c1->offset);
+	Quaternion dir1 = QuaternionMultiply(s1->dir, b1->dir);
+	dir1 = QuaternionNormalize(dir1);
+	float best = 0.0f;
+	int i;
+
+	/* Test the hull vertices against the surface, keep the deepest */
+	for (i = 0; i < s1->nverts; i++) {
+		Vector3 v = Vector3RotateByQuaternion(s1->verts[i], dir1);
+		v = Vector3Add(pos1, v);
+
+		Vector3 n;
+		float h;
+		if (!rbp_heightmap_sample(s2, origin, v.x, v.z, &h, &n)) {
+			continue;
+		}
+		float distance = (v.y - h) * n.y;
+		if (-distance > best) {
+			best = -distance;
+			c->cn = NEG(n);
+			c->depth = best;
+			c->p1 = v;
+			c->p2 = Vector3Subtract(v, Vector3Scale(n, distance));
+		}
+	}
+
+	if (best <= 0.0f) {
+		return 0;
+	}
+	c->b1 = b1;
+	c->b2 = b2;
+	c->pair = rbp_material_pair(c1->material, c2->material);
+	return 1;
+}
+
+/* Bounding boxes */
+/* Bounds of the box min-max after rotating it by q and moving it by t */
+void
+rbp_aabb_transform(Vector3 *min, Vector3 *max, Quaternion q, Vector3 t)
+{
+	Vector3 c = Vector3Scale(Vector3Add(*min, *max), 0.5f);
+	Vector3 h = Vector3Scale(Vector3Subtract(*max, *min), 0.5f);
+	Vector3 a[3];
+	rbp_cuboid_axes(q, a);
+
+	Vector3 e = {
+		fabsf(a[0].x)*h.x + fabsf(a[1].x)*h.y + fabsf(a[2].x)*h.z,
+		fabsf(a[0].y)*h.x + fabsf(a[1].y)*h.y + fabsf(a[2].y)*h.z,
+		fabsf(a[0].z)*h.x + fabsf(a[1].z)*h.y + fabsf(a[2].z)*h.z};
+	c = Vector3Add(t, Vector3RotateByQuaternion(c, q));
+	*min = Vector3Subtract(c, e);
+	*max = Vector3Add(c, e);
+}
+
+int
+rbp_aabb_overlap(Vector3 min1, Vector3 max1, Vector3 min2, Vector3 max2)
+{
+	return min1.x <= max2.x && max1.x >= min2.x &&
+	    min1.y <= max2.y && max1.y >= min2.y &&
+	    min1.z <= max2.z && max1.z >= min2.z;
+}
+
+/* World space bounds of the collider of body b */
+void
+rbp_collider_aabb(rbp_body *b, Vector3 *min, Vector3 *max)
+{
+	rbp_collider *c = rbp_body_collider(b);
+	Vector3 pos = Vector3Add(b->pos, c->offset);
+
+	switch (rbp_shape_type(b)) {
+	case SPHERE: {
+		rbp_shape_sphere *s = c->shape;
+		*min = Vector3SubtractValue(pos, s->radius);
+		*max = Vector3AddValue(pos, s->radius);
+		return;
+	}
+	case CUBOID: {
+		rbp_shape_cuboid *s = c->shape;
+		Quaternion dir = QuaternionMultiply(s->dir, b->dir);
+		Vector3 h = {0.5f*s->xsize, 0.5f*s->ysize, 0.5f*s->zsize};
+		*min = NEG(h);
+		*max = h;
+		rbp_aabb_transform(min, max, QuaternionNormalize(dir), pos);
+		return;
+	}
+	case CAPSULE: {
+		rbp_shape_capsule *s = c->shape;
+		Vector3 p, q;
+		rbp_capsule_segment(b, &p, &q);
+		*min = Vector3SubtractValue(Vector3Min(p, q), s->radius);
+		*max = Vector3AddValue(Vector3Max(p, q), s->radius);
+		return;
+	}
+	case CONVEX: {
+		/* 6 support queries, cheap thanks to hill climbing */
+		Vector3 ax = {1.0f, 0.0f, 0.0f};
+		Vector3 ay = {0.0f, 1.0f, 0.0f};
+		Vector3 az = {0.0f, 0.0f, 1.0f};
+		min->x = rbp_support_body(b, NEG(ax)).x;
+		min->y = rbp_support_body(b, NEG(ay)).y;
+		min->z = rbp_support_body(b, NEG(az)).z;
+		max->x = rbp_support_body(b, ax).x;
+		max->y = rbp_support_body(b, ay).y;
+		max->z = rbp_support_body(b, az).z;
+		return;
+	}
+	case HEIGHTMAP: {
+		rbp_shape_heightmap *s = c->shape;
+		*min = pos;
+		*max = Vector3Add(pos, (Vector3) {s->xsize, s->ysize, s->zsize});
+		return;
+	}
+	case TRIMESH: {
+		rbp_shape_trimesh *s = c->shape;
+		rbp_bvh_node *root = s->nodes;
+		*min = (Vector3) {root->min[0], root->min[1], root->min[2]};
+		*max = (Vector3) {root->max[0], root->max[1], root->max[2]};
+		rbp_aabb_transform(min, max, b->dir, pos);
+		return;
+	}
+	case COMPOUND: {
+		rbp_shape_compound *s = c->shape;
+		rbp_bvh_node *root = s->nodes;
+		*min = (Vector3) {root->min[0], root->min[1], root->min[2]};
+		*max = (Vector3) {root->max[0], root->max[1], root->max[2]};
+		rbp_aabb_transform(min, max, b->dir, pos);
+		return;
+	}
+	default:
+		*min = pos;
+		*max = pos;
+	}
+}
+
+/* Triangle meshes */
+/* Returns the centroid of triangle i along axis, used to sort triangles */
+float
+rbp_tri_centroid(Vector3 *verts, int *tris, int i, int axis)
+{
+	Vector3 a = verts[tris[3*i]];
+	Vector3 b = verts[tris[3*i + 1]];
+	Vector3 c = verts[tris[3*i + 2]];
+	float s[3] = {a.x + b.x + c.x, a.y + b.y + c.y, a.z + b.z + c.z};
+	return s[axis];
+}
+
+/* Initializes mesh from the nv vertices verts and the nt triangles tris (3
+ * vertex indices each) and builds its BVH. The triangles in tris are
+ * reordered to follow the BVH leaves. mesh keeps pointers to verts and tris
+ * and owns the node array, freed by rbp_trimesh_free or when the last
+ * reference to mesh is released. Returns 0 if the nodes can't be
+ * allocated. */
+int
+rbp_trimesh_build(rbp_shape_trimesh *mesh, Vector3 *verts, int nv, int *tris,
+    int nt)
+{
+	int stack[64][3]; /* parent to patch, first and last triangle */
+	int top = 0;
+	int i, j;
+
+	mesh->shape_type = TRIMESH;
+	mesh->nverts = nv;
+	mesh->verts = verts;
+	mesh->ntris = nt;
+	mesh->tris = tris;
+	mesh->nnodes = 0;
+
+	/* Nodes are aligned to cache lines, 2 per line */
+	mesh->mem = malloc((2*nt + 1)*sizeof(rbp_bvh_node) + RBP_CACHE_LINE);
+	if (mesh->mem == NULL) {
+		return 0;
+	}
+	mesh->nodes = (rbp_bvh_node *) (((size_t) mesh->mem + RBP_CACHE_LINE - 1) &
+	    ~((size_t) RBP_CACHE_LINE - 1));
+
+	/* Top down build: split each range at the median triangle along the
+	 * longest axis of its centroids. Nodes are laid out depth first, so
+	 * the left child always follows its parent and only the index of the
+	 * right child needs to be stored. */
+	stack[top][0] = -1;
+	stack[top][1] = 0;
+	stack[top][2] = nt;
+	top++;
+
+	while (top > 0) {
+		top--;
+		int parent = stack[top][0];
+		int first = stack[top][1];
+		int last = stack[top][2];
+		int index = mesh->nnodes++;
+		rbp_bvh_node *node = &mesh->nodes[index];
+		Vector3 min = {FLT_MAX, FLT_MAX, FLT_MAX};
+		Vector3 max = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+		Vector3 cmin = min;
+		Vector3 cmax = max;
+
+		if (parent >= 0) {
+			/* this is a right child */
+			mesh->nodes[parent].first = index;
+		}
+
+		for (i = first; i < last; i++) {
+			Vector3 a = verts[tris[3*i]];
+			Vector3 b = verts[tris[3*i + 1]];
+			Vector3 c = verts[tris[3*i + 2]];
+			Vector3 ctr = Vector3Scale(Vector3Add(a, Vector3Add(b, c)),
+			    1.0f/3.0f);
+			min = Vector3Min(min, Vector3Min(a, Vector3Min(b, c)));
+			max = Vector3Max(max, Vector3Max(a, Vector3Max(b, c)));
+			cmin = Vector3Min(cmin, ctr);
+			cmax = Vector3Max(cmax, ctr);
+		}
+		node->min[0] = min.x;
+		node->min[1] = min.y;
+		node->min[2] = min.z;
+		node->max[0] = max.x;
+		node->max[1] = max.y;
+		node->max[2] = max.z;
+
+		if (last - first <= RBP_BVH_LEAF || top >= 62) {
+			/* leaf */
+			node->first = first;
+			node->count = last - first;
+			continue;
+		}
+
+		/* Partial sort around the median along the longest axis */
+		Vector3 ext = Vector3Subtract(cmax, cmin);
+		int axis = ext.x > ext.y ? (ext.x > ext.z ? 0 : 2) :
+		    (ext.y > ext.z ? 1 : 2);
+		int mid = (first + last) / 2;
+		int lo = first;
+		int hi = last - 1;
+		while (lo < hi) {
+			float pivot = rbp_tri_centroid(verts, tris, (lo + hi)/2, axis);
+			int l = lo;
+			int r = hi;
+			while (l <= r) {
+				while (rbp_tri_centroid(verts, tris, l, axis) < pivot)
+					l++;
+				while (rbp_tri_centroid(verts, tris, r, axis) > pivot)
+					r--;
+				if (l <= r) {
+					for (j = 0; j < 3; j++) {
+						int t = tris[3*l + j];
+						tris[3*l + j] = tris[3*r + j];
+						tris[3*r + j] = t;
+					}
+					l++;
+					r--;
+				}
+			}
+			if (mid <= r) {
+				hi = r;
+			} else if (mid >= l) {
+				lo = l;
+			} else {
+				break;
+			}
+		}
+		node->count = 0;
+
+		/* Push the right range first so the left one is built next */
+		stack[top][0] = index;
+		stack[top][1] = mid;
+		stack[top][2] = last;
+		top++;
+		stack[top][0] = -1;
+		stack[top][1] = first;
+		stack[top][2] = mid;
+		top++;
+	}
+	return 1;
+}
+
+void
+rbp_trimesh_free(rbp_shape_trimesh *mesh)
+{
+	free(mesh->mem);
+	mesh->mem = NULL;
+	mesh->nodes = NULL;
+	mesh->nnodes = 0;
+}
+
+/* Traversal state of rbp_trimesh_overlap, so that the triangles
+ * overlapping a box are listed a chunk at a time:
+ * min, max = the box, in mesh space;
+ * stack, top = nodes left to visit;
+ * leaf, next = leaf being listed and its next triangle, leaf is -1 if none;
+ */
+typedef struct rbp_trimesh_cursor {
+	Vector3 min;
+	Vector3 max;
+	int stack[64];
+	int top;
+	int leaf;
+	int next;
+} rbp_trimesh_cursor;
+
+/* Starts cur on the triangles of mesh whose leaves overlap the box
+ * min-max (in mesh space) */
+void
+rbp_trimesh_overlap_begin(rbp_shape_trimesh *mesh, rbp_trimesh_cursor *cur,
+    Vector3 min, Vector3 max)
+{
+	cur->min = min;
+	cur->max = max;
+	cur->top = 0;
+	cur->leaf = -1;
+	cur->next = 0;
+	if (mesh->nnodes > 0) {
+		cur->stack[cur->top++] = 0;
+	}
+}
+
+/* Writes to out the indices of the next triangles of cur, up to maxout.
+ * Returns how many were found, 0 once every overlapping leaf was listed. */
+int
+rbp_trimesh_overlap(rbp_shape_trimesh *mesh, rbp_trimesh_cursor *cur,
+    int *out, int maxout)
+{
+	Vector3 min = cur->min;
+	Vector3 max = cur->max;
+	int n = 0;
+
+	for (;;) {
+		if (cur->leaf >= 0) {
+			rbp_bvh_node *leaf = &mesh->nodes[cur->leaf];
+			int end = leaf->first + leaf->count;
+			while (cur->next < end && n < maxout) {
+				out[n++] = cur->next++;
+			}
+			if (cur->next < end) {
+				return n; /* out is full, go on next time */
+			}
+			cur->leaf = -1;
+		}
+		if (cur->top == 0) {
+			return n;
+		}
+
+		int i = cur->stack[--cur->top];
+		rbp_bvh_node *node = &mesh->nodes[i];
+		if (node->min[0] > max.x || node->max[0] < min.x ||
+		    node->min[1] > max.y || node->max[1] < min.y ||
+		    node->min[2] > max.z || node->max[2] < min.z) {
+			continue;
+		}
+		if (node->count > 0) {
+			cur->leaf = i;
+			cur->next = node->first;
+			continue;
+		}
+		cur->stack[cur->top++] = node->first; /* right */
+		cur->stack[cur->top++] = i + 1; /* left */
+	}
+}
+
+/* Returns the point of triangle abc closest to p */
+Vector3
+rbp_closest_triangle_point(Vector3 a, Vector3 b, Vector3 c, Vector3 p)
+{
+	Vector3 ab = Vector3Subtract(b, a);
+	Vector3 ac = Vector3Subtract(c, a);
+	Vector3 ap = Vector3Subtract(p, a);
+	float d1 = DOT(ab, ap);
+	float d2 = DOT(ac, ap);
+	if (d1 <= 0.0f && d2 <= 0.0f) {
+		return a; /* vertex region a */
+	}
+
+	Vector3 bp = Vector3Subtract(p, b);
+	float d3 = DOT(ab, bp);
+	float d4 = DOT(ac, bp);
+	if (d3 >= 0.0f && d4 <= d3) {
+		return b; /* vertex region b */
+	}
+
+	float vc = d1*d4 - d3*d2;
+	if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+		/* edge region ab */
+		return Vector3Add(a, Vector3Scale(ab, d1 / (d1 - d3)));
+	}
+
+	Vector3 cp = Vector3Subtract(p, c);
+	float d5 = DOT(ab, cp);
+	float d6 = DOT(ac, cp);
+	if (d6 >= 0.0f && d5 <= d6) {
+		return c; /* vertex region c */
+	}
+
+	float vb = d5*d2 - d1*d6;
+	if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+		/* edge region ac */
+		return Vector3Add(a, Vector3Scale(ac, d2 / (d2 - d6)));
+	}
+
+	float va = d3*d6 - d5*d4;
+	if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) {
+		/* edge region bc */
+		float w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+		return Vector3Add(b, Vector3Scale(Vector3Subtract(c, b), w));
+	}
+
+	/* inside the face */
+	float denom = 1.0f / (va + vb + vc);
+	return Vector3Add(a, Vector3Add(Vector3Scale(ab, vb*denom),
+	    Vector3Scale(ac, vc*denom)));
+}
+
+/* Finds the closest points between segment pq and triangle abc, writes the
+ * point on the segment to s and the point on the triangle to t. */
+void
+rbp_closest_segment_triangle(Vector3 p, Vector3 q, Vector3 a, Vector3 b,
+    Vector3 c, Vector3 *s, Vector3 *t)
+{
+	Vector3 tri[3] = {a, b, c};
+	Vector3 n = X(Vector3Subtract(b, a), Vector3Subtract(c, a));
+	float dp = DOT(Vector3Subtract(p, a), n);
+	float dq = DOT(Vector3Subtract(q, a), n);
+	float best, d;
+	int i;
+
+	if ((dp < 0.0f && dq > 0.0f) || (dp > 0.0f && dq < 0.0f)) {
+		/* The segment crosses the plane, check if it's inside */
+		Vector3 x = Vector3Lerp(p, q, dp / (dp - dq));
+		Vector3 y = rbp_closest_triangle_point(a, b, c, x);
+		if (Vector3Distance(x, y) < 1e-6f) {
+			*s = x;
+			*t = x;
+			return;
+		}
+	}
+
+	/* Otherwise the closest points involve an end of the segment or an
+	 * edge of the triangle */
+	*s = p;
+	*t = rbp_closest_triangle_point(a, b, c, p);
+	best = Vector3Distance(*s, *t);
+
+	Vector3 y = rbp_closest_triangle_point(a, b, c, q);
+	d = Vector3Distance(q, y);
+	if (d < best) {
+		best = d;
+		*s = q;
+		*t = y;
+	}
+
+	for (i = 0; i < 3; i++) {
+		float u, v;
+		Vector3 e1 = tri[i];
+		Vector3 e2 = tri[(i+1) % 3];
+		rbp_closest_segment_segment(p, q, e1, e2, &u, &v);
+		Vector3 x = Vector3Lerp(p, q, u);
+		y = Vector3Lerp(e1, e2, v);
+		d = Vector3Distance(x, y);
+		if (d < best) {
+			best = d;
+			*s = x;
+			*t = y;
+		}
+	}
+}
+
+/* Places the triangle i of the trimesh of body b in world space */
+void
+rbp_trimesh_triangle(rbp_body *b, int i, Vector3 *tri)
+{
+	rbp_collider *c = rbp_body_collider(b);
+	rbp_shape_trimesh *s = c->shape;
+	Vector3 pos = Vector3Add(b->pos, c->offset);
+	int *t = &s->tris[3*i];
+	int k;
+
+	for (k = 0; k < 3; k++) {
+		tri[k] = Vector3RotateByQuaternion(s->verts[t[k]], b->dir);
+		tri[k] = Vector3Add(pos, tri[k]);
+	}
+}
+
+/* Starts cur on the triangles of the trimesh in b2 that may touch the
+ * collider of b1, see rbp_trimesh_overlap */
+void
+rbp_trimesh_candidates(rbp_body *b1, rbp_body *b2, rbp_trimesh_cursor *cur)
+{
+	rbp_collider *c2 = rbp_body_collider(b2);
+	rbp_shape_trimesh *s2 = c2->shape;
+	Vector3 min, max;
+
+	/* Bounds of b1 in mesh space */
+	rbp_collider_aabb(b1, &min, &max);
+	Vector3 pos = Vector3Add(b2->pos, c2->offset);
+	Quaternion unrot = QuaternionInvert(b2->dir);
+	min = Vector3Subtract(min, pos);
+	max = Vector3Subtract(max, pos);
+	rbp_aabb_transform(&min, &max, unrot, Vector3Zero());
+	rbp_trimesh_overlap_begin(s2, cur, min, max);
+}
+
+/* Fills c with the contact between a sphere at pos with the given radius
+ * and the trimesh in b2, keeping the deepest triangle. Returns 0 on a miss.
+ * Capsules pass their segment as p-q, spheres pass p == q. */
+int
+rbp_contact_segment_trimesh(Vector3 p, Vector3 q, float radius,
+    rbp_body *b1, rbp_body *b2, rbp_contact *c)
+{
+	rbp_shape_trimesh *s2 = rbp_body_collider(b2)->shape;
+	rbp_trimesh_cursor cur;
+	int cand[RBP_TRIMESH_CANDIDATES];
+	int i, n, hit = 0;
+	float best = 0.0f;
+
+	rbp_trimesh_candidates(b1, b2, &cur);
+	while ((n = rbp_trimesh_overlap(s2, &cur, cand,
+	    RBP_TRIMESH_CANDIDATES)) > 0) {
+		for (i = 0; i < n; i++) {
+			Vector3 tri[3];
+			Vector3 s, t;
+			rbp_trimesh_triangle(b2, cand[i], tri);
+			rbp_closest_segment_triangle(p, q, tri[0], tri[1],
+			    tri[2], &s, &t);
+
+			Vector3 d = Vector3Subtract(t, s);
+			float distance = Vector3Length(d);
+			float depth = radius - distance;
+			if (depth <= best) {
+				continue;
+			}
+
+			Vector3 cn;
+			if (distance > 1e-6f) {
+				cn = Vector3Scale(d, 1.0f/distance);
+			} else {
+				/* the segment touches the triangle, push along
+				 * its normal */
+				cn = Vector3Normalize(X(Vector3Subtract(tri[1],
+				    tri[0]), Vector3Subtract(tri[2], tri[0])));
+				cn = NEG(cn);
+			}
+			best = depth;
+			hit = 1;
+			c->cn = cn;
+			c->depth = depth;
+			c->p1 = Vector3Add(s, Vector3Scale(cn, radius));
+			c->p2 = t;
+		}
+	}
+	return hit;
+}
+
+int
+rbp_collide_sphere_trimesh(rbp_body *b1, rbp_body *b2, rbp_contact *c)
+{
+	rbp_collider *c1 = rbp_body_collider(b1);
+	rbp_shape_sphere *s1 = c1->shape;
+	rbp_collider *c2 = rbp_body_collider(b2);
+	Vector3 pos1 = Vector3Add(b1->pos, c1->offset);
+
+	if (!rbp_contact_segment_trimesh(pos1, pos1, s1->radius, b1, b2, c)) {
+		return 0;
+	}
+	c->b1 = b1;
+	c->b2 = b2;
+	c->pair = rbp_material_pair(c1->material, c2->material);
+	return 1;
+}
+
+int
+rbp_collide_capsule_trimesh(rbp_body *b1, rbp_body *b2, rbp_contact *c)
+{
+	rbp_collider *c1 = rbp_body_collider(b1);
+	rbp_shape_capsule *s1 = c1->shape;
+	rbp_collider *c2 = rbp_body_collider(b2);
+	Vector3 p, q;
+
+	rbp_capsule_segment(b1, &p, &q);
+	if (!rbp_contact_segment_trimesh(p, q, s1->radius, b1, b2, c)) {
+		return 0;
+	}
+	c->b1 = b1;
+	c->b2 = b2;
+	c->pair = rbp_material_pair(c1->material, c2->material);
+	return 1;
+}
+
+/* Cuboids and convex hulls are tested against each candidate triangle
+ * with MPR, using the triangle as a 3 vertex convex hull */
+int
+rbp_collide_convex_trimesh(rbp_body *b1, rbp_body *b2, rbp_contact *c)
+{
+	rbp_collider *c1 = rbp_body_collider(b1);
+	rbp_collider *c2 = rbp_body_collider(b2);
+	rbp_trimesh_cursor cur;
+	int cand[RBP_TRIMESH_CANDIDATES];
+	int adj_start[4] = {0, 2, 4, 6};
+	int adj[6] = {1, 2, 0, 2, 0, 1};
+	rbp_contact sample;
+	int i, n, hit = 0;
+
+	rbp_shape_convex ts = {0};
+	ts.shape_type = CONVEX;
+	ts.dir = QuaternionIdentity();
+	ts.nverts = 3;
+	ts.adj_start = adj_start;
+	ts.adj = adj;
+	rbp_collider tc = {0};
+	tc.shape = &ts;
+	rbp_body_props tp = {0};
+	tp.collider = &tc;
+	rbp_body tb = {0};
+	tb.dir = QuaternionIdentity();
+	tb.props = &tp;
+
+	rbp_trimesh_candidates(b1, b2, &cur);
+	while ((n = rbp_trimesh_overlap(c2->shape, &cur, cand,
+	    RBP_TRIMESH_CANDIDATES)) > 0) {
+		for (i = 0; i < n; i++) {
+			Vector3 tri[3];
+			rbp_trimesh_triangle(b2, cand[i], tri);
+			ts.verts = tri;
+			tc.hint = 0;
+			ts.center = Vector3Scale(Vector3Add(tri[0],
+			    Vector3Add(tri[1], tri[2])), 1.0f/3.0f);
+			if (rbp_mpr_contact(b1, &tb, &sample) &&
+			    (!hit || sample.depth > c->depth)) {
+				*c = sample;
+				hit = 1;
+			}
+		}
+	}
+
+	if (!hit) {
+		return 0;
+	}
+	c->b1 = b1;
+	c->b2 = b2;
+	c->pair = rbp_material_pair(c1->material, c2->material);
+	return 1;
+}
+
+/* Compound colliders */
+int rbp_collide(rbp_body *b1, rbp_body *b2, rbp_contact *c);
+
+/* Sets proxy to a copy of body b carrying a copy of the child collider of
+ * the compound collider c instead, placed so that the child ends up where
+ * it belongs. The copies of the properties and the collider go to pp and
+ * pc, so that collision routines writing to the collider, like the support
+ * hint of convex shapes, leave the children of the shared compound
+ * alone. */
+void
+rbp_compound_proxy(rbp_body *b, rbp_collider *c, rbp_collider *child,
+    rbp_body *proxy, rbp_body_props *pp, rbp_collider *pc)
+{
+	Vector3 pos = Vector3Add(b->pos, c->offset);
+	pos = Vector3Add(pos, Vector3RotateByQuaternion(child->offset, b->dir));
+
+	*pc = *child;
+	*pp = *b->props;
+	pp->collider = pc;
+	*proxy = *b;
+	proxy->props = pp;
+	proxy->pos = Vector3Subtract(pos, child->offset);
+}
+
+/* Bounds of a child in the frame of its compound */
+void
+rbp_compound_child_aabb(rbp_collider *child, Vector3 *min, Vector3 *max)
+{
+	rbp_body_props tp = {0};
+	tp.collider = child;
+	rbp_body tb = {0};
+	tb.dir = QuaternionIdentity();
+	tb.pos = NEG(child->offset);
+	tb.props = &tp;
+	rbp_collider_aabb(&tb, min, max);
+	*min = Vector3Add(*min, child->offset);
+	*max = Vector3Add(*max, child->offset);
+}
+
+/* Initializes c with the n colliders in children and builds the AABB tree
+ * over them. nodes must hold 2*n - 1 nodes, children gets reordered to
+ * follow the tree leaves. c keeps pointers to children and nodes.
+ */
+void
+rbp_compound_init(rbp_shape_compound *c, rbp_collider *children, int n,
+    rbp_bvh_node *nodes)
+{
+	int stack[64][3]; /* parent to patch, first and last child */
+	int top = 0;
+	int i, j;
+
+	c->shape_type = COMPOUND;
+	c->nchildren = n;
+	c->children = children;
+	c->nnodes = 0;
+	c->nodes = nodes;
+
+	/* Same layout as the trimesh BVH, with one child per leaf */
+	stack[top][0] = -1;
+	stack[top][1] = 0;
+	stack[top][2] = n;
+	top++;
+
+	while (top > 0) {
+		top--;
+		int parent = stack[top][0];
+		int first = stack[top][1];
+		int last = stack[top][2];
+		int index = c->nnodes++;
+		rbp_bvh_node *node = &nodes[index];
+		Vector3 min = {FLT_MAX, FLT_MAX, FLT_MAX};
+		Vector3 max = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+		float key[3];
+
+		if (parent >= 0) {
+			/* this is a right child */
+			nodes[parent].first = index;
+		}
+
+		for (i = first; i < last; i++) {
+			Vector3 cmin, cmax;
+			rbp_compound_child_aabb(&children[i], &cmin, &cmax);
+			min = Vector3Min(min, cmin);
+			max = Vector3Max(max, cmax);
+		}
+		node->min[0] = min.x;
+		node->min[1] = min.y;
+		node->min[2] = min.z;
+		node->max[0] = max.x;
+		node->max[1] = max.y;
+		node->max[2] = max.z;
+
+		if (last - first <= 1) {
+			/* leaf */
+			node->first = first;
+			node->count = last - first;
+			continue;
+		}
+
+		/* Sort the children along the longest axis, there are few of
+		 * them so insertion sort is fine */
+		Vector3 ext = Vector3Subtract(max, min);
+		int axis = ext.x > ext.y ? (ext.x > ext.z ? 0 : 2) :
+		    (ext.y > ext.z ? 1 : 2);
+		for (i = first + 1; i < last; i++) {
+			rbp_collider child = children[i];
+			key[0] = child.offset.x;
+			key[1] = child.offset.y;
+			key[2] = child.offset.z;
+			for (j = i; j > first; j--) {
+				Vector3 o = children[j - 1].offset;
+				float k[3] = {o.x, o.y, o.z};
+				if (k[axis] <= key[axis]) {
+					break;
+				}
+				children[j] = children[j - 1];
+			}
+			children[j] = child;
+		}
+		node->count = 0;
+
+		/* Push the right range first so the left one is built next */
+		int mid = (first + last) / 2;
+		stack[top][0] = index;
+		stack[top][1] = mid;
+		stack[top][2] = last;
+		top++;
+		stack[top][0] = -1;
+		stack[top][1] = first;
+		stack[top][2] = mid;
+		top++;
+	}
+}
+
+/* Collides every child of the compound in b1 whose bounds overlap b2 and
+ * keeps the deepest contact. b2 may be a compound as well. */
+int
+rbp_collide_compound(rbp_body *b1, rbp_body *b2, rbp_contact *c)
+{
+	rbp_collider *c1 = rbp_body_collider(b1);
+	rbp_shape_compound *s1 = c1->shape;
+	rbp_body proxy;
+	rbp_body_props pp;
+	rbp_collider pc;
+	rbp_contact sample;
+	Vector3 min, max;
+	int stack[64];
+	int top = 0;
+	int hit = 0;
+
+	if (s1->nnodes == 0) {
+		return 0;
+	}
+
+	/* Bounds of b2 in the compound frame */
+	rbp_collider_aabb(b2, &min, &max);
+	Vector3 pos = Vector3Add(b1->pos, c1->offset);
+	min = Vector3Subtract(min, pos);
+	max = Vector3Subtract(max, pos);
+	rbp_aabb_transform(&min, &max, QuaternionInvert(b1->dir), Vector3Zero());
+
+	stack[top++] = 0;
+	while (top > 0) {
+		int i = stack[--top];
+		rbp_bvh_node *node = &s1->nodes[i];
+
+		if (node->min[0] > max.x || node->max[0] < min.x ||
+		    node->min[1] > max.y || node->max[1] < min.y ||
+		    node->min[2] > max.z || node->max[2] < min.z) {
+			continue;
+		}
+		if (node->count == 0) {
+			stack[top++] = node->first; /* right */
+			stack[top++] = i + 1; /* left */
+			continue;
+		}
+
+		rbp_compound_proxy(b1, c1, &s1->children[node->first], &proxy,
+		    &pp, &pc);
+		if (rbp_collide(&proxy, b2, &sample) &&
+		    (!hit || sample.depth > c->depth)) {
+			/* report the contact on the real body */
+			if (sample.b1 == &proxy) {
+				sample.b1 = b1;
+			} else {
+				sample.b2 = b1;
+			}
+			*c = sample;
+			hit = 1;
+		}
+	}
+	return hit;
+}
+
+int
+rbp_collide(rbp_body *b1, rbp_body *b2, rbp_contact *c)
+{
+	rbp_body *a;
+	rbp_body *b;
+	int (*collide)(rbp_body*, rbp_body*, rbp_contact*);
+
+	rbp_collider_type a_type = rbp_shape_type(b1);
+	rbp_collider_type b_type = rbp_shape_type(b2);
+
+	/* Ensure smallest shape type goes in as b1 */
+	a = b1;
+	b = b2;
+	if (a_type > b_type) {
+		a = b2;
+		b = b1;
 
 		rbp_collider_type tmp = a_type;
 		a_type = b_type;
 		b_type = tmp;
 	}
 
+	if (b_type == COMPOUND) {
+		/* anything vs compound, goes through the children */
+		return rbp_collide_compound(b, a, c);
+	}
+
+	if (b_type == CONVEX && a_type != HEIGHTMAP) {
+		/* sphere, cuboid, capsule or convex vs convex */
+		return rbp_collide_convex(a, b, c);
+	}
+
 	switch (a_type) {
+	case HEIGHTMAP:
+		/* shape vs heightmap, the heightmap always goes in as b2 */
+		switch (b_type) {
+		case SPHERE: /* sphere vs heightmap */
+			return rbp_collide_sphere_heightmap(b, a, c);
+		case CUBOID: /* cuboid vs heightmap */
+			return rbp_collide_cuboid_heightmap(b, a, c);
+		case CAPSULE: /* capsule vs heightmap */
+			return rbp_collide_capsule_heightmap(b, a, c);
+		case CONVEX: /* convex vs heightmap */
+			return rbp_collide_convex_heightmap(b, a, c);
+		default: return 0;
+		}
+
 	case SPHERE:
 		switch (b_type) {
 		case SPHERE: /* sphere vs sphere */
@@ -416,9 +2976,11 @@ rbp_collide(rbp_body *b1, rbp_body *b2, rbp_contact *c)
 		case CUBOID: /* sphere vs cuboid */
 			collide = rbp_collide_sphere_cuboid;
 			break;
-
-		case HEIGHTMAP: /* sphere vs heightmap */
-			collide = rbp_collide_sphere_heightmap;
+		case CAPSULE: /* sphere vs capsule */
+			collide = rbp_collide_sphere_capsule;
+			break;
+		case TRIMESH: /* sphere vs trimesh */
+			collide = rbp_collide_sphere_trimesh;
 			break;
 		default: return 0;
 		}
@@ -429,9 +2991,32 @@ rbp_collide(rbp_body *b1, rbp_body *b2, rbp_contact *c)
 		case CUBOID: /* cuboid vs cuboid */
 			collide = rbp_collide_cuboid_cuboid;
 			break;
+		case CAPSULE: /* cuboid vs capsule */
+			collide = rbp_collide_cuboid_capsule;
+			break;
+		case TRIMESH: /* cuboid vs trimesh */
+			collide = rbp_collide_convex_trimesh;
+			break;
+		default: return 0;
+		}
+		break;
+
+	case CAPSULE:
+		switch (b_type) {
+		case CAPSULE: /* capsule vs capsule */
+			collide = rbp_collide_capsule_capsule;
+			break;
+		case TRIMESH: /* capsule vs trimesh */
+			collide = rbp_collide_capsule_trimesh;
+			break;
+		default: return 0;
+		}
+		break;
 
-		case HEIGHTMAP: /* cuboid vs heightmap */
-			collide = rbp_collide_cuboid_heightmap;
+	case CONVEX:
+		switch (b_type) {
+		case TRIMESH: /* convex vs trimesh */
+			collide = rbp_collide_convex_trimesh;
 			break;
 		default: return 0;
 		}
@@ -443,9 +3028,38 @@ rbp_collide(rbp_body *b1, rbp_body *b2, rbp_contact *c)
 	return collide(a, b, c);
 }
 
+/* Same as rbp_collide, but reports every contact point of the collision in
+ * manifold m. Returns the number of contact points (0 on a miss). */
+int
+rbp_collide_manifold(rbp_body *b1, rbp_body *b2, rbp_manifold *m)
+{
+	rbp_contact c;
+
+	if (rbp_shape_type(b1) == CUBOID && rbp_shape_type(b2) == CUBOID) {
+		/* face clipping */
+		return rbp_collide_cuboid_cuboid_manifold(b1, b2, m);
+	}
+
+	/* Every other pair touches at a single point */
+	if (!rbp_collide(b1, b2, &c)) {
+		return 0;
+	}
+	m->b1 = c.b1;
+	m->b2 = c.b2;
+	m->cn = c.cn;
+	m->pair = c.pair;
+	m->n = 1;
+	m->p1[0] = c.p1;
+	m->p2[0] = c.p2;
+	m->depth[0] = c.depth;
+	return 1;
+}
+
 /* Collision resolution */
-void
-rbp_resolve_collision(rbp_contact *c, float dt)
+/* Applies the collision and friction impulses of contact c. Returns 0 if the
+ * bodies are already receding and nothing was done, 1 otherwise. */
+int
+rbp_resolve_impulse(rbp_contact *c)
 {
 	/* Unpack c */
 	rbp_body *b1 = c->b1;
@@ -453,10 +3067,10 @@ rbp_resolve_collision(rbp_contact *c, float dt)
 	Vector3 p1 = c->p1;
 	Vector3 p2 = c->p2;
 	Vector3 cn = c->cn;
-	float depth = c->depth;
-	float e = c->e;
-	float uf_s = c->uf_s;
-	float uf_d = c->uf_d;
+	rbp_material *mat = &rbp_materials.pairs[c->pair];
+	float e = mat->e;
+	float uf_s = mat->uf_s;
+	float uf_d = mat->uf_d;
 
 	/* Unpack b1 and b2 */
 	float m1inv = b1->minv;
@@ -481,7 +3095,7 @@ rbp_resolve_collision(rbp_contact *c, float dt)
 	 * are at rest or receding */
 	if (vrn >= 0) {
 		/* bail out early if objects are receding */
-		return;
+		return 0;
 	}
 
 	/* Calculate jrn (normal direction impulses) */
@@ -536,14 +3150,452 @@ rbp_resolve_collision(rbp_contact *c, float dt)
 	b1->L = Vector3Add(b1->L, dL1);
 	b2->p = Vector3Add(b2->p, dp2);
 	b2->L = Vector3Add(b2->L, dL2);
+	return 1;
+}
+
+/* Split impulse position correction: pushes the bodies of contact c apart
+ * by applying an impulse to their bias velocities (vb and wb) instead of
+ * their momenta. Bias velocities only move the bodies on the next
+ * rbp_update and are discarded afterwards, so correcting penetration never
+ * adds energy to the system. */
+void
+rbp_resolve_penetration(rbp_contact *c, float dt)
+{
+	rbp_body *b1 = c->b1;
+	rbp_body *b2 = c->b2;
+	Vector3 cn = c->cn;
+
+	/* Only solve the penetration beyond the allowed slop */
+	float err = c->depth - rbp_solver.slop;
+	if (err <= 0.0f) {
+		return;
+	}
+	float target = rbp_solver.baumgarte * err / dt;
+
+	/* Relative bias velocity at the contact points in the direction 1->2 */
+	Vector3 r1 = Vector3Subtract(c->p1, b1->pos);
+	Vector3 r2 = Vector3Subtract(c->p2, b2->pos);
+	Vector3 vb1 = Vector3Add(b1->vb, X(b1->wb, r1));
+	Vector3 vb2 = Vector3Add(b2->vb, X(b2->wb, r2));
+	float vbn = DOT(Vector3Subtract(vb2, vb1), cn);
+
+	if (vbn >= target) {
+		/* already separating fast enough */
+		return;
+	}
+
+	/* Calculate the bias impulse jb along cn */
+	Vector3 wn1 = MatrixVector3Multiply(rbp_Iinv(b1), X(r1, cn));
+	Vector3 wn2 = MatrixVector3Multiply(rbp_Iinv(b2), X(r2, cn));
+	float k = b1->minv + b2->minv + DOT(Vector3Add(X(wn1, r1), X(wn2, r2)), cn);
+	float jb = (target - vbn) / k;
+
+	/* Apply bias impulses */
+	b1->vb = Vector3Subtract(b1->vb, Vector3Scale(cn, jb*b1->minv));
+	b1->wb = Vector3Subtract(b1->wb, Vector3Scale(wn1, jb));
+	b2->vb = Vector3Add(b2->vb, Vector3Scale(cn, jb*b2->minv));
+	b2->wb = Vector3Add(b2->wb, Vector3Scale(wn2, jb));
+}
+
+void
+rbp_resolve_collision(rbp_contact *c, float dt)
+{
+	rbp_resolve_impulse(c);
+	rbp_resolve_penetration(c, dt);
+}
+
+/* Resolves all the points of manifold m */
+void
+rbp_resolve_manifold(rbp_manifold *m, float dt)
+{
+	rbp_contact c;
+	int i;
+
+	for (i = 0; i < m->n; i++) {
+		rbp_manifold_contact(m, i, &c);
+		rbp_resolve_impulse(&c);
+		rbp_resolve_penetration(&c, dt);
+	}
+}
+
+/* Batch contact resolution */
+/* Velocities of a body involved in a batch, gathered once by the prepare
+ * pass and updated in place by the iterations.
+ * v, w = linear and angular velocities
+ * vb, wb = linear and angular bias velocities
+ */
+typedef struct rbp_solver_body {
+	rbp_body *b;
+	float minv;
+	Vector3 v;
+	Vector3 w;
+	Vector3 vb;
+	Vector3 wb;
+} rbp_solver_body;
+
+/* Contact constraints in SoA layout, laid out by rbp_constraints_layout
+ * over memory of the caller. Every contact has 3 rows, one along the
+ * normal (cn) and two along the tangents (t1, t2). For each row:
+ * rx1, rx2 = r1 x row and r2 x row, the angular jacobians
+ * ax1, ax2 = Iinv * (r x row), the angular velocity change per unit impulse
+ * k = effective mass, 1/(J M^-1 J^T)
+ * j = accumulated impulse
+ */
+typedef struct rbp_constraints {
+	int n;
+	int *b1;
+	int *b2;
+	Vector3 *r1;
+	Vector3 *r2;
+
+	Vector3 *cn;
+	Vector3 *t1;
+	Vector3 *t2;
+	Vector3 *rxn1;
+	Vector3 *rxn2;
+	Vector3 *rxt11;
+	Vector3 *rxt12;
+	Vector3 *rxt21;
+	Vector3 *rxt22;
+	Vector3 *axn1;
+	Vector3 *axn2;
+	Vector3 *axt11;
+	Vector3 *axt12;
+	Vector3 *axt21;
+	Vector3 *axt22;
+	float *kn;
+	float *kt1;
+	float *kt2;
+
+	/* restitution target velocity and position correction target bias
+	 * velocity along n */
+	float *vn_target;
+	float *vb_target;
+
+	float *uf_s;
+	float *uf_d;
+
+	float *jn;
+	float *jt1;
+	float *jt2;
+	float *jb;
+
+	/* solver bodies, at most 2 per contact, and an open addressing hash
+	 * from rbp_body pointers to their index, hsize a power of two at least
+	 * twice the number of bodies */
+	int nbodies;
+	rbp_solver_body *bodies;
+	int hsize;
+	int *hash;
+} rbp_constraints;
+
+/* Points the arrays of s into mem for a batch of n contacts and returns
+ * the bytes of mem they take. With mem NULL only the size is computed. */
+size_t
+rbp_constraints_layout(rbp_constraints *s, char *mem, int n)
+{
+	size_t off = 0;
+
+#define RBP_CARVE(field, count) \
+	(s->field = mem != NULL ? (void *) (mem + off) : NULL, \
+	    off += (size_t) (count)*sizeof(*s->field))
+
+	s->hsize = 1;
+	while (s->hsize < 4*n) {
+		s->hsize *= 2;
+	}
+	RBP_CARVE(bodies, 2*n); /* first, it holds pointers */
+	RBP_CARVE(hash, s->hsize);
+	RBP_CARVE(b1, n);
+	RBP_CARVE(b2, n);
+	RBP_CARVE(r1, n);
+	RBP_CARVE(r2, n);
+	RBP_CARVE(cn, n);
+	RBP_CARVE(t1, n);
+	RBP_CARVE(t2, n);
+	RBP_CARVE(rxn1, n);
+	RBP_CARVE(rxn2, n);
+	RBP_CARVE(rxt11, n);
+	RBP_CARVE(rxt12, n);
+	RBP_CARVE(rxt21, n);
+	RBP_CARVE(rxt22, n);
+	RBP_CARVE(axn1, n);
+	RBP_CARVE(axn2, n);
+	RBP_CARVE(axt11, n);
+	RBP_CARVE(axt12, n);
+	RBP_CARVE(axt21, n);
+	RBP_CARVE(axt22, n);
+	RBP_CARVE(kn, n);
+	RBP_CARVE(kt1, n);
+	RBP_CARVE(kt2, n);
+	RBP_CARVE(vn_target, n);
+	RBP_CARVE(vb_target, n);
+	RBP_CARVE(uf_s, n);
+	RBP_CARVE(uf_d, n);
+	RBP_CARVE(jn, n);
+	RBP_CARVE(jt1, n);
+	RBP_CARVE(jt2, n);
+	RBP_CARVE(jb, n);
+#undef RBP_CARVE
+	return off;
+}
+
+/* Bytes of memory rbp_resolve_contacts needs to resolve n contacts */
+size_t
+rbp_constraints_size(int n)
+{
+	rbp_constraints s;
+	return rbp_constraints_layout(&s, NULL, n);
+}
+
+/* Returns the index of b in the solver bodies of s, adding it if needed */
+int
+rbp_solver_body_index(rbp_constraints *s, rbp_body *b)
+{
+	uintptr_t h = ((uintptr_t) b >> 4) * 2654435761u;
+	int i = (int) (h & (uintptr_t) (s->hsize - 1));
+
+	while (s->hash[i] >= 0) {
+		if (s->bodies[s->hash[i]].b == b) {
+			return s->hash[i];
+		}
+		i = (i + 1) & (s->hsize - 1);
+	}
+
+	/* New body, gather its velocities */
+	rbp_solver_body *sb = &s->bodies[s->nbodies];
+	sb->b = b;
+	sb->minv = b->minv;
+	sb->v = rbp_v(b);
+	sb->w = rbp_w(b);
+	sb->vb = b->vb;
+	sb->wb = b->wb;
+	s->hash[i] = s->nbodies;
+	return s->nbodies++;
+}
+
+/* Effective mass of a constraint row along d with angular jacobians rx1,
+ * rx2 and angular responses ax1, ax2 */
+float
+rbp_effective_mass(float minv, Vector3 rx1, Vector3 ax1, Vector3 rx2,
+    Vector3 ax2)
+{
+	float k = minv + DOT(rx1, ax1) + DOT(rx2, ax2);
+	return k > 0.0f ? 1.0f/k : 0.0f;
+}
+
+/* Prepare pass: computes everything that doesn't change between
+ * iterations for contacts[0..n-1] and stores it in s. */
+void
+rbp_prepare_contacts(rbp_constraints *s, rbp_contact *contacts, int n,
+    float dt)
+{
+	int i;
+
+	s->n = n;
+	s->nbodies = 0;
+	for (i = 0; i < s->hsize; i++) {
+		s->hash[i] = -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		rbp_contact *c = &contacts[i];
+		rbp_material *mat = &rbp_materials.pairs[c->pair];
+		int i1 = rbp_solver_body_index(s, c->b1);
+		int i2 = rbp_solver_body_index(s, c->b2);
+		rbp_solver_body *sb1 = &s->bodies[i1];
+		rbp_solver_body *sb2 = &s->bodies[i2];
+		Matrix I1inv = rbp_Iinv(c->b1);
+		Matrix I2inv = rbp_Iinv(c->b2);
+		float minv = sb1->minv + sb2->minv;
+		Vector3 cn = c->cn;
+
+		Vector3 r1 = Vector3Subtract(c->p1, c->b1->pos);
+		Vector3 r2 = Vector3Subtract(c->p2, c->b2->pos);
+		Vector3 vp1 = Vector3Add(sb1->v, X(sb1->w, r1));
+		Vector3 vp2 = Vector3Add(sb2->v, X(sb2->w, r2));
+		Vector3 vr = Vector3Subtract(vp2, vp1);
+		float vrn = DOT(vr, cn);
+
+		/* Tangent basis: t1 along the sliding direction if there is
+		 * one, any direction orthogonal to cn otherwise */
+		Vector3 t1 = Vector3Subtract(vr, Vector3Scale(cn, vrn));
+		if (DOT(t1, t1) < 1e-12f) {
+			Vector3 ax = {1.0f, 0.0f, 0.0f};
+			Vector3 ay = {0.0f, 1.0f, 0.0f};
+			t1 = X(cn, fabsf(cn.x) < 0.57735f ? ax : ay);
+		}
+		t1 = Vector3Normalize(t1);
+		Vector3 t2 = X(cn, t1);
+
+		s->b1[i] = i1;
+		s->b2[i] = i2;
+		s->r1[i] = r1;
+		s->r2[i] = r2;
+		s->cn[i] = cn;
+		s->t1[i] = t1;
+		s->t2[i] = t2;
+
+		s->rxn1[i] = X(r1, cn);
+		s->rxn2[i] = X(r2, cn);
+		s->rxt11[i] = X(r1, t1);
+		s->rxt12[i] = X(r2, t1);
+		s->rxt21[i] = X(r1, t2);
+		s->rxt22[i] = X(r2, t2);
+		s->axn1[i] = MatrixVector3Multiply(I1inv, s->rxn1[i]);
+		s->axn2[i] = MatrixVector3Multiply(I2inv, s->rxn2[i]);
+		s->axt11[i] = MatrixVector3Multiply(I1inv, s->rxt11[i]);
+		s->axt12[i] = MatrixVector3Multiply(I2inv, s->rxt12[i]);
+		s->axt21[i] = MatrixVector3Multiply(I1inv, s->rxt21[i]);
+		s->axt22[i] = MatrixVector3Multiply(I2inv, s->rxt22[i]);
+		s->kn[i] = rbp_effective_mass(minv, s->rxn1[i], s->axn1[i],
+		    s->rxn2[i], s->axn2[i]);
+		s->kt1[i] = rbp_effective_mass(minv, s->rxt11[i], s->axt11[i],
+		    s->rxt12[i], s->axt12[i]);
+		s->kt2[i] = rbp_effective_mass(minv, s->rxt21[i], s->axt21[i],
+		    s->rxt22[i], s->axt22[i]);
+
+		/* Restitution only applies to approaching bodies */
+		s->vn_target[i] = vrn < 0.0f ? -mat->e*vrn : 0.0f;
+		s->vb_target[i] = rbp_solver.baumgarte *
+		    fmaxf(c->depth - rbp_solver.slop, 0.0f) / dt;
+		s->uf_s[i] = mat->uf_s;
+		s->uf_d[i] = mat->uf_d;
+
+		s->jn[i] = 0.0f;
+		s->jt1[i] = 0.0f;
+		s->jt2[i] = 0.0f;
+		s->jb[i] = 0.0f;
+	}
+}
+
+/* Relative velocity of the bodies of a constraint row, given the linear
+ * direction d and the angular jacobians rx1 and rx2 */
+#define RBP_ROW_V(v1, w1, v2, w2, d, rx1, rx2) \
+	(DOT(Vector3Subtract(v2, v1), d) + DOT(w2, rx2) - DOT(w1, rx1))
+
+/* Applies impulse j along a constraint row to solver bodies sb1 and sb2 */
+#define RBP_ROW_APPLY(v1, w1, v2, w2, minv1, minv2, d, ax1, ax2, j) \
+	do { \
+		v1 = Vector3Subtract(v1, Vector3Scale(d, (j)*(minv1))); \
+		w1 = Vector3Subtract(w1, Vector3Scale(ax1, j)); \
+		v2 = Vector3Add(v2, Vector3Scale(d, (j)*(minv2))); \
+		w2 = Vector3Add(w2, Vector3Scale(ax2, j)); \
+	} while (0)
+
+/* One sequential impulse iteration over all the constraints in s */
+void
+rbp_solve_contacts(rbp_constraints *s)
+{
+	int i;
+
+	for (i = 0; i < s->n; i++) {
+		rbp_solver_body *sb1 = &s->bodies[s->b1[i]];
+		rbp_solver_body *sb2 = &s->bodies[s->b2[i]];
+		float j, old, vr;
+
+		/* Normal impulse, accumulated impulse is clamped to push only */
+		vr = RBP_ROW_V(sb1->v, sb1->w, sb2->v, sb2->w, s->cn[i],
+		    s->rxn1[i], s->rxn2[i]);
+		old = s->jn[i];
+		s->jn[i] = fmaxf(old + s->kn[i]*(s->vn_target[i] - vr), 0.0f);
+		j = s->jn[i] - old;
+		RBP_ROW_APPLY(sb1->v, sb1->w, sb2->v, sb2->w, sb1->minv,
+		    sb2->minv, s->cn[i], s->axn1[i], s->axn2[i], j);
+
+		/* Friction impulses: static friction holds while the impulse
+		 * is within uf_s*jn, otherwise the bodies slide with uf_d*jn */
+		float smax = s->uf_s[i]*s->jn[i];
+		float dmax = s->uf_d[i]*s->jn[i];
+
+		vr = RBP_ROW_V(sb1->v, sb1->w, sb2->v, sb2->w, s->t1[i],
+		    s->rxt11[i], s->rxt12[i]);
+		old = s->jt1[i];
+		s->jt1[i] = old - s->kt1[i]*vr;
+		if (fabsf(s->jt1[i]) > smax) {
+			s->jt1[i] = s->jt1[i] > 0.0f ? dmax : -dmax;
+		}
+		j = s->jt1[i] - old;
+		RBP_ROW_APPLY(sb1->v, sb1->w, sb2->v, sb2->w, sb1->minv,
+		    sb2->minv, s->t1[i], s->axt11[i], s->axt12[i], j);
+
+		vr = RBP_ROW_V(sb1->v, sb1->w, sb2->v, sb2->w, s->t2[i],
+		    s->rxt21[i], s->rxt22[i]);
+		old = s->jt2[i];
+		s->jt2[i] = old - s->kt2[i]*vr;
+		if (fabsf(s->jt2[i]) > smax) {
+			s->jt2[i] = s->jt2[i] > 0.0f ? dmax : -dmax;
+		}
+		j = s->jt2[i] - old;
+		RBP_ROW_APPLY(sb1->v, sb1->w, sb2->v, sb2->w, sb1->minv,
+		    sb2->minv, s->t2[i], s->axt21[i], s->axt22[i], j);
+
+		/* Position correction on the bias velocities (split impulse) */
+		vr = RBP_ROW_V(sb1->vb, sb1->wb, sb2->vb, sb2->wb, s->cn[i],
+		    s->rxn1[i], s->rxn2[i]);
+		old = s->jb[i];
+		s->jb[i] = fmaxf(old + s->kn[i]*(s->vb_target[i] - vr), 0.0f);
+		j = s->jb[i] - old;
+		RBP_ROW_APPLY(sb1->vb, sb1->wb, sb2->vb, sb2->wb, sb1->minv,
+		    sb2->minv, s->cn[i], s->axn1[i], s->axn2[i], j);
+	}
+}
+
+/* Writes the accumulated impulses of s back into the bodies */
+void
+rbp_finish_contacts(rbp_constraints *s, rbp_contact *contacts)
+{
+	int i;
+
+	for (i = 0; i < s->n; i++) {
+		rbp_body *b1 = contacts[i].b1;
+		rbp_body *b2 = contacts[i].b2;
+		Vector3 P = Vector3Add(Vector3Scale(s->cn[i], s->jn[i]),
+		    Vector3Add(Vector3Scale(s->t1[i], s->jt1[i]),
+		    Vector3Scale(s->t2[i], s->jt2[i])));
+
+		if (b1->minv != 0.0f) {
+			b1->p = Vector3Subtract(b1->p, P);
+			b1->L = Vector3Subtract(b1->L, X(s->r1[i], P));
+		}
+		if (b2->minv != 0.0f) {
+			b2->p = Vector3Add(b2->p, P);
+			b2->L = Vector3Add(b2->L, X(s->r2[i], P));
+		}
+	}
 
-	/* Adjust positions to eliminate penetration */
-	Vector3 ds1 = Vector3Scale(cn, -1.0f*depth*m1inv / minv);
-	Vector3 ds2 = Vector3Scale(cn, +1.0f*depth*m2inv / minv);
-	b1->pos = Vector3Add(b1->pos, ds1);
-	b2->pos = Vector3Add(b2->pos, ds2);
+	for (i = 0; i < s->nbodies; i++) {
+		s->bodies[i].b->vb = s->bodies[i].vb;
+		s->bodies[i].b->wb = s->bodies[i].wb;
+	}
+}
+
+/* Resolves n contacts together. The setup of every contact is done once,
+ * then iterations passes of sequential impulses are run over all of them,
+ * so contacts sharing bodies converge to a consistent solution. mem is
+ * scratch space of rbp_constraints_size(n) bytes, aligned for pointers,
+ * which keeps concurrent calls with their own mem apart. */
+void
+rbp_resolve_contacts(void *mem, rbp_contact *contacts, int n, int iterations,
+    float dt)
+{
+	rbp_constraints s;
+	int k;
+
+	rbp_constraints_layout(&s, mem, n);
+	rbp_prepare_contacts(&s, contacts, n, dt);
+	for (k = 0; k < iterations; k++) {
+		rbp_solve_contacts(&s);
+	}
+	rbp_finish_contacts(&s, contacts);
 }
 
+#include "rbp-prof.h"
+#include "rbp-arena.h"
+#include "rbp-world.h"
+#include "rbp-pool.h"
+#include "rbp-query.h"
+
 #undef NEG
 #undef DOT
 #undef X
\ No newline at end of file